@@ -3,8 +3,13 @@
 
 #include <fstream>
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <boost/filesystem.hpp>
+#if defined(__AVX2__) || defined(__AVX512F__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
 
 #include "Version.h"
 #include "Util.h"
@@ -63,6 +68,286 @@ namespace {
         out[2] = rho * sin(phi) * sin(theta);
     }
 
+    /** Convert float to IEEE float16 bits, rounding to nearest even */
+    inline uint16_t floatToHalf(float f) {
+#if defined(__F16C__)
+        return _cvtss_sh(f, 0);
+#else
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(float));
+        const uint32_t sign = (x >> 16) & 0x8000, absx = x & 0x7fffffff;
+        if (absx >= 0x47800000) {
+            // Too large, infinity or NaN
+            return sign | (absx > 0x7f800000 ? 0x7e00 : 0x7c00);
+        }
+        uint32_t result, rem, halfway;
+        if (absx < 0x38800000) {
+            // Subnormal in float16
+            if (absx < 0x33000000) return sign;
+            const int shift = 126 - static_cast<int>(absx >> 23);
+            const uint32_t mant = (absx & 0x7fffff) | 0x800000;
+            result = mant >> shift;
+            rem = mant & ((1u << shift) - 1);
+            halfway = 1u << (shift - 1);
+        } else {
+            result = (absx - 0x38000000) >> 13;
+            rem = absx & 0x1fff;
+            halfway = 0x1000;
+        }
+        if (rem > halfway || (rem == halfway && (result & 1))) ++result;
+        return sign | result;
+#endif
+    }
+
+    /** Convert IEEE float16 bits to float */
+    inline float halfToFloat(uint16_t h) {
+#if defined(__F16C__)
+        return _cvtsh_ss(h);
+#else
+        const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16,
+                       exponent = (h >> 10) & 0x1f, mant = h & 0x3ff;
+        if (exponent == 0) {
+            const float f = mant * (1.f / 16777216.f);
+            return sign ? -f : f;
+        }
+        uint32_t x = sign | (exponent == 0x1f ? 0x7f800000 | (mant << 13) :
+                ((exponent + 112) << 23) | (mant << 13));
+        float f;
+        std::memcpy(&f, &x, sizeof(float));
+        return f;
+#endif
+    }
+
+    inline float keyValue(float key) { return key; }
+    inline float keyValue(uint16_t key) { return halfToFloat(key); }
+
+    /** Add float16 shape basis 'keys' (rows, weights.size()) weighted by 'weights' to 'out'
+     *  (rows, a multiple of 16) */
+    void applyShapeKeysHalf(const uint16_t* keys, const Eigen::VectorXf& weights, Eigen::VectorXf& out) {
+        const int rows = static_cast<int>(out.size());
+        float* result = out.data();
+        for (int k = 0; k < weights.size(); ++k) {
+            const uint16_t* key = keys + static_cast<size_t>(k) * rows;
+            int i = 0;
+#if defined(__AVX512F__)
+            const __m512 wv = _mm512_set1_ps(weights(k));
+            for (; i + 16 <= rows; i += 16) {
+                __m512 v = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + i)));
+                _mm512_storeu_ps(result + i, _mm512_fmadd_ps(v, wv, _mm512_loadu_ps(result + i)));
+            }
+#elif defined(__AVX2__) && defined(__F16C__)
+            const __m256 wv = _mm256_set1_ps(weights(k));
+            for (; i + 8 <= rows; i += 8) {
+                __m256 v = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(key + i)));
+                _mm256_storeu_ps(result + i, _mm256_add_ps(_mm256_mul_ps(v, wv), _mm256_loadu_ps(result + i)));
+            }
+#endif
+            for (; i < rows; ++i) {
+                result[i] += halfToFloat(key[i]) * weights(k);
+            }
+        }
+    }
+
+    /** Linear blend skinning of points [begin, end) of x, y, z planes 'shaped'
+     *  (each num_padded long) into 'out' (3, num points). Each point's transform is the
+     *  weighted sum of the transforms of its assigned joints, which are stored as 12
+     *  columns (rotation in row-major order, then translation) of num_joints floats */
+    void skinPointsSoA(const float* shaped, const int* joints, const float* weights,
+            int num_influences, int num_padded, int begin, int end,
+            const float* transforms, int num_joints, double* out) {
+        const float* x = shaped, * y = shaped + num_padded, * z = shaped + 2 * num_padded;
+        int i = begin;
+#if defined(__AVX512F__)
+        alignas(64) float result[3][16];
+        for (; i < end; i += 16) {
+            const __m512 zero = _mm512_setzero_ps();
+            __m512 m[12];
+            for (int c = 0; c < 12; ++c) m[c] = zero;
+            for (int k = 0; k < num_influences; ++k) {
+                __m512 wk = _mm512_loadu_ps(weights + k * num_padded + i);
+                __mmask16 used = _mm512_cmp_ps_mask(wk, zero, _CMP_NEQ_OQ);
+                if (!used) continue;
+                __m512i jk = _mm512_loadu_si512(joints + k * num_padded + i);
+                for (int c = 0; c < 12; ++c) {
+                    m[c] = _mm512_fmadd_ps(wk, _mm512_mask_i32gather_ps(zero, used, jk,
+                                transforms + c * num_joints, 4), m[c]);
+                }
+            }
+            __m512 px = _mm512_loadu_ps(x + i), py = _mm512_loadu_ps(y + i),
+                   pz = _mm512_loadu_ps(z + i);
+            for (int d = 0; d < 3; ++d) {
+                _mm512_store_ps(result[d], _mm512_fmadd_ps(m[3 * d], px,
+                            _mm512_fmadd_ps(m[3 * d + 1], py,
+                                _mm512_fmadd_ps(m[3 * d + 2], pz, m[9 + d]))));
+            }
+            for (int l = 0; l < 16 && i + l < end; ++l) {
+                double* pt = out + 3 * (i + l);
+                pt[0] = result[0][l]; pt[1] = result[1][l]; pt[2] = result[2][l];
+            }
+        }
+#elif defined(__AVX2__)
+        alignas(32) float result[3][8];
+        for (; i < end; i += 8) {
+            const __m256 zero = _mm256_setzero_ps();
+            __m256 m[12];
+            for (int c = 0; c < 12; ++c) m[c] = zero;
+            for (int k = 0; k < num_influences; ++k) {
+                __m256 wk = _mm256_loadu_ps(weights + k * num_padded + i);
+                __m256 used = _mm256_cmp_ps(wk, zero, _CMP_NEQ_OQ);
+                if (_mm256_testz_ps(used, used)) continue;
+                __m256i jk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                            joints + k * num_padded + i));
+                for (int c = 0; c < 12; ++c) {
+                    m[c] = _mm256_add_ps(m[c], _mm256_mul_ps(wk, _mm256_mask_i32gather_ps(zero,
+                                    transforms + c * num_joints, jk, used, 4)));
+                }
+            }
+            __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i),
+                   pz = _mm256_loadu_ps(z + i);
+            for (int d = 0; d < 3; ++d) {
+                _mm256_store_ps(result[d], _mm256_add_ps(
+                            _mm256_add_ps(_mm256_mul_ps(m[3 * d], px), _mm256_mul_ps(m[3 * d + 1], py)),
+                            _mm256_add_ps(_mm256_mul_ps(m[3 * d + 2], pz), m[9 + d])));
+            }
+            for (int l = 0; l < 8 && i + l < end; ++l) {
+                double* pt = out + 3 * (i + l);
+                pt[0] = result[0][l]; pt[1] = result[1][l]; pt[2] = result[2][l];
+            }
+        }
+#endif
+        for (; i < end; ++i) {
+            float m[12] = { 0.f };
+            for (int k = 0; k < num_influences; ++k) {
+                float wk = weights[k * num_padded + i];
+                if (wk == 0.f) continue;
+                const float* t = transforms + joints[k * num_padded + i];
+                for (int c = 0; c < 12; ++c) m[c] += wk * t[c * num_joints];
+            }
+            double* pt = out + 3 * i;
+            for (int d = 0; d < 3; ++d) {
+                pt[d] = m[3 * d] * x[i] + m[3 * d + 1] * y[i] + m[3 * d + 2] * z[i] + m[9 + d];
+            }
+        }
+    }
+
+    /** Shape keys and linear blend skinning of all points for SKIN_LANES avatars
+     *  at once, one avatar per lane. 'keys' is the shape basis (keyCloudsSoA or keyCloudsHalf).
+     *  Row i of 'weights' (shape basis column i) and 'transforms'
+     *  (entry i % 12 of joint i / 12, see skinPointsSoA) has lane values at
+     *  stride * i. out[l] is the (3, num points) output cloud of lane l, or null */
+    template<class KeyType>
+    void skinBatchSoA(const ark::AvatarModel& model, const KeyType* keys, const float* weights,
+            const float* transforms, int stride, double* const* out) {
+        const int SKIN_LANES = ark::AvatarBatch::SKIN_LANES;
+        const int nKeys = model.numShapeBasis(), nPadded = model.numPointsPadded;
+        // Results of TILE points, written out per avatar at once: lane values of
+        // coordinate d of the p-th point in the tile are at (3 * p + d) * SKIN_LANES
+        const int TILE = 16;
+        alignas(64) float tile[TILE * 3 * SKIN_LANES];
+        for (int pt = 0; pt < model.numPoints(); ++pt) {
+            float* result = tile + (pt % TILE) * 3 * SKIN_LANES;
+#if defined(__AVX512F__)
+            __m512 shaped[3], m[12];
+            for (int d = 0; d < 3; ++d) {
+                const int row = d * nPadded + pt;
+                shaped[d] = _mm512_set1_ps(model.baseCloudSoA(row));
+                for (int k = 0; k < nKeys; ++k) {
+                    shaped[d] = _mm512_fmadd_ps(_mm512_set1_ps(keyValue(keys[k * 3 * nPadded + row])),
+                            _mm512_loadu_ps(weights + k * stride), shaped[d]);
+                }
+            }
+            for (int c = 0; c < 12; ++c) m[c] = _mm512_setzero_ps();
+            for (int k = 0; k < model.maxInfluences; ++k) {
+                const float wk = model.skinWeights(k * nPadded + pt);
+                if (wk == 0.f) continue;
+                const __m512 wv = _mm512_set1_ps(wk);
+                const float* t = transforms + model.skinJoints(k * nPadded + pt) * 12 * stride;
+                for (int c = 0; c < 12; ++c) {
+                    m[c] = _mm512_fmadd_ps(wv, _mm512_loadu_ps(t + c * stride), m[c]);
+                }
+            }
+            for (int d = 0; d < 3; ++d) {
+                _mm512_store_ps(result + d * SKIN_LANES, _mm512_fmadd_ps(m[3 * d], shaped[0],
+                            _mm512_fmadd_ps(m[3 * d + 1], shaped[1],
+                                _mm512_fmadd_ps(m[3 * d + 2], shaped[2], m[9 + d]))));
+            }
+#elif defined(__AVX2__)
+            for (int h = 0; h < SKIN_LANES; h += 8) {
+                __m256 shaped[3], m[12];
+                for (int d = 0; d < 3; ++d) {
+                    const int row = d * nPadded + pt;
+                    shaped[d] = _mm256_set1_ps(model.baseCloudSoA(row));
+                    for (int k = 0; k < nKeys; ++k) {
+                        shaped[d] = _mm256_add_ps(shaped[d], _mm256_mul_ps(
+                                    _mm256_set1_ps(keyValue(keys[k * 3 * nPadded + row])),
+                                    _mm256_loadu_ps(weights + k * stride + h)));
+                    }
+                }
+                for (int c = 0; c < 12; ++c) m[c] = _mm256_setzero_ps();
+                for (int k = 0; k < model.maxInfluences; ++k) {
+                    const float wk = model.skinWeights(k * nPadded + pt);
+                    if (wk == 0.f) continue;
+                    const __m256 wv = _mm256_set1_ps(wk);
+                    const float* t = transforms + model.skinJoints(k * nPadded + pt) * 12 * stride + h;
+                    for (int c = 0; c < 12; ++c) {
+                        m[c] = _mm256_add_ps(m[c], _mm256_mul_ps(wv, _mm256_loadu_ps(t + c * stride)));
+                    }
+                }
+                for (int d = 0; d < 3; ++d) {
+                    _mm256_store_ps(result + d * SKIN_LANES + h, _mm256_add_ps(
+                                _mm256_add_ps(_mm256_mul_ps(m[3 * d], shaped[0]), _mm256_mul_ps(m[3 * d + 1], shaped[1])),
+                                _mm256_add_ps(_mm256_mul_ps(m[3 * d + 2], shaped[2]), m[9 + d])));
+                }
+            }
+#else
+            float shaped[3][SKIN_LANES], m[12][SKIN_LANES] = {{ 0.f }};
+            for (int d = 0; d < 3; ++d) {
+                const int row = d * nPadded + pt;
+                for (int l = 0; l < SKIN_LANES; ++l) shaped[d][l] = model.baseCloudSoA(row);
+                for (int k = 0; k < nKeys; ++k) {
+                    const float key = keyValue(keys[k * 3 * nPadded + row]);
+                    for (int l = 0; l < SKIN_LANES; ++l) shaped[d][l] += key * weights[k * stride + l];
+                }
+            }
+            for (int k = 0; k < model.maxInfluences; ++k) {
+                const float wk = model.skinWeights(k * nPadded + pt);
+                if (wk == 0.f) continue;
+                const float* t = transforms + model.skinJoints(k * nPadded + pt) * 12 * stride;
+                for (int c = 0; c < 12; ++c) {
+                    for (int l = 0; l < SKIN_LANES; ++l) m[c][l] += wk * t[c * stride + l];
+                }
+            }
+            for (int d = 0; d < 3; ++d) {
+                for (int l = 0; l < SKIN_LANES; ++l) {
+                    result[d * SKIN_LANES + l] = m[3 * d][l] * shaped[0][l] + m[3 * d + 1][l] * shaped[1][l] +
+                        m[3 * d + 2][l] * shaped[2][l] + m[9 + d][l];
+                }
+            }
+#endif
+            if (pt % TILE != TILE - 1 && pt != model.numPoints() - 1) continue;
+
+            const int tileStart = pt / TILE * TILE, tileSize = 3 * (pt - tileStart + 1);
+            for (int l = 0; l < SKIN_LANES; ++l) {
+                if (out[l] == nullptr) break;
+                double* dst = out[l] + 3 * tileStart;
+                int i = 0;
+#if defined(__AVX512F__)
+                const __m512i idx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                            8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(SKIN_LANES));
+                for (; i + 16 <= tileSize; i += 16) {
+                    __m512 v = _mm512_i32gather_ps(idx, tile + i * SKIN_LANES + l, 4);
+                    _mm512_storeu_pd(dst + i, _mm512_cvtps_pd(_mm512_castps512_ps256(v)));
+                    _mm512_storeu_pd(dst + i + 8, _mm512_cvtps_pd(
+                                _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1))));
+                }
+#endif
+                for (; i < tileSize; ++i) {
+                    dst[i] = tile[i * SKIN_LANES + l];
+                }
+            }
+        }
+    }
+
     /** Paint projected triangle on depth map using barycentric linear interp */
     template<class T>
     inline void paintTriangleBary(
@@ -311,12 +596,128 @@ namespace {
             }
         }
     }
+
+    /** Header of binary avatar model bundle, see AvatarModel::exportBundle.
+     *  The sections in BundleSection follow, at cache line aligned offsets */
+    struct BundleHeader {
+        char marker[4];
+        uint32_t version;
+        int32_t numJoints, numPoints, numShapeKeys, numFaces;
+        // Total point-joint assignments; nonzeros of joint regressor
+        int32_t numAssignments, numRegressorEntries;
+        // Shape keys of joint shape regressor, -1 if the joint regressor is used instead
+        int32_t numRegressorKeys;
+        // Pose prior components (-1 if there is no pose prior) and dimensions
+        int32_t numPriorComps, numPriorDims;
+        // Shape key compression, see AvatarModel::compressShapeKeys:
+        // PCA rank (0 if uncompressed) and BUNDLE_HALF_SHAPE_KEYS flag
+        int32_t shapeKeyRank;
+        uint32_t flags;
+        uint32_t reserved;
+        uint64_t fileSize;
+    };
+    static_assert(sizeof(BundleHeader) == 64, "BundleHeader must not be padded");
+
+    /** Version of avatar model bundle format */
+    const uint32_t BUNDLE_FORMAT_VERSION = 2;
+
+    /** BundleHeader flag: skinning shape basis is stored as float16 */
+    const uint32_t BUNDLE_HALF_SHAPE_KEYS = 1;
+
+    const size_t CACHE_LINE = 64;
+
+    enum BundleSection {
+        BUNDLE_PARENT, BUNDLE_JOINT_POS, BUNDLE_BASE_CLOUD, BUNDLE_KEY_CLOUDS,
+        // Number of assignments of each point, then their joints and weights
+        BUNDLE_ASSIGN_COUNTS, BUNDLE_ASSIGN_JOINTS, BUNDLE_ASSIGN_WEIGHTS,
+        // Joint regressor in compressed column storage
+        BUNDLE_REG_OUTER, BUNDLE_REG_INNER, BUNDLE_REG_VALUES,
+        BUNDLE_SHAPE_REG_BASE, BUNDLE_SHAPE_REG,
+        BUNDLE_PRIOR_WEIGHT, BUNDLE_PRIOR_MEAN, BUNDLE_PRIOR_COV,
+        BUNDLE_MESH,
+        _BUNDLE_SECTION_COUNT
+    };
+
+    inline size_t alignUp(size_t x, size_t alignment) {
+        return (x + alignment - 1) / alignment * alignment;
+    }
+
+    /** Compute byte offsets of sections of a bundle with 'header'
+     *  (counts must be validated), returns file size */
+    size_t bundleLayout(const BundleHeader& header, size_t offsets[_BUNDLE_SECTION_COUNT]) {
+        const size_t nJ = header.numJoints, nP = header.numPoints, nK = header.numShapeKeys,
+                     nA = header.numAssignments;
+        const bool shapeReg = header.numRegressorKeys >= 0;
+        const size_t nR = shapeReg ? 0 : header.numRegressorEntries,
+                     nRK = shapeReg ? header.numRegressorKeys : 0;
+        const size_t nC = std::max(header.numPriorComps, 0), nD = header.numPriorDims;
+        const size_t sizes[_BUNDLE_SECTION_COUNT] = {
+            sizeof(int32_t) * nJ, sizeof(double) * 3 * nJ, sizeof(double) * 3 * nP,
+            sizeof(double) * 3 * nP * nK,
+            sizeof(int32_t) * nP, sizeof(int32_t) * nA, sizeof(double) * nA,
+            shapeReg ? 0 : sizeof(int32_t) * (nJ + 1), sizeof(int32_t) * nR, sizeof(double) * nR,
+            shapeReg ? sizeof(double) * 3 * nJ : 0, sizeof(double) * 3 * nJ * nRK,
+            sizeof(double) * nC, sizeof(double) * nC * nD, sizeof(double) * nC * nD * nD,
+            sizeof(int32_t) * 3 * header.numFaces
+        };
+        size_t offset = alignUp(sizeof(BundleHeader), CACHE_LINE);
+        for (int i = 0; i < _BUNDLE_SECTION_COUNT; ++i) {
+            offsets[i] = offset;
+            offset = alignUp(offset + sizes[i], CACHE_LINE);
+        }
+        return offset;
+    }
+
+    template<class T>
+    inline void writeSection(char* data, size_t offset, const T* src, size_t count) {
+        if (count) std::memcpy(data + offset, src, sizeof(T) * count);
+    }
+
+    template<class T>
+    inline void readSection(const char* data, size_t offset, T* dst, size_t count) {
+        if (count) std::memcpy(dst, data + offset, sizeof(T) * count);
+    }
 }
 
 namespace ark {
-    AvatarModel::AvatarModel(const std::string & model_dir, bool limit_one_joint_per_point) : MODEL_DIR(model_dir) {
+    AvatarModel::AvatarModel(const std::string & model_dir, bool limit_one_joint_per_point, bool use_bundle) : MODEL_DIR(model_dir) {
         using namespace boost::filesystem;
         path modelPath = model_dir.empty() ? util::resolveRootPath("data/avatar-model") : model_dir;
+        path bundlePath = modelPath / "model.bundle";
+        bool loaded = false;
+        if (use_bundle && exists(bundlePath)) {
+            // Ignore bundles compiled before the model files were last changed
+            std::time_t bundleTime = last_write_time(bundlePath);
+            std::vector<path> sourcePaths;
+            for (const char* name : { "model.pcd", "skeleton.txt", "joint_regressor.txt",
+                    "joint_shape_regressor.txt", "pose_prior.txt", "mesh.txt", "shapekey" }) {
+                sourcePaths.push_back(modelPath / name);
+            }
+            // The directory changes when keys are added or removed, but not
+            // when a key is edited in place, so also check each key file
+            if (is_directory(modelPath / "shapekey")) {
+                sourcePaths.insert(sourcePaths.end(), directory_iterator(modelPath / "shapekey"),
+                        directory_iterator{});
+            }
+            bool upToDate = true;
+            for (const path& sourcePath : sourcePaths) {
+                if (exists(sourcePath) && last_write_time(sourcePath) > bundleTime) upToDate = false;
+            }
+            if (!upToDate) {
+                std::cerr << "WARNING: avatar model bundle " << bundlePath.string()
+                          << " is older than the model files, ignoring it (re-run smplbundle)\n";
+            } else {
+                loaded = loadBundle(bundlePath.string());
+            }
+        }
+        if (!loaded) loadText(modelPath.string());
+        setupAssignments(limit_one_joint_per_point);
+        prepareSkinning();
+    }
+
+    void AvatarModel::loadText(const std::string & model_dir) {
+        using namespace boost::filesystem;
+        path modelPath = model_dir;
         path skelPath = modelPath / "skeleton.txt";
         path jrPath = modelPath / "joint_regressor.txt";
         path jsrPath = modelPath / "joint_shape_regressor.txt";
@@ -353,12 +754,7 @@ namespace ark {
             std::exit(0);
         }
 
-        // Process joint assignments
-        assignedPoints.resize(nJoints);
-        for (int i = 0; i < nJoints; ++i) {
-            assignedPoints[i].reserve(7000 / nJoints);
-        }
-        size_t totalAssignments = 0;
+        // Read joint assignments
         assignedJoints.resize(nPoints);
         for (int i = 0; i < nPoints; ++i) {
             int nEntries; skel >> nEntries;
@@ -371,46 +767,17 @@ namespace ark {
             std::sort(assignedJoints[i].begin(), assignedJoints[i].end(), [](const std::pair<double, int>& a, const std::pair<double, int>& b) {
                         return a.first > b.first;
                     });
-            if (limit_one_joint_per_point) {
-                assignedJoints[i].resize(1);
-                assignedJoints[i].shrink_to_fit();
-                assignedJoints[i][0].first = 1.0;
-                assignedPoints[assignedJoints[i][0].second]
-                    .emplace_back(1.0, i);
-            } else {
-                for (int j = 0; j < nEntries; ++j) {
-                    assignedPoints[assignedJoints[i][j].second]
-                        .emplace_back(assignedJoints[i][j].first, i);
-                }
-            }
-            totalAssignments += assignedJoints[i].size();
         }
 
-        size_t totalPoints = 0;
-        assignStarts.resize(nJoints+1);
-        assignWeights = Eigen::SparseMatrix<double>(totalAssignments, nPoints);
-        assignWeights.reserve(Eigen::VectorXi::Constant(nPoints, 4));
-        for (int i = 0; i < nJoints; ++i) {
-            assignStarts[i] = totalPoints;
-            for (auto& assignment : assignedPoints[i]) {
-                int p = assignment.second;
-                assignWeights.insert(totalPoints, p) = assignment.first;
-                ++totalPoints;
-            }
-        }
-        assignStarts[nJoints] = totalPoints;
-
         // Load all shape keys
         path keyPath = modelPath / "shapekey";
         if (is_directory(keyPath)) {
-            int nShapeKeys = 0;
-            for (directory_iterator it(keyPath); it != directory_iterator(); ++it) ++nShapeKeys;
-            keyClouds.resize(3 * nPoints, nShapeKeys);
-
-            int i = 0;
-            for (directory_iterator it(keyPath); it != directory_iterator(); ++it) {
-                keyClouds.col(i) = loadPCDToPointVectorFast(it->path().string());
-                ++i;
+            // Sorted by name, so that shape key order does not depend on the file system
+            std::vector<path> keyFiles(directory_iterator(keyPath), directory_iterator{});
+            std::sort(keyFiles.begin(), keyFiles.end());
+            keyClouds.resize(3 * nPoints, keyFiles.size());
+            for (size_t i = 0; i < keyFiles.size(); ++i) {
+                keyClouds.col(i) = loadPCDToPointVectorFast(keyFiles[i].string());
             }
         } else {
             std::cerr << "WARNING: no shape key directory found for avatar\n";
@@ -472,6 +839,328 @@ namespace ark {
         }
     }
 
+    bool AvatarModel::exportBundle(const std::string & path) const {
+        const int nJoints = numJoints(), nPoints = static_cast<int>(assignedJoints.size());
+        if (baseCloud.size() != 3 * nPoints || (numShapeKeys() > 0 && keyClouds.rows() != 3 * nPoints)) {
+            std::cerr << "ERROR: avatar model point cloud sizes are inconsistent with skeleton, cannot export bundle\n";
+            return false;
+        }
+        BundleHeader header;
+        std::memcpy(header.marker, "AVB", 4);
+        header.version = BUNDLE_FORMAT_VERSION;
+        header.numJoints = nJoints;
+        header.numPoints = nPoints;
+        header.numShapeKeys = numShapeKeys();
+        header.numFaces = numFaces();
+        header.numAssignments = 0;
+        for (auto& assignments : assignedJoints) header.numAssignments += assignments.size();
+        Eigen::SparseMatrix<double> regressor;
+        if (useJointShapeRegressor) {
+            header.numRegressorEntries = 0;
+            header.numRegressorKeys = jointShapeReg.cols();
+        } else {
+            regressor = jointRegressor;
+            regressor.conservativeResize(nPoints, nJoints);
+            regressor.makeCompressed();
+            header.numRegressorEntries = regressor.nonZeros();
+            header.numRegressorKeys = -1;
+        }
+        header.numPriorComps = hasPosePrior() ? posePrior.nComps : -1;
+        header.numPriorDims = hasPosePrior() ? posePrior.nDims : 0;
+        header.shapeKeyRank = shapeKeyRank;
+        header.flags = halfShapeKeys ? BUNDLE_HALF_SHAPE_KEYS : 0;
+        header.reserved = 0;
+        size_t offsets[_BUNDLE_SECTION_COUNT];
+        header.fileSize = bundleLayout(header, offsets);
+
+        std::vector<char> data(header.fileSize, 0);
+        char* ptr = data.data();
+        std::memcpy(ptr, &header, sizeof(BundleHeader));
+        writeSection(ptr, offsets[BUNDLE_PARENT], parent.data(), nJoints);
+        writeSection(ptr, offsets[BUNDLE_JOINT_POS], initialJointPos.data(), 3 * nJoints);
+        writeSection(ptr, offsets[BUNDLE_BASE_CLOUD], baseCloud.data(), 3 * nPoints);
+        writeSection(ptr, offsets[BUNDLE_KEY_CLOUDS], keyClouds.data(), keyClouds.size());
+        size_t assignIdx = 0;
+        for (int i = 0; i < nPoints; ++i) {
+            int32_t count = assignedJoints[i].size();
+            writeSection(ptr, offsets[BUNDLE_ASSIGN_COUNTS] + sizeof(int32_t) * i, &count, 1);
+            for (auto& assignment : assignedJoints[i]) {
+                writeSection(ptr, offsets[BUNDLE_ASSIGN_JOINTS] + sizeof(int32_t) * assignIdx,
+                        &assignment.second, 1);
+                writeSection(ptr, offsets[BUNDLE_ASSIGN_WEIGHTS] + sizeof(double) * assignIdx,
+                        &assignment.first, 1);
+                ++assignIdx;
+            }
+        }
+        if (useJointShapeRegressor) {
+            writeSection(ptr, offsets[BUNDLE_SHAPE_REG_BASE], jointShapeRegBase.data(), 3 * nJoints);
+            writeSection(ptr, offsets[BUNDLE_SHAPE_REG], jointShapeReg.data(), jointShapeReg.size());
+        } else {
+            writeSection(ptr, offsets[BUNDLE_REG_OUTER], regressor.outerIndexPtr(), nJoints + 1);
+            writeSection(ptr, offsets[BUNDLE_REG_INNER], regressor.innerIndexPtr(), regressor.nonZeros());
+            writeSection(ptr, offsets[BUNDLE_REG_VALUES], regressor.valuePtr(), regressor.nonZeros());
+        }
+        if (hasPosePrior()) {
+            const int nComps = posePrior.nComps, nDims = posePrior.nDims;
+            writeSection(ptr, offsets[BUNDLE_PRIOR_WEIGHT], posePrior.weight.data(), nComps);
+            writeSection(ptr, offsets[BUNDLE_PRIOR_MEAN], posePrior.mean.data(), nComps * nDims);
+            for (int i = 0; i < nComps; ++i) {
+                writeSection(ptr, offsets[BUNDLE_PRIOR_COV] + sizeof(double) * nDims * nDims * i,
+                        posePrior.cov[i].data(), nDims * nDims);
+            }
+        }
+        writeSection(ptr, offsets[BUNDLE_MESH], mesh.data(), mesh.size());
+
+        std::ofstream ofs(path, std::ios::out | std::ios::binary);
+        if (!ofs) return false;
+        ofs.write(data.data(), data.size());
+        ofs.close();
+        return static_cast<bool>(ofs);
+    }
+
+    bool AvatarModel::loadBundle(const std::string & path) {
+        // Read in one piece and copy each section into place, no parsing
+        std::ifstream ifs(path, std::ios::in | std::ios::binary | std::ios::ate);
+        if (!ifs) {
+            std::cerr << "WARNING: failed to open avatar model bundle " << path << ", loading model files instead\n";
+            return false;
+        }
+        size_t fileSize = static_cast<size_t>(ifs.tellg());
+        ifs.seekg(0);
+        std::vector<char> buffer(fileSize);
+        if (fileSize < sizeof(BundleHeader) || !ifs.read(buffer.data(), fileSize)) {
+            std::cerr << "WARNING: failed to read avatar model bundle " << path << ", loading model files instead\n";
+            return false;
+        }
+        const char* data = buffer.data();
+
+        BundleHeader header;
+        readSection(data, 0, &header, 1);
+        size_t offsets[_BUNDLE_SECTION_COUNT];
+        if (std::memcmp(header.marker, "AVB", 4) != 0 || header.version != BUNDLE_FORMAT_VERSION ||
+                header.numJoints <= 0 || header.numPoints < 0 || header.numShapeKeys < 0 ||
+                header.numFaces < 0 || header.numAssignments < 0 || header.numRegressorEntries < 0 ||
+                header.numRegressorKeys < -1 || header.numPriorComps < -1 || header.numPriorDims < 0 ||
+                header.shapeKeyRank < 0 || header.fileSize != fileSize || bundleLayout(header, offsets) != fileSize) {
+            std::cerr << "WARNING: avatar model bundle " << path << " is corrupted or has unsupported version, "
+                         "loading model files instead\n";
+            return false;
+        }
+        const int nJoints = header.numJoints, nPoints = header.numPoints,
+                  nShapeKeys = header.numShapeKeys;
+
+        // Check indices first, since setupAssignments and Avatar index by them:
+        // joints of assignments, parents (joint 0 is root and each parent
+        // precedes its children), points of joint regressor entries and of
+        // mesh faces
+        std::vector<int32_t> counts(nPoints), joints(header.numAssignments), parents(nJoints);
+        readSection(data, offsets[BUNDLE_ASSIGN_COUNTS], counts.data(), nPoints);
+        readSection(data, offsets[BUNDLE_ASSIGN_JOINTS], joints.data(), joints.size());
+        readSection(data, offsets[BUNDLE_PARENT], parents.data(), nJoints);
+        int64_t totalAssignments = 0;
+        bool valid = true;
+        for (int32_t count : counts) {
+            valid = valid && count >= 0;
+            totalAssignments += std::max(count, 0);
+        }
+        valid = valid && totalAssignments == header.numAssignments;
+        for (int32_t joint : joints) valid = valid && joint >= 0 && joint < nJoints;
+        valid = valid && parents[0] == -1;
+        for (int i = 1; i < nJoints; ++i) valid = valid && parents[i] >= 0 && parents[i] < i;
+        std::vector<int32_t> regOuter, regInner;
+        if (header.numRegressorKeys < 0) {
+            regOuter.resize(nJoints + 1);
+            regInner.resize(header.numRegressorEntries);
+            readSection(data, offsets[BUNDLE_REG_OUTER], regOuter.data(), regOuter.size());
+            readSection(data, offsets[BUNDLE_REG_INNER], regInner.data(), regInner.size());
+            valid = valid && regOuter[0] == 0 && regOuter[nJoints] == header.numRegressorEntries;
+            for (int i = 0; i < nJoints; ++i) valid = valid && regOuter[i] <= regOuter[i + 1];
+            for (int32_t point : regInner) valid = valid && point >= 0 && point < nPoints;
+        }
+        MeshType faces(3, header.numFaces);
+        readSection(data, offsets[BUNDLE_MESH], faces.data(), faces.size());
+        valid = valid && (faces.size() == 0 || (faces.minCoeff() >= 0 && faces.maxCoeff() < nPoints));
+        if (!valid) {
+            std::cerr << "WARNING: avatar model bundle " << path << " has invalid joint assignments, "
+                         "parents, regressor or mesh, loading model files instead\n";
+            return false;
+        }
+        assignedJoints.resize(nPoints);
+        size_t assignIdx = 0;
+        for (int i = 0; i < nPoints; ++i) {
+            assignedJoints[i].resize(counts[i]);
+            for (auto& assignment : assignedJoints[i]) {
+                readSection(data, offsets[BUNDLE_ASSIGN_WEIGHTS] + sizeof(double) * assignIdx,
+                        &assignment.first, 1);
+                assignment.second = joints[assignIdx];
+                ++assignIdx;
+            }
+        }
+
+        parent = Eigen::Map<Eigen::VectorXi>(parents.data(), nJoints);
+        initialJointPos.resize(3, nJoints);
+        readSection(data, offsets[BUNDLE_JOINT_POS], initialJointPos.data(), 3 * nJoints);
+        baseCloud.resize(3 * nPoints);
+        readSection(data, offsets[BUNDLE_BASE_CLOUD], baseCloud.data(), 3 * nPoints);
+        if (nShapeKeys > 0) {
+            keyClouds.resize(3 * nPoints, nShapeKeys);
+            readSection(data, offsets[BUNDLE_KEY_CLOUDS], keyClouds.data(), keyClouds.size());
+        }
+
+        useJointShapeRegressor = header.numRegressorKeys >= 0;
+        if (useJointShapeRegressor) {
+            jointShapeRegBase.resize(3 * nJoints);
+            readSection(data, offsets[BUNDLE_SHAPE_REG_BASE], jointShapeRegBase.data(), 3 * nJoints);
+            jointShapeReg.resize(3 * nJoints, header.numRegressorKeys);
+            readSection(data, offsets[BUNDLE_SHAPE_REG], jointShapeReg.data(), jointShapeReg.size());
+        } else {
+            jointRegressor.resize(nPoints, nJoints);
+            jointRegressor.resizeNonZeros(header.numRegressorEntries);
+            std::copy(regOuter.begin(), regOuter.end(), jointRegressor.outerIndexPtr());
+            std::copy(regInner.begin(), regInner.end(), jointRegressor.innerIndexPtr());
+            readSection(data, offsets[BUNDLE_REG_VALUES], jointRegressor.valuePtr(),
+                    header.numRegressorEntries);
+        }
+
+        posePrior.nComps = header.numPriorComps;
+        if (hasPosePrior()) {
+            const int nComps = header.numPriorComps, nDims = header.numPriorDims;
+            posePrior.nDims = nDims;
+            posePrior.weight.resize(nComps);
+            readSection(data, offsets[BUNDLE_PRIOR_WEIGHT], posePrior.weight.data(), nComps);
+            posePrior.mean.resize(nComps, nDims);
+            readSection(data, offsets[BUNDLE_PRIOR_MEAN], posePrior.mean.data(), nComps * nDims);
+            posePrior.cov.resize(nComps);
+            for (int i = 0; i < nComps; ++i) {
+                posePrior.cov[i].resize(nDims, nDims);
+                readSection(data, offsets[BUNDLE_PRIOR_COV] + sizeof(double) * nDims * nDims * i,
+                        posePrior.cov[i].data(), nDims * nDims);
+            }
+            posePrior.init();
+        }
+
+        mesh = std::move(faces);
+
+        // Applied by prepareSkinning; keyClouds are already the compressed approximation
+        shapeKeyRank = header.shapeKeyRank < nShapeKeys ? header.shapeKeyRank : 0;
+        halfShapeKeys = (header.flags & BUNDLE_HALF_SHAPE_KEYS) != 0;
+        return true;
+    }
+
+    void AvatarModel::setupAssignments(bool limit_one_joint_per_point) {
+        const int nJoints = numJoints();
+        const int nPoints = static_cast<int>(assignedJoints.size());
+        assignedPoints.assign(nJoints, std::vector<std::pair<double, int> >());
+        for (int i = 0; i < nJoints; ++i) {
+            assignedPoints[i].reserve(7000 / nJoints);
+        }
+        size_t totalAssignments = 0;
+        for (int i = 0; i < nPoints; ++i) {
+            if (limit_one_joint_per_point) {
+                assignedJoints[i].resize(1);
+                assignedJoints[i].shrink_to_fit();
+                assignedJoints[i][0].first = 1.0;
+            }
+            for (auto& assignment : assignedJoints[i]) {
+                assignedPoints[assignment.second].emplace_back(assignment.first, i);
+            }
+            totalAssignments += assignedJoints[i].size();
+        }
+
+        size_t totalPoints = 0;
+        assignStarts.resize(nJoints+1);
+        assignWeights = Eigen::SparseMatrix<double>(totalAssignments, nPoints);
+        assignWeights.reserve(Eigen::VectorXi::Constant(nPoints, 4));
+        for (int i = 0; i < nJoints; ++i) {
+            assignStarts[i] = totalPoints;
+            for (auto& assignment : assignedPoints[i]) {
+                int p = assignment.second;
+                assignWeights.insert(totalPoints, p) = assignment.first;
+                ++totalPoints;
+            }
+        }
+        assignStarts[nJoints] = totalPoints;
+    }
+
+    void AvatarModel::prepareSkinning() {
+        const int nPoints = numPoints();
+        numPointsPadded = (nPoints + 15) / 16 * 16;
+        baseCloudSoA.setZero(3 * numPointsPadded);
+        // Shape basis: truncated PCA of the shape keys if compressed (keyClouds = basis * shapeBasisCoeffs)
+        MatrixType basis;
+        shapeBasisCoeffs.resize(0, 0);
+        if (shapeKeyRank > 0 && shapeKeyRank < numShapeKeys()) {
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(keyClouds.transpose() * keyClouds);
+            // Eigenvalues are in ascending order
+            shapeBasisCoeffs = eigen.eigenvectors().rightCols(shapeKeyRank).rowwise().reverse().transpose();
+            basis.noalias() = keyClouds * shapeBasisCoeffs.transpose();
+        }
+        const MatrixType& keys = shapeBasisCoeffs.size() ? basis : keyClouds;
+        keyCloudsSoA.setZero(3 * numPointsPadded, numShapeBasis());
+        const bool hasKeys = keys.rows() == 3 * nPoints;
+        for (int i = 0; i < nPoints; ++i) {
+            for (int d = 0; d < 3; ++d) {
+                baseCloudSoA(d * numPointsPadded + i) = static_cast<float>(baseCloud(3 * i + d));
+                if (hasKeys) {
+                    keyCloudsSoA.row(d * numPointsPadded + i) = keys.row(3 * i + d).cast<float>();
+                }
+            }
+        }
+        keyCloudsHalf.clear();
+        if (halfShapeKeys && keyCloudsSoA.size() > 0) {
+            keyCloudsHalf.resize(keyCloudsSoA.size());
+            for (size_t i = 0; i < keyCloudsHalf.size(); ++i) {
+                keyCloudsHalf[i] = floatToHalf(keyCloudsSoA.data()[i]);
+            }
+            keyCloudsSoA.resize(3 * numPointsPadded, 0);
+        }
+
+        maxInfluences = 0;
+        for (int i = 0; i < nPoints; ++i) {
+            maxInfluences = std::max(maxInfluences, static_cast<int>(assignedJoints[i].size()));
+        }
+        skinJoints.setZero(maxInfluences * numPointsPadded);
+        skinWeights.setZero(maxInfluences * numPointsPadded);
+        std::vector<std::pair<double, int> > sorted;
+        for (int i = 0; i < nPoints; ++i) {
+            // assignedJoints may have been modified since loading
+            sorted = assignedJoints[i];
+            std::sort(sorted.begin(), sorted.end(), [](const std::pair<double, int>& a, const std::pair<double, int>& b) {
+                        return a.first > b.first;
+                    });
+            for (size_t k = 0; k < sorted.size(); ++k) {
+                skinJoints(k * numPointsPadded + i) = sorted[k].second;
+                skinWeights(k * numPointsPadded + i) = static_cast<float>(sorted[k].first);
+            }
+        }
+
+        skinGroupJoints.clear();
+        if (numJoints() <= 64) {
+            skinGroupJoints.resize(numPointsPadded / 16);
+            for (int i = 0; i < nPoints; ++i) {
+                for (auto& assignment : assignedJoints[i]) {
+                    skinGroupJoints[i / 16] |= uint64_t(1) << assignment.second;
+                }
+            }
+        }
+    }
+
+    void AvatarModel::compressShapeKeys(int rank, bool half_precision) {
+        shapeKeyRank = rank > 0 && rank < numShapeKeys() ? rank : 0;
+        halfShapeKeys = half_precision;
+        if (shapeKeyRank > 0) {
+            // Project onto the top right singular vectors, i.e. truncated SVD
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(keyClouds.transpose() * keyClouds);
+            Eigen::MatrixXd top = eigen.eigenvectors().rightCols(shapeKeyRank);
+            keyClouds = keyClouds * top * top.transpose();
+            if (useJointShapeRegressor && jointShapeReg.cols() == numShapeKeys()) {
+                // Joints must move with the approximated shape, not the original
+                jointShapeReg = jointShapeReg * top * top.transpose();
+            }
+        }
+        prepareSkinning();
+    }
+
     Eigen::VectorXd AvatarPoseSequence::getFrame(size_t frame_id) const {
         if (preloaded) return data.col(frame_id);
         std::ifstream ifs(sequencePath, std::ios::in | std::ios::binary);
@@ -483,7 +1172,6 @@ namespace ark {
     }
 
     Avatar::Avatar(const AvatarModel& model) : model(model) {
-        assignVecs.resize(3, model.assignWeights.rows());
         w.resize(model.numShapeKeys());
         r.resize(model.numJoints());
         w.setZero();
@@ -494,54 +1182,226 @@ namespace ark {
     }
 
     void Avatar::update() {
+        const bool soa = fastSkinning && model.numPointsPadded > 0;
+        const int nJoints = model.numJoints();
 
-        /** Apply shape keys */
-        shapedCloudVec.noalias() = model.keyClouds * w + model.baseCloud;
-        Eigen::Map<CloudType> shapedCloud(shapedCloudVec.data(), 3, model.numPoints());
+        /** Find joints whose transform changed since the last update */
+        const bool shapeDirty = !updated || soa != lastFastSkinning || w != lastW;
+        jointDirty.assign(nJoints, shapeDirty);
+        bool anyDirty = shapeDirty;
+        for (int i = 0; i < nJoints; ++i) {
+            if (!jointDirty[i] && (r[i] != lastR[i] ||
+                        (i == 0 ? p != lastP : jointDirty[model.parent[i]]))) {
+                jointDirty[i] = anyDirty = true;
+            }
+        }
+        if (!anyDirty) return;
+        lastW = w; lastR = r; lastP = p;
+        lastFastSkinning = soa;
+        updated = true;
+
+        if (shapeDirty) {
+            /** Apply shape keys */
+            if (soa) {
+                const Eigen::VectorXf basisWeights = model.shapeBasisCoeffs.size() ?
+                    Eigen::VectorXf((model.shapeBasisCoeffs * w).cast<float>()) : Eigen::VectorXf(w.cast<float>());
+                if (model.keyCloudsHalf.empty()) {
+                    shapedCloudSoA.noalias() = model.keyCloudsSoA * basisWeights;
+                    shapedCloudSoA += model.baseCloudSoA;
+                } else {
+                    shapedCloudSoA = model.baseCloudSoA;
+                    applyShapeKeysHalf(model.keyCloudsHalf.data(), basisWeights, shapedCloudSoA);
+                }
+            } else {
+                shapedCloudVec.noalias() = model.keyClouds * w + model.baseCloud;
+            }
+            // Shaped cloud as 3 x num points, valid only if !soa
+            const Eigen::Map<const CloudType> shapedCloud(shapedCloudVec.data(), 3, soa ? 0 : model.numPoints());
+
+            /** Apply joint [shape] regressor */
+            if (model.useJointShapeRegressor) {
+                restJointPos.resize(3, nJoints);
+                Eigen::Map<Eigen::VectorXd> jointPosVec(restJointPos.data(), 3 * nJoints);
+                jointPosVec.noalias() = model.jointShapeRegBase + model.jointShapeReg * w;
+            } else if (soa) {
+                restJointPos.setZero(3, nJoints);
+                for (int i = 0; i < nJoints; ++i) {
+                    for (Eigen::SparseMatrix<double>::InnerIterator it(model.jointRegressor, i); it; ++it) {
+                        for (int d = 0; d < 3; ++d) {
+                            restJointPos(d, i) += it.value() * shapedCloudSoA(d * model.numPointsPadded + it.row());
+                        }
+                    }
+                }
+            } else {
+                restJointPos.noalias() = shapedCloud * model.jointRegressor;
+            }
 
-        /** Apply joint [shape] regressor */
-        if (model.useJointShapeRegressor) {
-            jointPos.resize(3, model.numJoints());
-            Eigen::Map<Eigen::VectorXd> jointPosVec(jointPos.data(), 3 * model.numJoints());
-            jointPosVec.noalias() = model.jointShapeRegBase + model.jointShapeReg * w;
-        } else {
-            jointPos.noalias() = shapedCloud * model.jointRegressor;
+            if (!soa) {
+                /** Update joint assignment/position constants */
+                restAssignVecs.resize(3, model.assignWeights.rows());
+                assignVecs.resize(3, model.assignWeights.rows());
+                size_t j = 0;
+                for (int i = 0; i < nJoints; ++i) {
+                    auto col = restJointPos.col(i);
+                    for (auto& assignment : model.assignedPoints[i]) {
+                        int idx = assignment.second;
+                        restAssignVecs.col(j++).noalias() = shapedCloud.col(idx) - col;
+                    }
+                }
+            }
         }
 
-        /** Update joint assignment/position constants */
-        size_t j = 0;
-        for (int i = 0; i < model.numJoints(); ++i) {
-            auto col = jointPos.col(i);
-            for (auto& assignment : model.assignedPoints[i]) {
-                int idx = assignment.second;
-                assignVecs.col(j++).noalias() = shapedCloud.col(idx) - col;
+        /** END of shape update, BEGIN pose update */
+        poseJoints();
+
+        if (soa) {
+            /** Blend each point's joint transforms, taking rest to posed positions */
+            jointTransforms.resize(nJoints, 12);
+            uint64_t dirtyMask = 0;
+            for (int i = 0; i < nJoints; ++i) {
+                if (!jointDirty[i]) continue;
+                if (i < 64) dirtyMask |= uint64_t(1) << i;
+                Eigen::Vector3d t = jointPos.col(i) - jointRot[i] * restJointPos.col(i);
+                for (int d = 0; d < 3; ++d) {
+                    for (int e = 0; e < 3; ++e) {
+                        jointTransforms(i, 3 * d + e) = static_cast<float>(jointRot[i](d, e));
+                    }
+                    jointTransforms(i, 9 + d) = static_cast<float>(t(d));
+                }
+            }
+            cloud.resize(3, model.numPoints());
+            const int nGroups = static_cast<int>(model.skinGroupJoints.size());
+            if (shapeDirty || jointDirty[0] || nGroups == 0) {
+                skinPointsSoA(shapedCloudSoA.data(), model.skinJoints.data(), model.skinWeights.data(),
+                        model.maxInfluences, model.numPointsPadded, 0, model.numPoints(),
+                        jointTransforms.data(), nJoints, cloud.data());
+                return;
+            }
+            /** Re-skin runs of point groups with any changed joint */
+            for (int g = 0; g < nGroups; ) {
+                if (!(model.skinGroupJoints[g] & dirtyMask)) {
+                    ++g;
+                    continue;
+                }
+                int start = g;
+                while (g < nGroups && (model.skinGroupJoints[g] & dirtyMask)) ++g;
+                skinPointsSoA(shapedCloudSoA.data(), model.skinJoints.data(), model.skinWeights.data(),
+                        model.maxInfluences, model.numPointsPadded,
+                        start * 16, std::min(g * 16, model.numPoints()),
+                        jointTransforms.data(), nJoints, cloud.data());
             }
+            return;
         }
 
-        for (int i = model.numJoints()-1; i > 0; --i) {
+        /** Compute each point's transform */
+        for (int i = 0; i < nJoints; ++i) {
+            if (!jointDirty[i]) continue;
+            const int start = 3 * model.assignStarts[i], cnt = model.assignStarts[i+1] - model.assignStarts[i];
+            Eigen::Map<CloudType> block(assignVecs.data() + start, 3, cnt);
+            block.noalias() = jointRot[i] * Eigen::Map<const CloudType>(restAssignVecs.data() + start, 3, cnt);
+            block.colwise() += jointPos.col(i);
+        }
+        cloud.noalias() = assignVecs * model.assignWeights;
+        // PROFILE(UPDATE New);
+    }
+
+    void Avatar::poseJoints() {
+        const int nJoints = model.numJoints();
+        jointPos = restJointPos;
+        for (int i = nJoints-1; i > 0; --i) {
             jointPos.col(i).noalias() -= jointPos.col(model.parent[i]);
         }
-        /** END of shape update, BEGIN pose update */
 
         /** Compute each joint's transform */
         //jointRot.clear();
-        jointRot.resize(model.numJoints());
+        jointRot.resize(nJoints);
         jointRot[0].noalias() = r[0];
 
         jointPos.col(0) = p; /** Add root position to all joints */
-        for (size_t i = 1; i < model.numJoints(); ++i) {
+        for (int i = 1; i < nJoints; ++i) {
             jointRot[i].noalias() = jointRot[model.parent[i]] * r[i];
             jointPos.col(i) = jointRot[model.parent[i]] * jointPos.col(i) + jointPos.col(model.parent[i]);
         }
+    }
 
-        /** Compute each point's transform */
-        for (int i = 0; i < model.numJoints(); ++i) {
-            Eigen::Map<CloudType> block(assignVecs.data() + 3 * model.assignStarts[i], 3, model.assignStarts[i+1] - model.assignStarts[i]);
-            block = jointRot[i] * block;
-            block.colwise() += jointPos.col(i);
+    void Avatar::invalidate() {
+        updated = false;
+    }
+
+    AvatarBatch::AvatarBatch(const AvatarModel& model, int batch_size) : model(model) {
+        avatars.reserve(batch_size);
+        for (int i = 0; i < batch_size; ++i) {
+            avatars.emplace_back(model);
+        }
+        numLanes = (batch_size + SKIN_LANES - 1) / SKIN_LANES * SKIN_LANES;
+
+        // Joint regressor applied to the base cloud and to each shape key
+        const int nJoints = model.numJoints();
+        if (model.useJointShapeRegressor) {
+            jointRegBase = model.jointShapeRegBase;
+            jointRegKeys = model.jointShapeReg;
+        } else {
+            jointRegBase.resize(3 * nJoints);
+            jointRegKeys.resize(3 * nJoints, model.numShapeKeys());
+            Eigen::Map<CloudType> base(jointRegBase.data(), 3, nJoints);
+            base.noalias() = Eigen::Map<const CloudType>(model.baseCloud.data(), 3, model.numPoints()) *
+                model.jointRegressor;
+            for (int k = 0; k < model.numShapeKeys(); ++k) {
+                Eigen::Map<CloudType> key(jointRegKeys.col(k).data(), 3, nJoints);
+                key.noalias() = Eigen::Map<const CloudType>(model.keyClouds.col(k).data(), 3, model.numPoints()) *
+                    model.jointRegressor;
+            }
+        }
+    }
+
+    void AvatarBatch::update() {
+        const int nJoints = model.numJoints(), nKeys = model.numShapeBasis(),
+                  nPoints = model.numPoints(), nPadded = model.numPointsPadded;
+
+        /** Pose each avatar's joints, and lay out shape key weights and joint
+         *  transforms with one lane per avatar */
+        weights.setZero(nKeys * numLanes);
+        transforms.setZero(nJoints * 12 * numLanes);
+        for (int b = 0; b < size(); ++b) {
+            Avatar& ava = avatars[b];
+            ava.restJointPos.resize(3, nJoints);
+            Eigen::Map<Eigen::VectorXd>(ava.restJointPos.data(), 3 * nJoints).noalias() =
+                jointRegBase + jointRegKeys * ava.w;
+            ava.poseJoints();
+            const Eigen::VectorXd basisWeights = model.shapeBasisCoeffs.size() ?
+                Eigen::VectorXd(model.shapeBasisCoeffs * ava.w) : ava.w;
+            for (int k = 0; k < nKeys; ++k) {
+                weights(k * numLanes + b) = static_cast<float>(basisWeights(k));
+            }
+            for (int i = 0; i < nJoints; ++i) {
+                float* t = transforms.data() + i * 12 * numLanes + b;
+                Eigen::Vector3d trans = ava.jointPos.col(i) - ava.jointRot[i] * ava.restJointPos.col(i);
+                for (int d = 0; d < 3; ++d) {
+                    for (int e = 0; e < 3; ++e) {
+                        t[(3 * d + e) * numLanes] = static_cast<float>(ava.jointRot[i](d, e));
+                    }
+                    t[(9 + d) * numLanes] = static_cast<float>(trans(d));
+                }
+            }
+            ava.cloud.resize(3, nPoints);
+            // The avatar's own update() caches are not kept up to date
+            ava.invalidate();
+        }
+
+        /** Apply shape keys and skin each point for SKIN_LANES avatars at once */
+        double* out[SKIN_LANES];
+        for (int lane = 0; lane < numLanes; lane += SKIN_LANES) {
+            for (int l = 0; l < SKIN_LANES; ++l) {
+                out[l] = lane + l < size() ? avatars[lane + l].cloud.data() : nullptr;
+            }
+            if (model.keyCloudsHalf.empty()) {
+                skinBatchSoA(model, model.keyCloudsSoA.data(), weights.data() + lane,
+                        transforms.data() + lane, numLanes, out);
+            } else {
+                skinBatchSoA(model, model.keyCloudsHalf.data(), weights.data() + lane,
+                        transforms.data() + lane, numLanes, out);
+            }
         }
-        cloud.noalias() = assignVecs * model.assignWeights;
-        // PROFILE(UPDATE New);
     }
 
     void Avatar::randomize(bool randomize_pose,
@@ -18,17 +18,10 @@ namespace ark {
         }
         ifs >> nComps >> nDims;
 
-        // compute constants
-        double sqrt_2_pi_n = std::pow(2 * M_PI, nDims * 0.5 );
-        double log_sqrt_2_pi_n = nDims * 0.5 * std::log(2 * M_PI);
         weight.resize(nComps);
-        consts.resize(nComps);
-        consts_log.resize(nComps);
         for (int i = 0; i < nComps; ++i) {
             // load weights
             ifs >> weight[i];
-            consts_log[i] = log(weight[i]) - log_sqrt_2_pi_n;
-            consts[i] = weight[i] / sqrt_2_pi_n;
         }
 
         mean.resize(nComps, nDims);
@@ -39,13 +32,7 @@ namespace ark {
             }
         }
 
-        /** Cholesky decomposition */
-        typedef Eigen::LLT<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>> Cholesky;
-
         cov.resize(nComps);
-        cov_cho.resize(nComps);
-        prec_cho.resize(nComps);
-        double minDet = std::numeric_limits<double>::max();
         for (int i = 0; i < nComps; ++i) {
             auto & m = cov[i];
             m.resize(nDims, nDims);
@@ -55,6 +42,29 @@ namespace ark {
                     ifs >> m(j, k);
                 }
             }
+        }
+        init();
+    }
+
+    void GaussianMixture::init()
+    {
+        // compute constants
+        double sqrt_2_pi_n = std::pow(2 * M_PI, nDims * 0.5 );
+        double log_sqrt_2_pi_n = nDims * 0.5 * std::log(2 * M_PI);
+        consts.resize(nComps);
+        consts_log.resize(nComps);
+        for (int i = 0; i < nComps; ++i) {
+            consts_log[i] = log(weight[i]) - log_sqrt_2_pi_n;
+            consts[i] = weight[i] / sqrt_2_pi_n;
+        }
+
+        /** Cholesky decomposition */
+        typedef Eigen::LLT<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>> Cholesky;
+
+        cov_cho.resize(nComps);
+        prec_cho.resize(nComps);
+        double minDet = std::numeric_limits<double>::max();
+        for (int i = 0; i < nComps; ++i) {
             Cholesky chol(cov[i]);
             if (chol.info() != Eigen::Success) throw "Decomposition failed!";
             cov_cho[i] = chol.matrixL();
@@ -1,19 +1,43 @@
 #include "RTree.h"
 
 #include <fstream>
+#include <functional>
 #include <chrono>
+#include <cerrno>
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <csignal>
 #include <random>
 #include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <mutex>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <zlib.h>
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 #include <opencv2/imgcodecs.hpp>
 #include <boost/filesystem.hpp>
 #include <Eigen/StdVector>
 #include <unsupported/Eigen/CXX11/Tensor>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #include "Util.h"
 #include "AvatarRenderer.h"
@@ -47,6 +71,21 @@ namespace {
         return depth;
     }
 
+    /** Get depth at probe offset u (scaled by sample_depth, the depth at pix) from pix */
+    template <class Image>
+    inline float getProbeDepth(const Image& depth_image,
+            const ark::RTree::Vec2i& pix,
+            float sample_depth,
+            const ark::RTree::Vec2& u) {
+            // Add offset u and round
+            Eigen::Vector2f ut = u / sample_depth;
+            Eigen::Vector2i uti;
+            uti[0] = static_cast<int32_t>(std::round(ut.x()));
+            uti[1] = static_cast<int32_t>(std::round(ut.y()));
+            uti += pix.cast<int32_t>();
+            return getDepth(depth_image, uti);
+    }
+
     /** Get score of single sample given by a feature */
     template <class Image>
     inline float scoreByFeature(const Image& depth_image,
@@ -54,16 +93,686 @@ namespace {
             const ark::RTree::Vec2& u,
             const ark::RTree::Vec2& v) {
             float sampleDepth = depth_image.template at<float>(pix.y(), pix.x());
+            return getProbeDepth(depth_image, pix, sampleDepth, u) -
+                   getProbeDepth(depth_image, pix, sampleDepth, v);
+    }
+
+    /** Number of score buckets used by ScoreHistogram in trainers v1, v2 */
+    const int SPLIT_HISTOGRAM_BINS = 255;
+
+    /** Histogram split finder (as in LightGBM/XGBoost): feature scores of a
+     *  node's samples are binned into equal-width buckets with per-part
+     *  counts in one pass, then information gain is evaluated at bucket
+     *  edges only, instead of sorting the scores and evaluating between
+     *  every pair of distinct scores */
+    class ScoreHistogram {
+    public:
+        ScoreHistogram(int num_parts, int num_bins) :
+            counts(num_parts, num_bins), distBelow(num_parts), distAbove(num_parts),
+            numBins(num_bins) {}
+
+        /** Clear counts; all scores added must be in [min_score, max_score] */
+        void reset(float min_score, float max_score) {
+            counts.setZero();
+            minScore = min_score;
+            binWidth = (max_score - min_score) / numBins;
+            invBinWidth = binWidth > 0.f ? 1.f / binWidth : 0.f;
+        }
+
+        void add(float score, int part) {
+            counts(part, bin(score)) += 1.f;
+        }
+
+        /** Bucket of score */
+        int bin(float score) const {
+            return std::min(static_cast<int>((score - minScore) * invBinWidth), numBins - 1);
+        }
+
+        /** Add count samples of part to bucket bin */
+        void addToBin(int bin, int part, float count) {
+            counts(part, bin) += count;
+        }
+
+        /** Calls fn(info_gain, thresh) for each split of the samples between
+         *  two non-empty buckets, where samples with score < thresh are on
+         *  one side. thresh is drawn uniformly from the empty score range
+         *  between the buckets. info_gain is -(expected entropy) */
+        template<class Fn>
+        void forEachSplit(Fn fn) {
+            distAbove = counts.rowwise().sum();
+            distBelow.setZero();
+            float total = distAbove.sum(), belowSum = 0.f;
+            int lastBin = -1;
+            for (int bin = 0; bin < numBins; ++bin) {
+                float binSum = counts.col(bin).sum();
+                if (binSum == 0.f) continue;
+                if (~lastBin) {
+                    float aboveSum = total - belowSum;
+                    float belowEntropy = entropy(distBelow / belowSum);
+                    float aboveEntropy = entropy(distAbove / aboveSum);
+                    float infoGain = - (belowSum * belowEntropy + aboveSum * aboveEntropy);
+                    if (infoGain > 0) {
+                        std::cerr << "FATAL: Possibly overflow detected during training, exiting. Internal data: left entropy "
+                            << aboveEntropy << " right entropy "
+                            << belowEntropy << " information gain "
+                            << infoGain<< "\n";
+                        std::exit(2);
+                    }
+                    float lo = minScore + (lastBin + 1) * binWidth, hi = minScore + bin * binWidth;
+                    fn(infoGain, lo < hi ? ark::random_util::uniform(lo, hi) : lo);
+                }
+                distBelow += counts.col(bin);
+                distAbove -= counts.col(bin);
+                belowSum += binSum;
+                lastBin = bin;
+            }
+        }
+
+    private:
+        // Per-part sample count in each bucket (parts x buckets)
+        Eigen::MatrixXf counts;
+        ark::RTree::Distribution distBelow, distAbove;
+        int numBins;
+        float minScore = 0.f, binWidth = 0.f, invBinWidth = 0.f;
+    };
+
+    /** Traverse tree from root for pixel (r, c) with nonzero depth
+     *  sample_depth, treating probes outside of ROI as background.
+     *  Returns the leaf id reached */
+    inline int traverseROI(const std::vector<ark::RTree::RNode,
+                Eigen::aligned_allocator<ark::RTree::RNode> >& nodes,
+            const cv::Mat& depth, int r, int c, float sample_depth,
+            const cv::Point& top_left, const cv::Point& bot_right) {
+        int nodeid = 0;
+        while (nodes[nodeid].leafid == -1) {
+            auto& node = nodes[nodeid];
+
             // Add feature u,v and round
-            Eigen::Vector2f ut = u / sampleDepth, vt = v / sampleDepth;
+            Eigen::Vector2f ut = node.u / sample_depth,
+                vt = node.v / sample_depth;
             Eigen::Vector2i uti, vti;
-            uti[0] = static_cast<int32_t>(std::round(ut.x()));
-            uti[1] = static_cast<int32_t>(std::round(ut.y()));
-            vti[0] = static_cast<int32_t>(std::round(vt.x()));
-            vti[1] = static_cast<int32_t>(std::round(vt.y()));
-            uti += pix.cast<int32_t>(); vti += pix.cast<int32_t>();
+            uti[0] = static_cast<int32_t>(std::round(ut.x())) + c;
+            uti[1] = static_cast<int32_t>(std::round(ut.y())) + r;
+            vti[0] = static_cast<int32_t>(std::round(vt.x())) + c;
+            vti[1] = static_cast<int32_t>(std::round(vt.y())) + r;
+
+            float zu, zv;
+            if (uti.x() < top_left.x || uti.y() < top_left.y ||
+                uti.x() > bot_right.x || uti.y() > bot_right.y) {
+                zu = ark::RTree::BACKGROUND_DEPTH;
+            } else {
+                zu = depth.at<float>(uti.y(), uti.x());
+                if (zu == 0.0) zu = ark::RTree::BACKGROUND_DEPTH;
+            }
+            if (vti.x() < top_left.x || vti.y() < top_left.y ||
+                vti.x() > bot_right.x || vti.y() > bot_right.y) {
+                zv = ark::RTree::BACKGROUND_DEPTH;
+            } else {
+                zv = depth.at<float>(vti.y(), vti.x());
+                if (zv == 0.0) zv = ark::RTree::BACKGROUND_DEPTH;
+            }
+
+            if (zu - zv < node.thresh) {
+                nodeid = node.lnode;
+            } else {
+                nodeid = node.rnode;
+            }
+        }
+        return nodes[nodeid].leafid;
+    }
+
+    /** Minimum early exit code (CNode::earlyExit >> 24) above which
+     *  traversal never exits early */
+    const uint32_t NO_EARLY_EXIT = 256;
+
+    /** Minimum early exit code for a tree's earlyExit settings */
+    inline uint32_t earlyExitCode(const ark::RTree& tree) {
+        if (!tree.earlyExit) return NO_EARLY_EXIT;
+        if (tree.earlyExitConfidence >= 1.f) return 255;
+        return static_cast<uint32_t>(std::max(0.f, std::ceil(tree.earlyExitConfidence * 254.f)));
+    }
+
+    /** Same as traverseROI, but on compact layout (see RTree::compact).
+     *  Stops at nodes with early exit code at least min_exit_code */
+    inline int traverseCompactROI(const ark::RTree::CNode* cnodes,
+            const cv::Mat& depth, int r, int c, float sample_depth,
+            const cv::Point& top_left, const cv::Point& bot_right,
+            uint32_t min_exit_code = NO_EARLY_EXIT) {
+        int32_t nodeid = 0;
+        do {
+            const ark::RTree::CNode& node = cnodes[nodeid];
+            if ((node.earlyExit >> 24) >= min_exit_code && (node.earlyExit & 0xFFFFFF)) {
+                return static_cast<int>(node.earlyExit & 0xFFFFFF) - 1;
+            }
+
+            // Add feature u,v and round
+            int32_t utx = static_cast<int32_t>(std::round(node.u[0] / sample_depth)) + c,
+                    uty = static_cast<int32_t>(std::round(node.u[1] / sample_depth)) + r,
+                    vtx = static_cast<int32_t>(std::round(node.v[0] / sample_depth)) + c,
+                    vty = static_cast<int32_t>(std::round(node.v[1] / sample_depth)) + r;
+
+            float zu, zv;
+            if (utx < top_left.x || uty < top_left.y ||
+                utx > bot_right.x || uty > bot_right.y) {
+                zu = ark::RTree::BACKGROUND_DEPTH;
+            } else {
+                zu = depth.ptr<float>(uty)[utx];
+                if (zu == 0.0) zu = ark::RTree::BACKGROUND_DEPTH;
+            }
+            if (vtx < top_left.x || vty < top_left.y ||
+                vtx > bot_right.x || vty > bot_right.y) {
+                zv = ark::RTree::BACKGROUND_DEPTH;
+            } else {
+                zv = depth.ptr<float>(vty)[vtx];
+                if (zv == 0.0) zv = ark::RTree::BACKGROUND_DEPTH;
+            }
+
+            nodeid = (zu - zv < node.thresh) ? node.child[0] : node.child[1];
+        } while (nodeid >= 0);
+        return ~nodeid;
+    }
+
+    /** Traverse tree using compact layout if available */
+    inline int traverseTreeROI(const ark::RTree& tree,
+            const cv::Mat& depth, int r, int c, float sample_depth,
+            const cv::Point& top_left, const cv::Point& bot_right,
+            uint32_t min_exit_code = NO_EARLY_EXIT) {
+        if (tree.compiledTraversal != nullptr) {
+            int leaf;
+            tree.compiledTraversal(depth.ptr<float>(), static_cast<int>(depth.step1()), r,
+                    &c, 1, top_left.x, top_left.y, bot_right.x, bot_right.y, &leaf);
+            return leaf;
+        }
+        if (tree.compactNodes != nullptr) {
+            return traverseCompactROI(tree.compactNodes, depth, r, c,
+                    sample_depth, top_left, bot_right, min_exit_code);
+        }
+        return traverseROI(tree.nodes, depth, r, c, sample_depth, top_left, bot_right);
+    }
+
+#if defined(__AVX512F__)
+#define RTREE_SIMD_LANES 16
+    /** std::round (half away from zero) of each lane, converted to int32 */
+    inline __m512i roundToInt(__m512 x) {
+        const __m512 one = _mm512_set1_ps(1.f);
+        __m512 t = _mm512_roundscale_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m512 frac = _mm512_sub_ps(x, t);
+        t = _mm512_mask_add_ps(t, _mm512_cmp_ps_mask(frac, _mm512_set1_ps(0.5f), _CMP_GE_OQ), t, one);
+        t = _mm512_mask_sub_ps(t, _mm512_cmp_ps_mask(frac, _mm512_set1_ps(-0.5f), _CMP_LE_OQ), t, one);
+        return _mm512_cvttps_epi32(t);
+    }
+
+    /** Depth at probe (x, y) for active lanes, BACKGROUND_DEPTH if outside
+     *  of ROI or zero */
+    inline __m512 probeDepth(const float* depth_base, __m512i depth_step,
+            __m512i x, __m512i y, __mmask16 active,
+            __m512i tl_x, __m512i tl_y, __m512i br_x, __m512i br_y) {
+        const __m512 background = _mm512_set1_ps(ark::RTree::BACKGROUND_DEPTH);
+        __mmask16 inside = active &
+            _mm512_cmpge_epi32_mask(x, tl_x) & _mm512_cmple_epi32_mask(x, br_x) &
+            _mm512_cmpge_epi32_mask(y, tl_y) & _mm512_cmple_epi32_mask(y, br_y);
+        __m512i idx = _mm512_add_epi32(_mm512_mullo_epi32(y, depth_step), x);
+        __m512 z = _mm512_mask_i32gather_ps(background, inside, idx, depth_base, 4);
+        return _mm512_mask_mov_ps(z,
+                _mm512_cmp_ps_mask(z, _mm512_setzero_ps(), _CMP_EQ_OQ), background);
+    }
+
+    /** Traverse compact tree for RTREE_SIMD_LANES pixels (r, cols[i]) with
+     *  nonzero depth at once, using gathers. Same results as traverseCompactROI */
+    inline void traverseCompactROISIMD(const ark::RTree::CNode* cnodes,
+            const cv::Mat& depth, int r, const int* cols,
+            const cv::Point& top_left, const cv::Point& bot_right, int* leaves,
+            uint32_t min_exit_code) {
+        const float* nodeBase = reinterpret_cast<const float*>(cnodes);
+        const int* nodeBaseI = reinterpret_cast<const int*>(cnodes);
+        const float* depthBase = depth.ptr<float>(0);
+        const __m512i depthStep = _mm512_set1_epi32(static_cast<int>(depth.step1()));
+        const __m512i tlX = _mm512_set1_epi32(top_left.x), tlY = _mm512_set1_epi32(top_left.y),
+                      brX = _mm512_set1_epi32(bot_right.x), brY = _mm512_set1_epi32(bot_right.y);
+        const __m512i col = _mm512_loadu_si512(cols), row = _mm512_set1_epi32(r);
+        const __m512 sampleDepth = _mm512_i32gather_ps(
+                _mm512_add_epi32(_mm512_mullo_epi32(row, depthStep), col), depthBase, 4);
+
+        __m512i nodeid = _mm512_setzero_si512();
+        __mmask16 active = 0xFFFF;
+        while (active) {
+            const __m512 zero = _mm512_setzero_ps();
+            __m512i off = _mm512_slli_epi32(nodeid, 3);
+            if (min_exit_code < NO_EARLY_EXIT) {
+                __m512i exitData = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(),
+                        active, off, nodeBaseI + 7, 4);
+                __m512i exitLeaf = _mm512_and_si512(exitData, _mm512_set1_epi32(0xFFFFFF));
+                __mmask16 exits = _mm512_cmpge_epu32_mask(_mm512_srli_epi32(exitData, 24),
+                        _mm512_set1_epi32(min_exit_code)) &
+                    _mm512_test_epi32_mask(exitLeaf, exitLeaf);
+                // ~(leaf id) = -(leaf id + 1)
+                nodeid = _mm512_mask_sub_epi32(nodeid, exits, _mm512_setzero_si512(), exitLeaf);
+                active &= ~exits;
+                if (!active) break;
+            }
+            __m512 ux = _mm512_mask_i32gather_ps(zero, active, off, nodeBase, 4),
+                   uy = _mm512_mask_i32gather_ps(zero, active, off, nodeBase + 1, 4),
+                   vx = _mm512_mask_i32gather_ps(zero, active, off, nodeBase + 2, 4),
+                   vy = _mm512_mask_i32gather_ps(zero, active, off, nodeBase + 3, 4),
+                   thresh = _mm512_mask_i32gather_ps(zero, active, off, nodeBase + 4, 4);
+            __m512i lchild = _mm512_mask_i32gather_epi32(nodeid, active, off, nodeBaseI + 5, 4),
+                    rchild = _mm512_mask_i32gather_epi32(nodeid, active, off, nodeBaseI + 6, 4);
+
+            __m512i utx = _mm512_add_epi32(roundToInt(_mm512_div_ps(ux, sampleDepth)), col),
+                    uty = _mm512_add_epi32(roundToInt(_mm512_div_ps(uy, sampleDepth)), row),
+                    vtx = _mm512_add_epi32(roundToInt(_mm512_div_ps(vx, sampleDepth)), col),
+                    vty = _mm512_add_epi32(roundToInt(_mm512_div_ps(vy, sampleDepth)), row);
+            __m512 zu = probeDepth(depthBase, depthStep, utx, uty, active, tlX, tlY, brX, brY),
+                   zv = probeDepth(depthBase, depthStep, vtx, vty, active, tlX, tlY, brX, brY);
+
+            __mmask16 left = _mm512_cmp_ps_mask(_mm512_sub_ps(zu, zv), thresh, _CMP_LT_OQ);
+            nodeid = _mm512_mask_blend_epi32(left, rchild, lchild);
+            active &= _mm512_cmpge_epi32_mask(nodeid, _mm512_setzero_si512());
+        }
+        _mm512_storeu_si512(leaves, _mm512_xor_si512(nodeid, _mm512_set1_epi32(-1)));
+    }
+#elif defined(__AVX2__)
+#define RTREE_SIMD_LANES 8
+    /** std::round (half away from zero) of each lane, converted to int32 */
+    inline __m256i roundToInt(__m256 x) {
+        const __m256 one = _mm256_set1_ps(1.f);
+        __m256 t = _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m256 frac = _mm256_sub_ps(x, t);
+        t = _mm256_add_ps(t, _mm256_and_ps(one,
+                    _mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ)));
+        t = _mm256_sub_ps(t, _mm256_and_ps(one,
+                    _mm256_cmp_ps(frac, _mm256_set1_ps(-0.5f), _CMP_LE_OQ)));
+        return _mm256_cvttps_epi32(t);
+    }
+
+    /** Depth at probe (x, y) for active lanes, BACKGROUND_DEPTH if outside
+     *  of ROI or zero */
+    inline __m256 probeDepth(const float* depth_base, __m256i depth_step,
+            __m256i x, __m256i y, __m256i active,
+            __m256i tl_x, __m256i tl_y, __m256i br_x, __m256i br_y) {
+        const __m256 background = _mm256_set1_ps(ark::RTree::BACKGROUND_DEPTH);
+        __m256i outside = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpgt_epi32(tl_x, x), _mm256_cmpgt_epi32(x, br_x)),
+                _mm256_or_si256(_mm256_cmpgt_epi32(tl_y, y), _mm256_cmpgt_epi32(y, br_y)));
+        __m256i inside = _mm256_andnot_si256(outside, active);
+        __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(y, depth_step), x);
+        __m256 z = _mm256_mask_i32gather_ps(background, depth_base, idx,
+                _mm256_castsi256_ps(inside), 4);
+        return _mm256_blendv_ps(z, background,
+                _mm256_cmp_ps(z, _mm256_setzero_ps(), _CMP_EQ_OQ));
+    }
+
+    /** Traverse compact tree for RTREE_SIMD_LANES pixels (r, cols[i]) with
+     *  nonzero depth at once, using gathers. Same results as traverseCompactROI */
+    inline void traverseCompactROISIMD(const ark::RTree::CNode* cnodes,
+            const cv::Mat& depth, int r, const int* cols,
+            const cv::Point& top_left, const cv::Point& bot_right, int* leaves,
+            uint32_t min_exit_code) {
+        const float* nodeBase = reinterpret_cast<const float*>(cnodes);
+        const int* nodeBaseI = reinterpret_cast<const int*>(cnodes);
+        const float* depthBase = depth.ptr<float>(0);
+        const __m256i depthStep = _mm256_set1_epi32(static_cast<int>(depth.step1()));
+        const __m256i tlX = _mm256_set1_epi32(top_left.x), tlY = _mm256_set1_epi32(top_left.y),
+                      brX = _mm256_set1_epi32(bot_right.x), brY = _mm256_set1_epi32(bot_right.y);
+        const __m256i col = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cols)),
+                      row = _mm256_set1_epi32(r);
+        const __m256 sampleDepth = _mm256_i32gather_ps(depthBase,
+                _mm256_add_epi32(_mm256_mullo_epi32(row, depthStep), col), 4);
+
+        __m256i nodeid = _mm256_setzero_si256();
+        __m256i active = _mm256_set1_epi32(-1);
+        while (!_mm256_testz_si256(active, active)) {
+            const __m256 zero = _mm256_setzero_ps();
+            __m256i off = _mm256_slli_epi32(nodeid, 3);
+            if (min_exit_code < NO_EARLY_EXIT) {
+                __m256i exitData = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+                        nodeBaseI + 7, off, active, 4);
+                __m256i exitLeaf = _mm256_and_si256(exitData, _mm256_set1_epi32(0xFFFFFF));
+                // Code is at most 255, so signed comparison is fine
+                __m256i exits = _mm256_andnot_si256(
+                        _mm256_or_si256(
+                            _mm256_cmpgt_epi32(_mm256_set1_epi32(min_exit_code),
+                                _mm256_srli_epi32(exitData, 24)),
+                            _mm256_cmpeq_epi32(exitLeaf, _mm256_setzero_si256())),
+                        active);
+                // ~(leaf id) = -(leaf id + 1)
+                nodeid = _mm256_blendv_epi8(nodeid,
+                        _mm256_sub_epi32(_mm256_setzero_si256(), exitLeaf), exits);
+                active = _mm256_andnot_si256(exits, active);
+                if (_mm256_testz_si256(active, active)) break;
+            }
+            const __m256 activeF = _mm256_castsi256_ps(active);
+            __m256 ux = _mm256_mask_i32gather_ps(zero, nodeBase, off, activeF, 4),
+                   uy = _mm256_mask_i32gather_ps(zero, nodeBase + 1, off, activeF, 4),
+                   vx = _mm256_mask_i32gather_ps(zero, nodeBase + 2, off, activeF, 4),
+                   vy = _mm256_mask_i32gather_ps(zero, nodeBase + 3, off, activeF, 4),
+                   thresh = _mm256_mask_i32gather_ps(zero, nodeBase + 4, off, activeF, 4);
+            __m256i lchild = _mm256_mask_i32gather_epi32(nodeid, nodeBaseI + 5, off, active, 4),
+                    rchild = _mm256_mask_i32gather_epi32(nodeid, nodeBaseI + 6, off, active, 4);
+
+            __m256i utx = _mm256_add_epi32(roundToInt(_mm256_div_ps(ux, sampleDepth)), col),
+                    uty = _mm256_add_epi32(roundToInt(_mm256_div_ps(uy, sampleDepth)), row),
+                    vtx = _mm256_add_epi32(roundToInt(_mm256_div_ps(vx, sampleDepth)), col),
+                    vty = _mm256_add_epi32(roundToInt(_mm256_div_ps(vy, sampleDepth)), row);
+            __m256 zu = probeDepth(depthBase, depthStep, utx, uty, active, tlX, tlY, brX, brY),
+                   zv = probeDepth(depthBase, depthStep, vtx, vty, active, tlX, tlY, brX, brY);
+
+            __m256 left = _mm256_cmp_ps(_mm256_sub_ps(zu, zv), thresh, _CMP_LT_OQ);
+            nodeid = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(rchild),
+                        _mm256_castsi256_ps(lchild), left));
+            active = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), nodeid), active);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(leaves),
+                _mm256_xor_si256(nodeid, _mm256_set1_epi32(-1)));
+    }
+#else
+#define RTREE_SIMD_LANES 1
+#endif
+
+    /** Find leaf ids for the n pixels (r, cols[i]) with nonzero depth, writing
+     *  them to leaves. Uses SIMD traversal if available and enabled.
+     *  cols and leaves must have room for n rounded up to a multiple of
+     *  RTREE_SIMD_LANES (cols is padded in place).
+     *  With min_exit_code from earlyExitCode, leaves may be replaced by
+     *  other leaves of a subtree with the same best match (compact layout only) */
+    inline void traverseTreeRow(const ark::RTree& tree,
+            const cv::Mat& depth, int r, int* cols, int n,
+            const cv::Point& top_left, const cv::Point& bot_right, int* leaves,
+            uint32_t min_exit_code = NO_EARLY_EXIT) {
+        if (tree.compiledTraversal != nullptr) {
+            tree.compiledTraversal(depth.ptr<float>(), static_cast<int>(depth.step1()), r,
+                    cols, n, top_left.x, top_left.y, bot_right.x, bot_right.y, leaves);
+            return;
+        }
+#if RTREE_SIMD_LANES > 1
+        if (tree.compactNodes != nullptr && tree.enableSIMD && n > 0) {
+            // Pad tail with copies of last pixel
+            for (int i = n; i % RTREE_SIMD_LANES; ++i) cols[i] = cols[n - 1];
+            for (int i = 0; i < n; i += RTREE_SIMD_LANES) {
+                traverseCompactROISIMD(tree.compactNodes, depth, r, cols + i,
+                        top_left, bot_right, leaves + i, min_exit_code);
+            }
+            return;
+        }
+#endif
+        const auto* inPtr = depth.ptr<float>(r);
+        for (int i = 0; i < n; ++i) {
+            leaves[i] = traverseTreeROI(tree, depth, r, cols[i], inPtr[cols[i]],
+                    top_left, bot_right, min_exit_code);
+        }
+    }
+
+    /** Find leaf ids of the ROI grid of pixels (top_left + interval * (j, i))
+     *  with nonzero depth, using num_threads threads. For each grid row i,
+     *  calls process_row(i, cols, leaves, n) with the n image columns that
+     *  have depth and their leaf ids. Buffers are allocated once per thread */
+    template<class RowProcessor>
+    void traverseTreeGrid(const ark::RTree& tree, const cv::Mat& depth,
+            int num_threads, int interval, const cv::Size& grid_size,
+            const cv::Point& top_left, const cv::Point& bot_right,
+            RowProcessor process_row) {
+        std::atomic<int> row(0);
+        const int rowCapacity = grid_size.width + RTREE_SIMD_LANES;
+        auto worker = [&]() {
+            std::vector<int> cols(rowCapacity), leaves(rowCapacity);
+            int i;
+            while ((i = row++) < grid_size.height) {
+                int r = top_left.y + i * interval;
+                const auto* inPtr = depth.ptr<float>(r);
+                int n = 0;
+                for (int c = top_left.x; c <= bot_right.x; c += interval) {
+                    if (inPtr[c] != 0.f) cols[n++] = c;
+                }
+                traverseTreeRow(tree, depth, r, cols.data(), n,
+                        top_left, bot_right, leaves.data());
+                process_row(i, cols.data(), leaves.data(), n);
+            }
+        };
+        std::vector<std::thread> threadMgr;
+        for (int i = 1; i < num_threads; ++i) {
+            threadMgr.emplace_back(worker);
+        }
+        worker();
+        for (auto& thd : threadMgr) {
+            thd.join();
+        }
+    }
+
+    /** Labels pixels of a row with best matches of a tree.
+     *  Holds buffers for one thread */
+    class TreeLabeler {
+    public:
+        TreeLabeler(const ark::RTree& tree, int capacity) : tree(tree),
+            bestMatch(tree.compactNodes != nullptr ?
+                    tree.compactBestMatch : tree.leafBestMatch.data()),
+            minExitCode(earlyExitCode(tree)), leaves(capacity) {}
+
+        /** Label the n pixels (r, cols[i]) with nonzero depth, cols as in
+         *  traverseTreeRow */
+        void operator()(const cv::Mat& depth, int r, int* cols, int n,
+                const cv::Point& top_left, const cv::Point& bot_right, uint8_t* labels) {
+            traverseTreeRow(tree, depth, r, cols, n, top_left, bot_right,
+                    leaves.data(), minExitCode);
+            for (int i = 0; i < n; ++i) {
+                labels[i] = bestMatch[leaves[i]];
+            }
+        }
+
+    private:
+        const ark::RTree& tree;
+        const uint8_t* bestMatch;
+        uint32_t minExitCode;
+        std::vector<int> leaves;
+    };
+
+    /** Labels pixels of a row with the argmax of the summed leaf
+     *  distributions of a forest's trees. Holds buffers for one thread */
+    class ForestLabeler {
+    public:
+        ForestLabeler(const ark::RForest& forest, int capacity) : forest(forest),
+            capacity(capacity), leaves(capacity * forest.trees.size()),
+            distr(forest.numParts) {}
+
+        /** Label the n pixels (r, cols[i]) with nonzero depth, cols as in
+         *  traverseTreeRow */
+        void operator()(const cv::Mat& depth, int r, int* cols, int n,
+                const cv::Point& top_left, const cv::Point& bot_right, uint8_t* labels) {
+            const auto& trees = forest.trees;
+            for (size_t t = 0; t < trees.size(); ++t) {
+                traverseTreeRow(trees[t], depth, r, cols, n,
+                        top_left, bot_right, leaves.data() + t * capacity);
+            }
+            if (trees.size() == 1) {
+                const ark::RTree& tree = trees[0];
+                const uint8_t* bestMatch = tree.compactNodes != nullptr ?
+                    tree.compactBestMatch : tree.leafBestMatch.data();
+                for (int i = 0; i < n; ++i) {
+                    labels[i] = bestMatch[leaves[i]];
+                }
+                return;
+            }
+            int best;
+            for (int i = 0; i < n; ++i) {
+                // Sum of leaf distributions over trees (same argmax as average)
+                distr.setZero();
+                for (size_t t = 0; t < trees.size(); ++t) {
+                    const float* leaf = trees[t].leafDistribution(leaves[t * capacity + i]);
+                    distr.noalias() += Eigen::Map<const ark::RTree::Distribution>(leaf, forest.numParts);
+                }
+                distr.maxCoeff(&best);
+                labels[i] = static_cast<uint8_t>(best);
+            }
+        }
+
+    private:
+        const ark::RForest& forest;
+        int capacity;
+        std::vector<int> leaves;
+        ark::RTree::Distribution distr;
+    };
+
+    /** Label every interval-th row of ROI at every interval-th pixel, starting
+     *  one interval below top_left, with num_threads threads. Labeler
+     *  is constructed with (model, row capacity) in each thread */
+    template<class Labeler, class Model>
+    void labelGrid(const Model& model, cv::Mat& result, const cv::Mat& depth,
+            int num_threads, int interval,
+            const cv::Point& top_left, const cv::Point& bot_right) {
+        std::atomic<int> row(top_left.y);
+        // Room for a row of pixels, padded to a multiple of SIMD lanes
+        const int rowCapacity = (bot_right.x - top_left.x) / interval + RTREE_SIMD_LANES + 1;
+        auto worker = [&]() {
+            Labeler label(model, rowCapacity);
+            std::vector<int> cols(rowCapacity);
+            std::vector<uint8_t> labels(rowCapacity);
+            uint8_t* ptr;
+            int r;
+            while(true) {
+                r = (row += interval);
+                if (r > bot_right.y) break;
+                ptr = result.ptr<uint8_t>(r);
+                const auto* inPtr = depth.ptr<float>(r);
+                int n = 0;
+                for (int c = top_left.x; c <= bot_right.x; c += interval) {
+                    if (inPtr[c] != 0.f) cols[n++] = c;
+                }
+                label(depth, r, cols.data(), n, top_left, bot_right, labels.data());
+                for (int i = 0; i < n; ++i) {
+                    ptr[cols[i]] = labels[i];
+                }
+            }
+        };
+        std::vector<std::thread> threadMgr;
+        for (int i = 0; i < num_threads; ++i) {
+            threadMgr.emplace_back(worker);
+        }
+        for (int i = 0; i < num_threads; ++i) {
+            threadMgr[i].join();
+        }
+    }
+
+    /** Coarse-to-fine labelling of ROI: labels pixels at
+     *  top_left + interval * (j, i + 1), the same grid as labelGrid, then fills
+     *  each interval x interval cell whose (up to 4) corner labels agree with
+     *  that label, and labels every pixel of the other cells. Like labelGrid
+     *  followed by upscaleGrid, rows above the first grid row are not labelled.
+     *  Labeler is as in labelGrid */
+    template<class Labeler, class Model>
+    void labelAdaptive(const Model& model, cv::Mat& result, const cv::Mat& depth,
+            int num_threads, int interval,
+            const cv::Point& top_left, const cv::Point& bot_right) {
+        const int gridTop = top_left.y + interval;
+        const int gridCols = (bot_right.x - top_left.x) / interval + 1,
+                  gridRows = bot_right.y < gridTop ? 0 : (bot_right.y - gridTop) / interval + 1;
+        const int rowCapacity = bot_right.x - top_left.x + RTREE_SIMD_LANES + 1;
+        auto runThreads = [num_threads](const std::function<void()>& worker) {
+            std::vector<std::thread> threadMgr;
+            for (int i = 1; i < num_threads; ++i) {
+                threadMgr.emplace_back(worker);
+            }
+            worker();
+            for (auto& thd : threadMgr) {
+                thd.join();
+            }
+        };
+
+        // Coarse grid, all of which is needed before refining
+        std::atomic<int> row(0);
+        runThreads([&]() {
+            Labeler label(model, rowCapacity);
+            std::vector<int> cols(rowCapacity);
+            std::vector<uint8_t> labels(rowCapacity);
+            int i;
+            while ((i = row++) < gridRows) {
+                int r = gridTop + i * interval;
+                uint8_t* ptr = result.ptr<uint8_t>(r);
+                const auto* inPtr = depth.ptr<float>(r);
+                int n = 0;
+                for (int c = top_left.x; c <= bot_right.x; c += interval) {
+                    if (inPtr[c] != 0.f) cols[n++] = c;
+                }
+                label(depth, r, cols.data(), n, top_left, bot_right, labels.data());
+                for (int k = 0; k < n; ++k) {
+                    ptr[cols[k]] = labels[k];
+                }
+            }
+        });
+
+        // Fill or refine each band of cells between two grid rows
+        row = 0;
+        runThreads([&]() {
+            Labeler label(model, rowCapacity);
+            std::vector<int> cols(rowCapacity);
+            std::vector<uint8_t> labels(rowCapacity);
+            std::vector<char> refine(gridCols);
+            int i;
+            while ((i = row++) < gridRows) {
+                const int r0 = gridTop + i * interval,
+                          rEnd = std::min(r0 + interval - 1, bot_right.y);
+                const uint8_t* top = result.ptr<uint8_t>(r0);
+                const uint8_t* bottom = i + 1 < gridRows ?
+                    result.ptr<uint8_t>(r0 + interval) : nullptr;
+                bool anyRefined = false;
+                for (int j = 0; j < gridCols; ++j) {
+                    const int c0 = top_left.x + j * interval,
+                              cEnd = std::min(c0 + interval - 1, bot_right.x);
+                    const uint8_t val = top[c0];
+                    bool agree = true;
+                    if (j + 1 < gridCols) agree = top[c0 + interval] == val;
+                    if (bottom != nullptr) {
+                        agree = agree && bottom[c0] == val &&
+                            (j + 1 >= gridCols || bottom[c0 + interval] == val);
+                    }
+                    refine[j] = !agree;
+                    anyRefined = anyRefined || !agree;
+                    if (!agree) continue;
+                    // Grid pixels are never written here, since the band
+                    // above reads this band's top row grid pixels as its bottom corners
+                    memset(result.ptr<uint8_t>(r0) + c0 + 1, val, cEnd - c0);
+                    for (int r = r0 + 1; r <= rEnd; ++r) {
+                        memset(result.ptr<uint8_t>(r) + c0, val, cEnd - c0 + 1);
+                    }
+                }
+                if (!anyRefined) continue;
+                for (int r = r0; r <= rEnd; ++r) {
+                    uint8_t* ptr = result.ptr<uint8_t>(r);
+                    const auto* inPtr = depth.ptr<float>(r);
+                    int n = 0;
+                    for (int j = 0; j < gridCols; ++j) {
+                        if (!refine[j]) continue;
+                        const int c0 = top_left.x + j * interval,
+                                  cEnd = std::min(c0 + interval - 1, bot_right.x);
+                        // Skip grid pixel, already labelled
+                        for (int c = (r == r0 ? c0 + 1 : c0); c <= cEnd; ++c) {
+                            if (inPtr[c] != 0.f) cols[n++] = c;
+                        }
+                    }
+                    label(depth, r, cols.data(), n, top_left, bot_right, labels.data());
+                    for (int k = 0; k < n; ++k) {
+                        ptr[cols[k]] = labels[k];
+                    }
+                }
+            }
+        });
+    }
 
-            return (getDepth(depth_image, uti) - getDepth(depth_image, vti));
+    /** Clamp ROI to image; bot_right = (-1, -1) means bottom right corner.
+     *  Returns size of the grid of pixels computed at interval */
+    cv::Size predictionGrid(const cv::Mat& depth, int interval,
+            cv::Point& top_left, cv::Point& bot_right) {
+        if (bot_right.x == -1) {
+            bot_right.x = depth.cols - 1;
+            bot_right.y = depth.rows - 1;
+        }
+        top_left.x = std::max(top_left.x, 0);
+        top_left.y = std::max(top_left.y, 0);
+        bot_right.x = std::min(bot_right.x, depth.cols - 1);
+        bot_right.y = std::min(bot_right.y, depth.rows - 1);
+        if (bot_right.x < top_left.x || bot_right.y < top_left.y) {
+            return cv::Size(0, 0);
+        }
+        return cv::Size((bot_right.x - top_left.x) / interval + 1,
+                        (bot_right.y - top_left.y) / interval + 1);
     }
 
     void upscaleGrid(cv::Mat& image, int interval, int num_threads,
@@ -318,6 +1027,149 @@ namespace {
             }
         }
     }
+
+    /** Internal node record of the quantized ('Q') RTree file format.
+     *  Probe offsets are fixed point with offsetShift fractional bits,
+     *  threshold is in millimeters, children are as in RTree::CNode */
+    struct QuantizedNode {
+        int16_t u[2], v[2];
+        int16_t threshMM;
+        int16_t reserved;
+        int32_t child[2];
+    };
+    static_assert(sizeof(QuantizedNode) == 20, "QuantizedNode must not be padded");
+
+    /** Version of quantized RTree file format */
+    const uint8_t QUANTIZED_FORMAT_VERSION = 2;
+
+    /** Header of flat ('F') RTree file format. The rest of the file is laid
+     *  out exactly like RTree::compact()'s buffer, so that it can be memory
+     *  mapped and used for inference directly */
+    struct FlatHeader {
+        char marker;
+        uint8_t version;
+        uint16_t reserved;
+        int32_t numParts;
+        uint32_t numNodes, numLeaves;
+        // Byte offsets of sections from start of file (cache line aligned)
+        uint64_t nodesOffset, leafDataOffset, bestMatchOffset, fileSize;
+    };
+    static_assert(sizeof(FlatHeader) == 48, "FlatHeader must not be padded");
+
+    /** Version of flat RTree file format */
+    const uint8_t FLAT_FORMAT_VERSION = 1;
+
+    const size_t CACHE_LINE = 64;
+
+    inline size_t alignUp(size_t x, size_t alignment) {
+        return (x + alignment - 1) / alignment * alignment;
+    }
+
+    /** Offsets of sections within compact inference buffer, relative to
+     *  the first node; shared by RTree::compact and the flat file format */
+    inline void compactLayout(size_t num_nodes, size_t num_leaves, int num_parts,
+            size_t& leaf_data_offset, size_t& best_match_offset, size_t& total_size) {
+        leaf_data_offset = alignUp(num_nodes * sizeof(ark::RTree::CNode), CACHE_LINE);
+        best_match_offset = leaf_data_offset + num_leaves * num_parts * sizeof(float);
+        total_size = best_match_offset + num_leaves;
+    }
+
+    /** Leaf statistics of a subtree, for computing early exit data */
+    struct SubtreeLeaves {
+        // Sum and elementwise minimum of leaf distributions
+        Eigen::VectorXf sum, min;
+        // For each part, a leaf with that best match, or -1
+        std::vector<int> leafWithBest;
+        // Best match shared by all leaves, or -1
+        int commonBest;
+    };
+
+    /** Set CNode::earlyExit of all internal nodes in the subtree at nodeid
+     *  of compact layout, writing the subtree's leaf statistics to result */
+    void computeEarlyExit(ark::RTree::CNode* cnodes, int32_t nodeid,
+            const float* leaf_data, const uint8_t* best_match, int num_parts,
+            SubtreeLeaves& result) {
+        if (nodeid < 0) {
+            int leafid = ~nodeid;
+            result.sum = result.min = Eigen::Map<const Eigen::VectorXf>(
+                    leaf_data + static_cast<size_t>(leafid) * num_parts, num_parts);
+            result.leafWithBest.assign(num_parts, -1);
+            result.commonBest = best_match[leafid];
+            if (result.commonBest < num_parts) result.leafWithBest[result.commonBest] = leafid;
+            return;
+        }
+        ark::RTree::CNode& node = cnodes[nodeid];
+        SubtreeLeaves right;
+        computeEarlyExit(cnodes, node.child[0], leaf_data, best_match, num_parts, result);
+        computeEarlyExit(cnodes, node.child[1], leaf_data, best_match, num_parts, right);
+        result.sum += right.sum;
+        result.min = result.min.cwiseMin(right.min);
+        for (int i = 0; i < num_parts; ++i) {
+            if (result.leafWithBest[i] == -1) result.leafWithBest[i] = right.leafWithBest[i];
+        }
+        if (result.commonBest != right.commonBest) result.commonBest = -1;
+
+        int part;
+        uint32_t code;
+        if (result.commonBest >= 0 && result.commonBest < num_parts) {
+            part = result.commonBest;
+            code = 255;
+        } else {
+            result.sum.maxCoeff(&part);
+            code = static_cast<uint32_t>(std::min(254.f,
+                        std::max(0.f, std::floor(result.min[part] * 254.f))));
+        }
+        int leafid = result.leafWithBest[part];
+        node.earlyExit = (leafid >= 0 && leafid < 0xFFFFFF) ?
+            (code << 24) | static_cast<uint32_t>(leafid + 1) : 0;
+    }
+
+    /** Round and clamp to int16 */
+    inline int16_t saturateInt16(float x) {
+        return static_cast<int16_t>(std::max(-32767.f, std::min(32767.f, std::round(x))));
+    }
+
+    /** FNV-1a hash of compact nodes, identifies the tree a compiled
+     *  traversal was generated from */
+    uint64_t compactFingerprint(const ark::RTree::CNode* cnodes, int num_nodes) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (int i = 0; i < num_nodes; ++i) {
+            // Early exit data is derived from leaves, skip it
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(cnodes + i);
+            for (size_t j = 0; j < offsetof(ark::RTree::CNode, earlyExit); ++j) {
+                hash = (hash ^ bytes[j]) * 1099511628211ULL;
+            }
+        }
+        return hash;
+    }
+
+    /** Levels of the tree emitted per generated function. Deeper nodes
+     *  go in functions of their own, so that no function gets too large
+     *  to optimize */
+    const int COMPILED_LEVELS_PER_FUNCTION = 8;
+
+    /** Emit the subtree rooted at compact node nodeid as nested ifs,
+     *  adding nodes COMPILED_LEVELS_PER_FUNCTION levels down to pending */
+    void writeCompiledSubtree(std::ostream& os, const ark::RTree::CNode* cnodes,
+            int32_t nodeid, int level, std::vector<int32_t>& pending) {
+        std::string indent(4 * (level + 1), ' ');
+        if (nodeid < 0) {
+            os << indent << "return " << ~nodeid << ";\n";
+            return;
+        }
+        if (level == COMPILED_LEVELS_PER_FUNCTION) {
+            pending.push_back(nodeid);
+            os << indent << "return node" << nodeid << "(p);\n";
+            return;
+        }
+        const ark::RTree::CNode& node = cnodes[nodeid];
+        os << indent << "if (goLeft(p, " << node.u[0] << "f, " << node.u[1] << "f, "
+           << node.v[0] << "f, " << node.v[1] << "f, " << node.thresh << "f)) {\n";
+        writeCompiledSubtree(os, cnodes, node.child[0], level + 1, pending);
+        os << indent << "} else {\n";
+        writeCompiledSubtree(os, cnodes, node.child[1], level + 1, pending);
+        os << indent << "}\n";
+    }
 }
 
 namespace ark {
@@ -374,14 +1226,32 @@ namespace ark {
             return _data_paths[0].size();
         }
 
+        /** Identifies the dataset for ImageStore: image count and a hash of
+         *  the path, size and modification time of each file */
+        std::string fingerprint() const {
+            uint64_t hash = 14695981039346656037ULL;
+            for (int k = 0; k < 2; ++k) {
+                for (const std::string& dataPath : _data_paths[k]) {
+                    boost::system::error_code ec;
+                    std::ostringstream ss;
+                    ss << dataPath << " " << boost::filesystem::file_size(dataPath, ec) << " " <<
+                        boost::filesystem::last_write_time(dataPath, ec) << "\n";
+                    for (char c : ss.str()) hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+                }
+            }
+            std::ostringstream os;
+            os << "files " << size() << " " << std::hex << hash;
+            return os.str();
+        }
+
         const std::array<cv::Mat, 2>& load(int idx, int hint = -1) {
             thread_local std::array<cv::Mat, 2> arr;
             thread_local int last_idx = -1, last_hint = -1;
             if (idx != last_idx || hint != last_hint) {
                 if (hint == 0 || hint == -1)
-                    arr[0] = cv::imread(_data_paths[idx][0], IMREAD_FLAGS[0]);
+                    arr[0] = cv::imread(_data_paths[0][idx], IMREAD_FLAGS[0]);
                 if (hint == 1 || hint == -1)
-                    arr[1] = cv::imread(_data_paths[idx][1], IMREAD_FLAGS[1]);
+                    arr[1] = cv::imread(_data_paths[1][idx], IMREAD_FLAGS[1]);
                 last_idx = idx;
                 last_hint = hint;
             }
@@ -444,12 +1314,25 @@ namespace ark {
             }
             seq.resize(num_images);
             xorKey = random_util::randint<uint32_t>(1, std::numeric_limits<uint32_t>::max());
+            // Addresses can be reused by later sources, ids are not
+            static std::atomic<uint64_t> nextInstanceId(1);
+            instanceId = nextInstanceId++;
         }
 
         int size() const {
             return numImages;
         }
 
+        /** Identifies the rendered images for ImageStore */
+        std::string fingerprint() const {
+            uint64_t hash = 14695981039346656037ULL;
+            for (int i : seq) hash = (hash ^ static_cast<uint32_t>(i)) * 1099511628211ULL;
+            std::ostringstream os;
+            os << "avatar " << numImages << " " << imageSize.width << "x" << imageSize.height <<
+                " " << xorKey << " " << std::hex << hash;
+            return os.str();
+        }
+
         /** Implements DataSource interface */
         const std::array<cv::Mat, 2>& load(int idx, int hint = -1) {
             thread_local std::array<cv::Mat, 2> arr;
@@ -458,15 +1341,7 @@ namespace ark {
             if (idx != last_idx || hint != last_hint) {
                 last_idx = idx;
                 last_hint = hint;
-                if (poseSequence.numFrames) {
-                    // random_util::randint<size_t>(0, poseSequence.numFrames - 1)
-                    int seqid = seq[idx % seq.size()];
-                    poseSequence.poseAvatar(ava, seqid);
-                    ava.r[0].setIdentity();
-                    ava.randomize(false, true, true, static_cast<uint32_t>(idx) ^ xorKey);
-                } else {
-                    ava.randomize(true, true, true, static_cast<uint32_t>(idx) ^ xorKey);
-                }
+                poseAvatar(ava, idx);
                 ava.update();
                 AvatarRenderer renderer(ava, intrin);
 
@@ -478,20 +1353,31 @@ namespace ark {
             return arr;
         }
 
-        /** Simple load: load the depth and part mask for image at idx */
+        /** Simple load: load the depth and part mask for image at idx.
+         *  Avatars for idx and the following images are posed and skinned
+         *  together as an AvatarBatch, so loading consecutive images is fastest.
+         *  The result does not depend on the order images are loaded in. */
         void loadSimple(int idx, cv::Mat& depth, cv::Mat& part_mask, bool skip_part_mask = false) {
-            thread_local Avatar ava(avaModel);
-            if (poseSequence.numFrames) {
-                // random_util::randint<size_t>(0, poseSequence.numFrames - 1)
-                int seqid = seq[idx % seq.size()];
-                poseSequence.poseAvatar(ava, seqid);
-                ava.r[0].setIdentity();
-                ava.randomize(false, true, true, static_cast<uint32_t>(idx) ^ xorKey);
-            } else {
-                ava.randomize(true, true, true, static_cast<uint32_t>(idx) ^ xorKey);
+            thread_local std::unique_ptr<AvatarBatch> batch;
+            thread_local uint64_t batchSourceId = 0;
+            thread_local int batchGeneration = -1;
+            thread_local int batchStart = -1;
+            if (!batch || batchSourceId != instanceId) {
+                // The batch references avaModel, which lives as long as this source
+                batch.reset(new AvatarBatch(avaModel, AvatarBatch::SKIN_LANES));
+                batchSourceId = instanceId;
+                batchStart = -1;
+            }
+            if (batchGeneration != generation || batchStart < 0 ||
+                    idx < batchStart || idx >= batchStart + batch->size()) {
+                batchGeneration = generation;
+                batchStart = idx;
+                for (int i = 0; i < batch->size(); ++i) {
+                    poseAvatar(batch->avatars[i], std::min(idx + i, numImages - 1));
+                }
+                batch->update();
             }
-            ava.update();
-            AvatarRenderer renderer(ava, intrin);
+            AvatarRenderer renderer(batch->avatars[idx - batchStart], intrin);
             depth = renderer.renderDepth(imageSize);
             if (!skip_part_mask)
                 part_mask = renderer.renderPartMask(imageSize, partMap);
@@ -536,6 +1422,7 @@ namespace ark {
             if (seq.size() > numImages) {
                 seq.resize(numImages);
             }
+            ++generation;
         }
 
         int numImages; uint32_t xorKey;
@@ -545,46 +1432,476 @@ namespace ark {
         CameraIntrin& intrin;
         std::vector<int> seq;
         const std::vector<int>& partMap;
+
+    private:
+        /** Set pose and shape of the avatar for image idx */
+        void poseAvatar(Avatar& ava, int idx) {
+            if (poseSequence.numFrames) {
+                // random_util::randint<size_t>(0, poseSequence.numFrames - 1)
+                int seqid = seq[idx % seq.size()];
+                poseSequence.poseAvatar(ava, seqid);
+                ava.r[0].setIdentity();
+                ava.randomize(false, true, true, static_cast<uint32_t>(idx) ^ xorKey);
+            } else {
+                ava.randomize(true, true, true, static_cast<uint32_t>(idx) ^ xorKey);
+            }
+        }
+
+        /** Unique id of this source and counter incremented when poses change,
+         *  which together key the batches cached by loadSimple */
+        uint64_t instanceId;
+        int generation = 0;
     };
 
-    template<class DataSource>
-    /** Responsible for handling data loading from abstract data source
-     *  Interface: dataLoader.get(sample): get (depth, part mask) images for a sample
-     *             dataLoader.preload(samples, a, b, numThreads): preload images for samples if possible */
-    struct DataLoader {
-        DataSource& dataSource;
-        DataLoader(DataSource& data_source, size_t max_images_loaded) : dataSource(data_source), maxImagesLoaded(max_images_loaded) {}
+    /** Structured training telemetry, written as JSON lines: one object per
+     *  event (node split, tree level, ...) with an "event" name, seconds
+     *  since opening and peak RSS. Lines are flushed as they are written, so
+     *  a running job can be followed with tail -f. Thread safe */
+    class TrainingTelemetry {
+    public:
+        /** One JSON object, built field by field */
+        class Record {
+        public:
+            explicit Record(const char* event) {
+                os << "{\"event\":\"" << event << '"';
+            }
 
-        /** Precondition: samples must be sorted by image index on [a, ..., b-1] */
-        bool preload(const SampleVec& samples, int a, int b, int numThreads) {
-            std::vector<int> images;
-            images.push_back(samples[a].index);
-            images.reserve((b-a - 1) / 2000 + 1); // HACK
-            size_t loadSize = data.size();
+            template<class T>
+            Record& operator()(const char* key, const T& value) {
+                os << ",\"" << key << "\":";
+                writeValue(value);
+                return *this;
+            }
 
-            imageIdx.resize(dataSource.size(), -1);
-            for (int i = a + 1; i < b; ++i) {
-                if (samples[i].index != images.back()) {
-                    images.push_back(samples[i].index);
-                    if (imageIdx[samples[i].index] == -1) {
-                        ++loadSize;
-                    }
-                    // if (samples[i].index < images.back()) {
-                    //     std::cerr << "FATAL: Images not sorted at preload " <<a << "," << b << "\n";
-                    //     std::exit(0);
-                    // }
+            std::string str() const {
+                return os.str() + "}";
+            }
+
+        private:
+            template<class T>
+            void writeValue(const T& value) {
+                writeNumber(value, std::is_floating_point<T>());
+            }
+            void writeValue(const std::string& value) {
+                os << '"';
+                for (char c : value) {
+                    if (c == '"' || c == '\\') os << '\\';
+                    os << c;
                 }
+                os << '"';
             }
-            if (loadSize - data.size() == 0) return true; // Already all loaded
-            if (images.size() > maxImagesLoaded) {
-                std::cout << "INFO: Number of images too large (" << images.size() <<
-                    " > " << maxImagesLoaded << "), not preloading\n";
-                return false;
+            void writeValue(const char* value) {
+                writeValue(std::string(value));
+            }
+            template<class T>
+            void writeNumber(T value, std::true_type) {
+                // JSON has no inf/nan. Test the exponent bits, since
+                // std::isfinite may fold to true under -ffast-math
+                double dvalue = value;
+                uint64_t bits;
+                std::memcpy(&bits, &dvalue, sizeof bits);
+                if ((bits & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL) os << value;
+                else os << "null";
+            }
+            template<class T>
+            void writeNumber(T value, std::false_type) {
+                os << +value;
             }
 
-            if (loadSize > maxImagesLoaded) {
-                clear();
-            } else {
+            std::ostringstream os;
+        };
+
+        /** Append to file at path; returns false (and stays disabled)
+         *  if it cannot be opened */
+        bool open(const std::string& path) {
+            file.open(path, std::ios::out | std::ios::app);
+            if (!file) {
+                std::cerr << "WARNING: cannot open telemetry file " << path << ", telemetry disabled\n";
+                return false;
+            }
+            startTime = std::chrono::high_resolution_clock::now();
+            return true;
+        }
+
+        bool enabled() const {
+            return file.is_open();
+        }
+
+        /** New record for event, with time and peak RSS filled in */
+        Record record(const char* event) const {
+            Record result(event);
+            result("time_s", std::chrono::duration<double>(
+                        std::chrono::high_resolution_clock::now() - startTime).count())
+                  ("peak_rss_mb", peakRssMb());
+            return result;
+        }
+
+        void write(const Record& record) {
+            std::lock_guard<std::mutex> lock(fileMutex);
+            file << record.str() << "\n" << std::flush;
+        }
+
+        /** Peak resident set size of this process in MB */
+        static double peakRssMb() {
+#ifdef _WIN32
+            return 0.0;
+#else
+            rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage)) return 0.0;
+            // KB on Linux
+            return usage.ru_maxrss / 1024.0;
+#endif
+        }
+
+    private:
+        std::ofstream file;
+        std::mutex fileMutex;
+        std::chrono::high_resolution_clock::time_point startTime;
+    };
+
+    /** Milliseconds since start */
+    inline double millisSince(const std::chrono::high_resolution_clock::time_point& start) {
+        return std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    /** Event counter for many threads: each thread increments a slot on its
+     *  own cache line, so counting does not contend */
+    class ShardedCounter {
+    public:
+        void add(size_t n = 1) {
+            slots[slot()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        size_t total() const {
+            size_t result = 0;
+            for (const auto& s : slots) {
+                result += s.value.load(std::memory_order_relaxed);
+            }
+            return result;
+        }
+
+    private:
+        static const int NUM_SLOTS = 64;
+        static int slot() {
+            static std::atomic<int> nextSlot(0);
+            thread_local int threadSlot = nextSlot++ % NUM_SLOTS;
+            return threadSlot;
+        }
+        struct alignas(64) Slot {
+            std::atomic<size_t> value{0};
+        };
+        std::array<Slot, NUM_SLOTS> slots;
+    };
+
+    /** Out-of-core training image store: images are written once, zlib
+     *  compressed, into shards of IMAGES_PER_SHARD images in a directory, and
+     *  read back one whole shard at a time, so a trainer sweeping its samples
+     *  in image order streams through the shards sequentially. Depth is stored
+     *  as SparseImage (only the nonzero span of each row), part masks as raw
+     *  bytes (mostly background, so they compress well). Shards are complete
+     *  or absent, so a store interrupted while building can be reopened */
+    class ImageStore {
+    public:
+        static const int IMAGES_PER_SHARD = 256;
+
+        /** Open store in directory path, creating it if it does not exist.
+         *  fingerprint identifies the dataset (see FileDataSource::fingerprint);
+         *  a store built from a different dataset is emptied */
+        ImageStore(const std::string& path, const std::string& fingerprint) : path(path) {
+            static std::atomic<uint64_t> nextInstanceId(1);
+            instanceId = nextInstanceId++;
+            using namespace boost::filesystem;
+            create_directories(path);
+            std::string manifestPath = (boost::filesystem::path(path) / "manifest.txt").string();
+            std::string storedFingerprint;
+            std::ifstream mifs(manifestPath);
+            std::getline(mifs, storedFingerprint);
+            mifs.close();
+            if (storedFingerprint != fingerprint) {
+                if (exists(shardPath(0))) {
+                    std::cerr << "WARNING: image store " << path << " was built from a different dataset, rebuilding it\n";
+                }
+                for (directory_iterator it(path); it != directory_iterator(); ++it) {
+                    if (it->path().filename().string().compare(0, 6, "shard_") == 0) remove(it->path());
+                }
+                std::ofstream mofs(manifestPath);
+                mofs << fingerprint << "\n";
+                mofs.close();
+                if (!mofs) {
+                    std::cerr << "FATAL: failed to write image store manifest " << manifestPath << "\n";
+                    std::exit(1);
+                }
+                return;
+            }
+            while (true) {
+                std::ifstream ifs(shardPath(numShards), std::ios::binary);
+                if (!ifs) break;
+                char marker[8];
+                uint32_t count;
+                ifs.read(marker, 8);
+                util::read_bin(ifs, count);
+                if (!ifs || strncmp(marker, "RTSHARD1", 8)) {
+                    std::cerr << "ERROR: corrupted image store shard " << shardPath(numShards) << ", ignoring it and later shards\n";
+                    break;
+                }
+                for (uint32_t i = 0; i < count; ++i) {
+                    Entry entry;
+                    entry.shard = numShards;
+                    util::read_bin(ifs, entry.index);
+                    util::read_bin(ifs, entry.offset);
+                    util::read_bin(ifs, entry.compressedSize);
+                    util::read_bin(ifs, entry.rawSize);
+                    if (entry.index >= static_cast<int>(location.size())) {
+                        location.resize(entry.index + 1, -1);
+                    }
+                    location[entry.index] = static_cast<int64_t>(entries.size());
+                    entries.push_back(entry);
+                }
+                ++numShards;
+            }
+            if (entries.size()) {
+                std::cout << "Image store " << path << ": " << entries.size() << " images in " << numShards << " shards\n";
+            }
+        }
+
+        /** True if image idx is in the store */
+        bool contains(int idx) const {
+            return idx < static_cast<int>(location.size()) && ~location[idx];
+        }
+
+        /** Add images (in this order) to the store, loading them from data_source */
+        template<class DataSource>
+        void build(const std::vector<int>& images, DataSource& data_source, int num_threads, bool verbose) {
+            if (images.empty()) return;
+            std::cout << "Building image store at " << path << " with " << images.size() << " images...\n" << std::flush;
+            size_t numNewShards = (images.size() - 1) / IMAGES_PER_SHARD + 1;
+            std::vector<std::vector<Entry> > newEntries(numNewShards);
+            std::atomic<size_t> shardIndex(0);
+            auto worker = [&]() {
+                std::vector<char> raw, compressed;
+                while (true) {
+                    size_t k = shardIndex++;
+                    if (k >= numNewShards) break;
+                    if (verbose || k % 100 == 99) {
+                        std::cout << "Writing image store shard " << k + 1 << " of " << numNewShards << "\n" << std::flush;
+                    }
+                    size_t begin = k * IMAGES_PER_SHARD, end = std::min(begin + IMAGES_PER_SHARD, images.size());
+                    std::vector<Entry>& shardEntries = newEntries[k];
+                    std::string blobs;
+                    for (size_t i = begin; i < end; ++i) {
+                        const std::array<cv::Mat, 2>& arr = data_source.load(images[i]);
+                        encode(arr[DATA_DEPTH], arr[DATA_PART_MASK], raw);
+                        uLongf compressedSize = compressBound(raw.size());
+                        compressed.resize(compressedSize);
+                        if (compress2(reinterpret_cast<Bytef*>(compressed.data()), &compressedSize,
+                                reinterpret_cast<const Bytef*>(raw.data()), raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+                            std::cerr << "FATAL: failed to compress image " << images[i] << " for image store\n";
+                            std::exit(1);
+                        }
+                        Entry entry;
+                        entry.shard = numShards + static_cast<int>(k);
+                        entry.index = images[i];
+                        entry.offset = blobs.size();
+                        entry.compressedSize = compressedSize;
+                        entry.rawSize = raw.size();
+                        shardEntries.push_back(entry);
+                        blobs.append(compressed.data(), compressedSize);
+                    }
+                    // Write whole shard, then rename into place
+                    std::string outPath = shardPath(numShards + static_cast<int>(k));
+                    std::ofstream ofs(outPath + ".partial", std::ios::binary);
+                    ofs.write("RTSHARD1", 8);
+                    util::write_bin<uint32_t>(ofs, shardEntries.size());
+                    for (const auto& entry : shardEntries) {
+                        util::write_bin(ofs, entry.index);
+                        util::write_bin(ofs, entry.offset);
+                        util::write_bin(ofs, entry.compressedSize);
+                        util::write_bin(ofs, entry.rawSize);
+                    }
+                    ofs.write(blobs.data(), blobs.size());
+                    ofs.close();
+                    if (!ofs) {
+                        std::cerr << "FATAL: failed to write image store shard " << outPath << "\n";
+                        std::exit(1);
+                    }
+                    boost::filesystem::rename(outPath + ".partial", outPath);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (int i = 0; i < num_threads; ++i) {
+                threads.emplace_back(worker);
+            }
+            for (int i = 0; i < num_threads; ++i) {
+                threads[i].join();
+            }
+
+            for (const auto& shardEntries : newEntries) {
+                for (const auto& entry : shardEntries) {
+                    if (entry.index >= static_cast<int>(location.size())) {
+                        location.resize(entry.index + 1, -1);
+                    }
+                    location[entry.index] = static_cast<int64_t>(entries.size());
+                    entries.push_back(entry);
+                }
+            }
+            numShards += static_cast<int>(numNewShards);
+            std::cout << "Image store complete\n" << std::flush;
+        }
+
+        /** Get (depth, part mask) of image idx, which must be in the store.
+         *  Reads the image's whole shard if it is not the last shard read by
+         *  this thread. The result is valid until the next call on this thread */
+        const std::array<cv::Mat, 2>& load(int idx) const {
+            // Keyed on instanceId, since a new store may reuse a destroyed one's address
+            thread_local uint64_t cachedStoreId = 0;
+            thread_local int cachedShard = -1, cachedIndex = -1;
+            thread_local std::vector<char> shard, raw;
+            thread_local std::array<cv::Mat, 2> arr;
+            if (cachedStoreId == instanceId && cachedIndex == idx) return arr;
+
+            const Entry& entry = entries[location[idx]];
+            if (cachedStoreId != instanceId || cachedShard != entry.shard) {
+                std::ifstream ifs(shardPath(entry.shard), std::ios::binary | std::ios::ate);
+                size_t fileSize = ifs.tellg();
+                ifs.seekg(0);
+                shard.resize(fileSize);
+                ifs.read(shard.data(), fileSize);
+                if (!ifs) {
+                    std::cerr << "FATAL: failed to read image store shard " << shardPath(entry.shard) << "\n";
+                    std::exit(1);
+                }
+                cachedStoreId = instanceId;
+                cachedShard = entry.shard;
+            }
+            // Blobs follow header: marker, count, then (index, offset, sizes) per image
+            size_t blobsBegin = 8 + sizeof(uint32_t) + (shard.size() == 0 ? 0 :
+                    *reinterpret_cast<const uint32_t*>(shard.data() + 8) * ENTRY_HEADER_SIZE);
+            raw.resize(entry.rawSize);
+            uLongf rawSize = entry.rawSize;
+            if (blobsBegin + entry.offset + entry.compressedSize > shard.size() ||
+                    uncompress(reinterpret_cast<Bytef*>(raw.data()), &rawSize,
+                        reinterpret_cast<const Bytef*>(shard.data() + blobsBegin + entry.offset),
+                        entry.compressedSize) != Z_OK || rawSize != entry.rawSize) {
+                std::cerr << "FATAL: corrupted image " << idx << " in image store shard " << shardPath(entry.shard) << "\n";
+                std::exit(1);
+            }
+            decode(raw, arr[DATA_DEPTH], arr[DATA_PART_MASK]);
+            cachedIndex = idx;
+            return arr;
+        }
+
+    private:
+        struct Entry {
+            int shard, index;
+            uint64_t offset, compressedSize, rawSize;
+        };
+        static const size_t ENTRY_HEADER_SIZE = sizeof(int) + 3 * sizeof(uint64_t);
+
+        std::string shardPath(int shard) const {
+            std::ostringstream ss;
+            ss << "shard_" << std::setw(6) << std::setfill('0') << shard << ".bin";
+            return (boost::filesystem::path(path) / ss.str()).string();
+        }
+
+        /** Serialize depth (as SparseImage) and part mask (raw) */
+        static void encode(const cv::Mat& depth, const cv::Mat& part_mask, std::vector<char>& raw) {
+            SparseImage sparse;
+            if (depth.type() == CV_32F) {
+                sparse = depth;
+            } else {
+                cv::Mat depthFloat;
+                depth.convertTo(depthFloat, CV_32F);
+                sparse = depthFloat;
+            }
+            int32_t header[4] = { sparse.rows, sparse.cols,
+                static_cast<int32_t>(sparse.starts.size()), static_cast<int32_t>(sparse.data.size()) };
+            size_t maskSize = part_mask.empty() ? 0 : part_mask.total();
+            raw.resize(sizeof(header) + sparse.starts.size() * sizeof(int) +
+                    sparse.data.size() * sizeof(float) + maskSize);
+            char* ptr = raw.data();
+            std::memcpy(ptr, header, sizeof(header));
+            ptr += sizeof(header);
+            std::memcpy(ptr, sparse.starts.data(), sparse.starts.size() * sizeof(int));
+            ptr += sparse.starts.size() * sizeof(int);
+            std::memcpy(ptr, sparse.data.data(), sparse.data.size() * sizeof(float));
+            ptr += sparse.data.size() * sizeof(float);
+            for (int r = 0; r < part_mask.rows; ++r) {
+                std::memcpy(ptr, part_mask.ptr<uint8_t>(r), part_mask.cols);
+                ptr += part_mask.cols;
+            }
+        }
+
+        static void decode(const std::vector<char>& raw, cv::Mat& depth, cv::Mat& part_mask) {
+            int32_t header[4];
+            const char* ptr = raw.data();
+            std::memcpy(header, ptr, sizeof(header));
+            ptr += sizeof(header);
+            SparseImage sparse;
+            sparse.rows = header[0];
+            sparse.cols = header[1];
+            sparse.starts.resize(header[2]);
+            sparse.data.resize(header[3]);
+            std::memcpy(sparse.starts.data(), ptr, header[2] * sizeof(int));
+            ptr += header[2] * sizeof(int);
+            std::memcpy(sparse.data.data(), ptr, header[3] * sizeof(float));
+            ptr += header[3] * sizeof(float);
+            depth = sparse.toMat();
+            if (ptr == raw.data() + raw.size()) {
+                part_mask.release();
+            } else {
+                // Fresh buffer: callers (DataLoader cache) may share the previous one
+                part_mask = cv::Mat(sparse.rows, sparse.cols, CV_8U);
+                std::memcpy(part_mask.data, ptr, part_mask.total());
+            }
+        }
+
+        std::string path;
+        uint64_t instanceId;
+        int numShards = 0;
+        std::vector<Entry> entries;
+        // Index in entries of each image index, -1 if not stored
+        std::vector<int64_t> location;
+    };
+
+    template<class DataSource>
+    /** Responsible for handling data loading from abstract data source
+     *  Interface: dataLoader.get(sample): get (depth, part mask) images for a sample
+     *             dataLoader.preload(samples, a, b, numThreads): preload images for samples if possible */
+    struct DataLoader {
+        DataSource& dataSource;
+        DataLoader(DataSource& data_source, size_t max_images_loaded) : dataSource(data_source), maxImagesLoaded(max_images_loaded) {}
+
+        /** Precondition: samples must be sorted by image index on [a, ..., b-1] */
+        bool preload(const SampleVec& samples, int a, int b, int numThreads) {
+            std::vector<int> images;
+            images.push_back(samples[a].index);
+            images.reserve((b-a - 1) / 2000 + 1); // HACK
+            size_t loadSize = data.size();
+
+            imageIdx.resize(dataSource.size(), -1);
+            for (int i = a + 1; i < b; ++i) {
+                if (samples[i].index != images.back()) {
+                    images.push_back(samples[i].index);
+                    if (imageIdx[samples[i].index] == -1) {
+                        ++loadSize;
+                    }
+                    // if (samples[i].index < images.back()) {
+                    //     std::cerr << "FATAL: Images not sorted at preload " <<a << "," << b << "\n";
+                    //     std::exit(0);
+                    // }
+                }
+            }
+            if (loadSize - data.size() == 0) return true; // Already all loaded
+            if (images.size() > maxImagesLoaded) {
+                std::cout << "INFO: Number of images too large (" << images.size() <<
+                    " > " << maxImagesLoaded << "), not preloading\n";
+                return false;
+            }
+
+            if (loadSize > maxImagesLoaded) {
+                clear();
+            } else {
                 std::vector<int> newImages;
                 newImages.reserve(loadSize);
                 for (int im : images) {
@@ -603,14 +1920,19 @@ namespace ark {
             data.resize(basei + images.size());
             revImageIdx.resize(basei + images.size());;
 
+            // Image store reads whole shards, so hand out runs of consecutive images
+            size_t chunkSize = store != nullptr ? ImageStore::IMAGES_PER_SHARD : 1;
             auto worker = [&]() {
-                size_t thread_i;
+                size_t chunk_i;
                 while (true) {
-                    thread_i = i++;
-                    if (thread_i >= images.size()) break;
-                    data[basei + thread_i] = dataSource.load(images[thread_i]);
-                    imageIdx[images[thread_i]] = basei + thread_i;
-                    revImageIdx[basei + thread_i] = images[thread_i];
+                    chunk_i = i.fetch_add(chunkSize);
+                    if (chunk_i >= images.size()) break;
+                    size_t chunkEnd = std::min(chunk_i + chunkSize, images.size());
+                    for (size_t thread_i = chunk_i; thread_i < chunkEnd; ++thread_i) {
+                        data[basei + thread_i] = load(images[thread_i]);
+                        imageIdx[images[thread_i]] = basei + thread_i;
+                        revImageIdx[basei + thread_i] = images[thread_i];
+                    }
                 }
             };
             for (int i = 0; i < numThreads; ++i) {
@@ -626,11 +1948,29 @@ namespace ark {
             int iidx = sample.index >= static_cast<int>(imageIdx.size()) ?
                          -1 : imageIdx[sample.index];
             if (iidx < 0) {
-                return dataSource.load(sample.index, hint);
+                return load(sample.index, hint);
             }
+            cacheHits.add();
             return data[iidx];
         }
 
+        /** Load an image bypassing the RAM cache, from the image store if it has it */
+        const std::array<cv::Mat, 2>& load(int idx, int hint = -1) const {
+            // Data sources and the store keep the last image loaded by each thread
+            thread_local int lastIdx = -1, lastHint = -1;
+            if (idx == lastIdx && hint == lastHint) {
+                cacheHits.add();
+            } else {
+                cacheMisses.add();
+                lastIdx = idx;
+                lastHint = hint;
+            }
+            if (store != nullptr && store->contains(idx)) {
+                return store->load(idx);
+            }
+            return dataSource.load(idx, hint);
+        }
+
         void clear() {
             data.clear();
             for (int i : revImageIdx) {
@@ -642,6 +1982,11 @@ namespace ark {
         std::vector<std::array<cv::Mat, 2> > data;
         std::vector<int> imageIdx, revImageIdx;
         size_t maxImagesLoaded;
+        /** Optional on-disk image store, used for images not in RAM */
+        ImageStore* store = nullptr;
+        /** Images served from RAM (preloaded, or the thread's last loaded
+         *  image) and images read from the data source or store */
+        mutable ShardedCounter cacheHits, cacheMisses;
     };
 
     /** Internal trainer implementation */
@@ -658,7 +2003,7 @@ namespace ark {
         Trainer(Trainer&&) =delete;
 
         Trainer(std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes,
-                std::vector<RTree::Distribution>& leaf_data,
+                RTree::LeafTable& leaf_data,
                 DataSource& data_source,
                 int num_parts,
                 size_t max_images_loaded)
@@ -778,15 +2123,13 @@ namespace ark {
                             std::cout << "Added leaf node: id=" << node.leafid << "\n";
                         }
                     }
-                    leafData.emplace_back();
-                    leafData.back().resize(numParts);
-                    leafData.back().setZero();
+                    RTree::LeafTable::Row leaf = leafData.emplace_back();
                     for (size_t i = start; i < end; ++i) {
                         auto samplePart = dataLoader.get(samples[i], DATA_PART_MASK)[DATA_PART_MASK]
                             .template at<uint8_t>(samples[i].pix.y(), samples[i].pix.x());
-                        leafData.back()(samplePart) += 1.f;
+                        leaf(samplePart) += 1.f;
                     }
-                    leafData.back() /= leafData.back().sum();
+                    leaf /= leaf.sum();
                     return;
                 }
                 if (verbose) {
@@ -920,9 +2263,11 @@ namespace ark {
                     if (verbose) {
                         std::cout << "Fast-forward evaluation for small node\n" << std::flush;
                     }
+                    int numConstantFeatures = 0;
                     for (int featureId = 0; featureId < numFeatures; ++featureId) {
                         if (featureThreshes[featureId].empty()) {
-                            std::cerr<< "WARNING: Encountered feature with no canditates thresholds (skipped)\n";
+                            // Constant on these samples (e.g. both probes on background)
+                            ++numConstantFeatures;
                             continue;
                         }
                         auto& bestFeatureThresh = featureThreshes[featureId][0];
@@ -932,6 +2277,9 @@ namespace ark {
                             bestFeature = candidateFeatures[featureId];
                         }
                     }
+                    if (verbose && numConstantFeatures > 0) {
+                        std::cout << "Skipped " << numConstantFeatures << " features constant on this node\n";
+                    }
                 } else {
                     // Interval is long
                     if (verbose && end - start > 500) {
@@ -1167,58 +2515,31 @@ namespace ark {
             int feature_id, std::vector<std::array<float, 2> >& optimal_threshes,
             bool place_best_thresh_first = false) {
 
-            // Initially everything is in left set
-            RTree::Distribution distLeft(numParts), distRight(numParts);
-            distLeft.setZero();
-            distRight.setZero();
+            if (samples.empty()) return;
+            // Score range, for bucketing
+            auto scores = sample_feature_scores.col(feature_id);
+            float minScore = static_cast<float>(scores.minCoeff()),
+                  maxScore = static_cast<float>(scores.maxCoeff());
 
-            // Compute scores
-            std::vector<std::pair<float, int> > samplesByScore;
-            samplesByScore.reserve(samples.size());
+            // Count samples of each part in each score bucket
+            ScoreHistogram histogram(numParts, SPLIT_HISTOGRAM_BINS);
+            histogram.reset(minScore, maxScore);
             for (size_t i = 0; i < samples.size(); ++i) {
-                // const Sample& sample = samples[i];
-                samplesByScore.emplace_back(
-                        sample_feature_scores(i, feature_id), i);
                 uint8_t samplePart = sample_parts(i);
-                if (samplePart >= distLeft.size()) {
+                if (samplePart >= numParts) {
                     std::cerr << "FATAL: Invalid sample " << int(samplePart) << " detected during RTree training, "
                                  "please check the randomization code\n";
                     std::exit(0);
                 }
-                distLeft[samplePart] += 1.f;
-            }
-            static auto scoreComp = [](const std::pair<float, int> & a, const std::pair<float, int> & b) {
-                return a.first < b.first;
-            };
-            std::sort(samplesByScore.begin(), samplesByScore.end(), scoreComp);
-            // std::cerr << samplesByScore.size() << "\n";
-
-            // Start everything in the left set ...
-            float lastScore = -FLT_MAX;
-            for (size_t i = 0; i < samplesByScore.size()-1; ++i) {
-                // Update distributions for left, right sets
-                int idx = samplesByScore[i].second;
-                uint8_t samplePart = sample_parts(idx);
-                distLeft[samplePart] -= 1.f;
-                distRight[samplePart] += 1.f;
-                if (lastScore == samplesByScore[i].first) continue;
-                lastScore = samplesByScore[i].first;
-
-                float left_entropy = entropy(distLeft / distLeft.sum());
-                float right_entropy = entropy(distRight / distRight.sum());
-                // Compute the information gain
-                float infoGain = - ((samples.size() - i - 1) * left_entropy
-                                 + (i+1)                     * right_entropy);
-                if (infoGain > 0) {
-                    std::cerr << "FATAL: Possibly overflow detected during training, exiting. Internal data: left entropy "
-                        << left_entropy << " right entropy "
-                        << right_entropy << " information gain "
-                        << infoGain<< "\n";
-                    std::exit(2);
-                }
-                // Add to candidate threshes
-                optimal_threshes.push_back({infoGain, random_util::uniform(samplesByScore[i].first, samplesByScore[i+1].first)});
+                histogram.add(static_cast<float>(scores(i)), samplePart);
             }
+
+            // Add each bucket edge to candidate threshes
+            histogram.forEachSplit([&](float infoGain, float thresh) {
+                optimal_threshes.push_back({infoGain, thresh});
+            });
+            // All scores in one bucket: feature cannot split the samples
+            if (optimal_threshes.empty()) return;
             if (static_cast<size_t>(threshesPerFeature) < optimal_threshes.size()) {
                 std::nth_element(optimal_threshes.begin(), optimal_threshes.begin() + threshesPerFeature,
                         optimal_threshes.end(), std::greater<std::array<float, 2> >());
@@ -1380,7 +2701,7 @@ namespace ark {
         }
 
         std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes;
-        std::vector<RTree::Distribution>& leafData;
+        RTree::LeafTable& leafData;
         const int numParts;
         DataLoader<DataSource> dataLoader;
 
@@ -1406,7 +2727,7 @@ namespace ark {
         TrainerV2(TrainerV2&&) =delete;
 
         TrainerV2(std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes,
-                std::vector<RTree::Distribution>& leaf_data,
+                RTree::LeafTable& leaf_data,
                 DataSource& data_source,
                 int num_parts,
                 size_t max_images_loaded)
@@ -1422,14 +2743,20 @@ namespace ark {
                    int threshes_per_feature, int num_threads,
                    const std::string& save_path,
                    int mem_limit_mb,
-                   bool verbose) {
+                   bool verbose,
+                   const std::string& image_store_path = "") {
             if (!save_path.empty()) readSamples(save_path, verbose, num_images);
             if (needInitTraining) {
                 std::cerr << "Init RTree training (v2) with maximum depth " << max_tree_depth << "\n";
 
                 // Initialize new samples
+                auto initStart = std::chrono::high_resolution_clock::now();
                 initTraining(num_images, num_points_per_image, max_tree_depth, num_threads, verbose);
                 needInitTraining = false;
+                if (telemetry != nullptr) {
+                    telemetry->write(telemetry->record("init")("trainer", "v2")
+                            ("images", num_images)("samples", samples.size())("init_ms", millisSince(initStart)));
+                }
                 std::cerr << "Init complete\n";
                 if (!save_path.empty()) {
                     std::cerr << "Saving to " << save_path << "\n";
@@ -1439,6 +2766,22 @@ namespace ark {
                 std::cerr << "Resuming RTree training at depth " << depth << " of " << max_tree_depth << "\n";
             }
 
+            std::unique_ptr<ImageStore> imageStore;
+            if (!image_store_path.empty()) {
+                imageStore.reset(new ImageStore(image_store_path, dataLoader.dataSource.fingerprint()));
+                // Store images missing from it, in the order samples first use them,
+                // so sweeps over the samples read shards sequentially
+                std::vector<int> storeImages;
+                std::vector<bool> seen(dataLoader.dataSource.size());
+                for (const auto& sample : samples) {
+                    if (seen[sample.index]) continue;
+                    seen[sample.index] = true;
+                    if (!imageStore->contains(sample.index)) storeImages.push_back(sample.index);
+                }
+                imageStore->build(storeImages, dataLoader.dataSource, num_threads, verbose);
+                dataLoader.store = imageStore.get();
+            }
+
 
             // Train
 
@@ -1489,6 +2832,15 @@ namespace ark {
                     break;
                 }
                 std::cout << "\nRTree training (v2) at depth " << depth << ", " << numNodes << " node(s) remaining at this depth\n" << std::flush;
+                // Telemetry of this level
+                auto levelStart = std::chrono::high_resolution_clock::now();
+                size_t levelCacheHits = dataLoader.cacheHits.total(),
+                       levelCacheMisses = dataLoader.cacheMisses.total();
+                double samplingMs, countMs = 0.0, optimizeMs = 0.0;
+                std::vector<double> nodeScoreMs(numNodes), nodeSearchMs(numNodes);
+                std::vector<float> nodeSamples(numNodes), nodeEntropy(numNodes);
+                std::vector<size_t> nodeSparseSamples(numNodes);
+                std::vector<char> nodeTrained(numNodes);
 
                 if (sparse.size() != numNodes) {
                     std::cerr << "FATAL: the size of the sparse samples vector " << sparse.size() << " is different from the number of nodes " << numNodes << "\n";
@@ -1497,6 +2849,7 @@ namespace ark {
 
                 /** STEP 0 Compute random reatures and sparse samples */
                 feats.resize(numNodes);
+                auto phaseStart = std::chrono::high_resolution_clock::now();
                 {
                     static const double MIN_PROBE = 0.1;
                     std::atomic<int> randomGenIndex(0);
@@ -1541,6 +2894,7 @@ namespace ark {
                     }
                     threads.clear();
                 }
+                samplingMs = millisSince(phaseStart);
 
                 if (!save_path.empty()) {
                     std::cout << "Saving to " << save_path << "\n";
@@ -1557,6 +2911,9 @@ namespace ark {
                     // Skip leaves
                     if (~nodes[currStartNode + nodeid].leafid) continue;
                     auto& subsamples = sparse[nodeid];
+                    nodeTrained[nodeid] = true;
+                    nodeSparseSamples[nodeid] = subsamples.size();
+                    phaseStart = std::chrono::high_resolution_clock::now();
                     Eigen::MatrixXd sampleFeatureScores(subsamples.size(), num_features);
                     // This worker loads and computes the pixel scores and
                     // parts for sparse features
@@ -1589,6 +2946,9 @@ namespace ark {
                         threads.clear();
                     }
 
+                    nodeScoreMs[nodeid] = millisSince(phaseStart);
+                    phaseStart = std::chrono::high_resolution_clock::now();
+
                     // Find best information gain (expected entropy decrease)
                     // This worker finds threshesPerSample optimal thresholds for each feature on the selected sparse features
                     std::atomic<int> featuresLeft(feats[nodeid].size()  - 1);
@@ -1617,6 +2977,7 @@ namespace ark {
                         threads[i].join();
                     }
                     threads.clear();
+                    nodeSearchMs[nodeid] = millisSince(phaseStart);
 
                     // Pick best features
                     if (rankedFeats.size() > num_features_filtered) {
@@ -1641,6 +3002,7 @@ namespace ark {
                     for (size_t batchid = 0; batchid < numBatches; ++batchid)
                     {
                         std::cout << "Counting total samples matching each (feature, thresh) pair, batch " << batchid+1 << " of " << numBatches << "...\n" << std::flush;
+                        phaseStart = std::chrono::high_resolution_clock::now();
                         size_t batchBegin = currStartNode + batchid * nodesPerBatch;
                         size_t batchEnd = std::min(currStartNode + (batchid + 1) * nodesPerBatch, nodes.size());
                         featureThreshCount.resize(batchEnd-batchBegin, num_features_filtered, threshes_per_feature, numParts);
@@ -1670,15 +3032,14 @@ namespace ark {
                                     std::cerr << "FATAL: more features generated than allowed " << nodeFeatures.size() << " > " << num_features_filtered <<", terminated\n";
                                     std::exit(1);
                                 }
-                                uint8_t partid = 0;
+                                const auto& dataArr = dataLoader.get(sample, DATA_DEPTH);
+                                uint8_t partid = samplesParts[sampid];
+                                if (partid >= numParts) {
+                                    std::cerr << "FATAL: Invalid part id " << partid << " detected, possibly samples are corrupted\n";
+                                    std::exit(1);
+                                }
                                 for (int featid = 0; featid < static_cast<int>(nodeFeatures.size()); ++featid) {
                                     Feature& feature = nodeFeatures[featid];
-                                    const auto& dataArr = dataLoader.get(sample, DATA_DEPTH);
-                                    partid = samplesParts[sampid];
-                                    if (partid >= numParts) {
-                                        std::cerr << "FATAL: Invalid part id " << partid << " detected, possibly samples are corrupted\n";
-                                        std::exit(1);
-                                    }
                                     float score = scoreByFeature(dataArr[DATA_DEPTH],
                                             sample.pix, feature.u, feature.v);
 
@@ -1712,6 +3073,8 @@ namespace ark {
                         }
                         threads.clear();
                         // Done counting
+                        countMs += millisSince(phaseStart);
+                        phaseStart = std::chrono::high_resolution_clock::now();
 
                         std::cout << "Finding optimal features, batch " << batchid+1 << " of " << numBatches << "...\n" << std::flush;
                         /** STEP 3 finding optimal feature */
@@ -1729,7 +3092,7 @@ namespace ark {
                                     nodeid = nodeOptIndex++;
                                     if (nodeid >= batchEnd) break;
                                     if (~nodes[nodeid].leafid) continue;
-                                    float bestEntropy = FLT_MAX, bestThresh;
+                                    float bestEntropy = FLT_MAX, bestThresh = 0.f;
                                     Feature bestFeature;
                                     std::vector<Feature, Eigen::aligned_allocator<Feature> > & nodeFeatures = feats[nodeid - currStartNode];
                                     float total = featureCountTotal(nodeid - batchBegin);
@@ -1770,10 +3133,12 @@ namespace ark {
                                             }
                                         }
                                     }
-                                    if (depth >= max_tree_depth) {
-                                        // Max depth reached, force this to be a leaf
+                                    if (depth >= max_tree_depth || bestEntropy == FLT_MAX) {
+                                        // Max depth reached (or no feature can split samples), force this to be a leaf
                                         threadIsLeaf = 4;
                                     }
+                                    nodeSamples[nodeid - currStartNode] = total;
+                                    nodeEntropy[nodeid - currStartNode] = bestEntropy;
                                     // Only display for first one (else gets too messy)
                                     if (verbose && nodeid == batchBegin) {
                                         std::cout<< "[First node in batch] Min expected entropy: " << bestEntropy << " thresh: " << bestThresh <<" u:" << bestFeature.u.transpose() << " v:" << bestFeature.v.transpose() << " split:" << bestPartTotal << "," << total - bestPartTotal << " detect leaf? ";
@@ -1807,10 +3172,12 @@ namespace ark {
                             }
                             threads.clear();
                         }
+                        optimizeMs += millisSince(phaseStart);
                     }
                 }
 
                 std::cout << "Creating new nodes and leaves\n" << std::flush;
+                phaseStart = std::chrono::high_resolution_clock::now();
                 /** STEP 4 making leaves and children */
                 int oldStartNode = currStartNode;
                 currStartNode = static_cast<int>(nodes.size());
@@ -1821,8 +3188,6 @@ namespace ark {
                     auto addLeaf = [&](RTree::RNode& node) {
                         node.leafid = static_cast<int>(leafData.size());
                         leafData.emplace_back();
-                        leafData.back().resize(numParts);
-                        leafData.back().setZero();
                     };
 
                     // Set threshes, make children nodes for all non-leaf nodes, and add leaf data for leaf nodes
@@ -1950,6 +3315,31 @@ namespace ark {
                         std::exit(1);
                     }
                 }
+
+                if (telemetry != nullptr) {
+                    double splitMs = millisSince(phaseStart), scoreMs = 0.0, searchMs = 0.0;
+                    for (int nodeid = 0; nodeid < numNodes; ++nodeid) {
+                        if (!nodeTrained[nodeid]) continue;
+                        scoreMs += nodeScoreMs[nodeid];
+                        searchMs += nodeSearchMs[nodeid];
+                        telemetry->write(telemetry->record("node")
+                                ("trainer", "v2")("node", oldStartNode + nodeid)("depth", depth)
+                                ("samples", nodeSamples[nodeid])("sparse_samples", nodeSparseSamples[nodeid])
+                                ("features", num_features)("features_filtered", std::min<int>(num_features, num_features_filtered))
+                                ("score_ms", nodeScoreMs[nodeid])("search_ms", nodeSearchMs[nodeid])
+                                ("entropy", nodeEntropy[nodeid])
+                                ("result", isLeaf[nodeid] == 4 ? "leaf" : "split"));
+                    }
+                    telemetry->write(telemetry->record("level")
+                            ("trainer", "v2")("depth", depth)("nodes", numNodes)("batches", numBatches)
+                            ("leaves", leafData.size())
+                            ("sampling_ms", samplingMs)("score_ms", scoreMs)("search_ms", searchMs)
+                            ("count_ms", countMs)("optimize_ms", optimizeMs)("split_ms", splitMs)
+                            ("level_ms", millisSince(levelStart))
+                            ("cache_hits", dataLoader.cacheHits.total() - levelCacheHits)
+                            ("cache_misses", dataLoader.cacheMisses.total() - levelCacheMisses)
+                            ("mem_limit_mb", mem_limit_mb));
+                }
             }
             needInitTraining = true;
             if (!save_path.empty()) {
@@ -2088,9 +3478,8 @@ namespace ark {
 
             size_t leafsz;
             util::read_bin(ifs, leafsz);
-            leafData.resize(leafsz);
+            leafData.reset(numParts, leafsz);
             for (int i = 0; i < leafData.size(); ++i) {
-                leafData[i].resize(numParts);
                 for (int j = 0; j < numParts; ++j) {
                     util::read_bin(ifs, leafData[i][j]);
                 }
@@ -2142,62 +3531,37 @@ namespace ark {
             int feature_id, std::vector<float>& output_threshes,
             int threshes_per_feature) {
 
-            // Initially everything is in left set
-            RTree::Distribution distLeft(numParts), distRight(numParts);
-            distLeft.setZero();
-            distRight.setZero();
+            if (indices.empty()) {
+                std::cerr << "FATAL: not enough samples to compute threshes indices.size()=" << indices.size() << "\n";
+                std::exit(1);
+            }
+            // Score range, for bucketing
+            auto scores = sample_feature_scores.col(feature_id);
+            float minScore = static_cast<float>(scores.minCoeff()),
+                  maxScore = static_cast<float>(scores.maxCoeff());
 
-            // Compute scores
-            std::vector<std::pair<float, int> > samplesByScore;
-            samplesByScore.reserve(indices.size());
+            // Count samples of each part in each score bucket
+            ScoreHistogram histogram(numParts, SPLIT_HISTOGRAM_BINS);
+            histogram.reset(minScore, maxScore);
             for (size_t i = 0; i < indices.size(); ++i) {
-                samplesByScore.emplace_back(
-                        sample_feature_scores(i, feature_id), i);
                 uint8_t samplePart = sample_parts(indices[i]);
-                if (samplePart >= distLeft.size()) {
+                if (samplePart >= numParts) {
                     std::cerr << "FATAL: Invalid sample " << int(samplePart) << " detected during RTree training, "
                                  "please check the randomization code\n";
                     std::exit(0);
                 }
-                distLeft[samplePart] += 1.f;
+                histogram.add(static_cast<float>(scores(i)), samplePart);
             }
-            static auto scoreComp = [](const std::pair<float, int> & a, const std::pair<float, int> & b) {
-                return a.first < b.first;
-            };
-            std::sort(samplesByScore.begin(), samplesByScore.end(), scoreComp);
-            // std::cerr << samplesByScore.size() << "\n";
 
-            // Start everything in the left set ...
-            float lastScore = -FLT_MAX;
-            if (samplesByScore.empty()) {
-                std::cerr << "FATAL: not enough samples to compute threshes indices.size()=" << indices.size() << "\n";
-                std::exit(1);
-            }
+            // Add each bucket edge to candidate threshes
             std::vector<std::array<float, 2> > optimalThreshes;
-            for (size_t i = 0; i < samplesByScore.size()-1; ++i) {
-                // Update distributions for left, right sets
-                int idx = samplesByScore[i].second;
-
-                uint8_t samplePart = sample_parts(indices[idx]);
-                distLeft[samplePart] -= 1.f;
-                distRight[samplePart] += 1.f;
-                if (lastScore == samplesByScore[i].first) continue;
-                lastScore = samplesByScore[i].first;
-
-                float left_entropy = entropy(distLeft / distLeft.sum());
-                float right_entropy = entropy(distRight / distRight.sum());
-                // Compute the information gain
-                float infoGain = - ((indices.size() - i - 1) * left_entropy
-                                 + (i+1)                     * right_entropy);
-                if (infoGain > 0) {
-                    std::cerr << "FATAL: Possibly overflow detected during training, exiting. Internal data: left entropy "
-                        << left_entropy << " right entropy "
-                        << right_entropy << " information gain "
-                        << infoGain<< "\n";
-                    std::exit(2);
-                }
-                // Add to candidate threshes
-                optimalThreshes.push_back({infoGain, random_util::uniform(samplesByScore[i].first, samplesByScore[i+1].first)});
+            histogram.forEachSplit([&](float infoGain, float thresh) {
+                optimalThreshes.push_back({infoGain, thresh});
+            });
+            output_threshes.clear();
+            if (optimalThreshes.empty()) {
+                // All scores in one bucket: feature cannot split the samples
+                return std::numeric_limits<float>::lowest();
             }
             if (static_cast<size_t>(threshes_per_feature) < optimalThreshes.size()) {
                 std::nth_element(optimalThreshes.begin(), optimalThreshes.begin() + threshes_per_feature,
@@ -2206,13 +3570,9 @@ namespace ark {
             std::nth_element(optimalThreshes.begin(), optimalThreshes.begin() + 1, optimalThreshes.end(), std::greater<std::array<float, 2> >());
             size_t numOutputThreshes = std::min(static_cast<size_t>(threshes_per_feature), optimalThreshes.size());
             output_threshes.reserve(numOutputThreshes);
-            output_threshes.clear();
             for (size_t i = 0; i < numOutputThreshes; ++i) {
                 output_threshes.push_back(optimalThreshes[i][1]);
             }
-            if (optimalThreshes.empty()) {
-                std::cerr << "FATAL: no threshes found, input indices size: " << indices.size() << "\n";
-            }
             return optimalThreshes[0][0];
         }
 
@@ -2312,9 +3672,13 @@ namespace ark {
         }
 
         std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes;
-        std::vector<RTree::Distribution>& leafData;
+        RTree::LeafTable& leafData;
         const int numParts;
         DataLoader<DataSource> dataLoader;
+    public:
+        /** Optional telemetry, written per node and level if set */
+        TrainingTelemetry* telemetry = nullptr;
+    private:
 
         /* Indices of sparse samples for each node (initially not sparse, is made sparse early in each loop) */
         std::vector<std::vector<size_t > > sparse;
@@ -2333,8 +3697,134 @@ namespace ark {
         std::vector<int> chosenImages;
     };
 
+    /** Set on SIGINT (see sigHandler): all trainers save and stop */
+    std::atomic<bool> panicMode(false);
+
+    /** Bounded blocking queue on a ring buffer, for producer/consumer pipelines */
+    template<class T>
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity) : ring(capacity) {}
+
+        /** Add item, waiting while the queue is full */
+        void push(T&& item) {
+            std::unique_lock<std::mutex> lock(mtx);
+            notFull.wait(lock, [this]() { return count < ring.size(); });
+            ring[(head + count) % ring.size()] = std::move(item);
+            ++count;
+            notEmpty.notify_one();
+        }
+
+        /** Remove next item, waiting while the queue is empty.
+         *  Returns false if the queue is empty and closed */
+        bool pop(T& item) {
+            std::unique_lock<std::mutex> lock(mtx);
+            notEmpty.wait(lock, [this]() { return count > 0 || closed; });
+            if (count == 0) return false;
+            item = std::move(ring[head]);
+            head = (head + 1) % ring.size();
+            --count;
+            notFull.notify_one();
+            return true;
+        }
+
+        /** No more items will be pushed: wake consumers waiting on an empty queue */
+        void close() {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+            notEmpty.notify_all();
+        }
+
+    private:
+        std::vector<T> ring;
+        size_t head = 0, count = 0;
+        bool closed = false;
+        std::mutex mtx;
+        std::condition_variable notFull, notEmpty;
+    };
+
+    /** Rendered training image (see renderImages) */
+    struct RenderedImage {
+        int index;
+        cv::Mat depth, partMask;
+    };
+
+    /** Set candidates to the foreground pixels of part_mask */
+    inline void findCandidates(const cv::Mat& part_mask,
+            std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> >& candidates) {
+        candidates.clear();
+        for (int r = 0; r < part_mask.rows; ++r) {
+            auto* ptr = part_mask.ptr<uint8_t>(r);
+            for (int c = 0; c < part_mask.cols; ++c) {
+                if (ptr[c] != 255) {
+                    candidates.emplace_back();
+                    candidates.back() << c, r;
+                }
+            }
+        }
+    }
+
+    /** Number of consecutive images each renderImages renderer thread claims at once */
+    const int RENDER_CHUNK_SIZE = AvatarBatch::SKIN_LANES;
+
+    /** Number of consumer threads renderImages runs for num_threads threads */
+    inline int numRenderConsumers(int num_threads) {
+        return std::max(num_threads / 4, 1);
+    }
+
+    /** Render images {0 ... num_images-1} of data_source and pass each to
+     *  consume(image, consumer_id). Renderer threads (num_threads) fill a
+     *  bounded ring buffer that consumer threads (numRenderConsumers)
+     *  drain, so rendering never waits for preprocessing, and at most a
+     *  few dense images exist at once. Part masks are rendered unless
+     *  skip_part_mask */
+    template<class DataSource, class Consume>
+    void renderImages(DataSource& data_source, int num_images, int num_threads,
+            bool skip_part_mask, bool verbose, Consume consume) {
+        int numConsumers = numRenderConsumers(num_threads);
+        BoundedQueue<RenderedImage> queue(2 * (num_threads + numConsumers));
+        std::atomic<int> imageIndex(0), renderersLeft(num_threads);
+        auto renderer = [&]() {
+            while (true) {
+                // Claim consecutive images, which AvatarDataSource poses together
+                int begin = imageIndex.fetch_add(RENDER_CHUNK_SIZE);
+                if (begin >= num_images) break;
+                for (int i = begin; i < std::min(begin + RENDER_CHUNK_SIZE, num_images); ++i) {
+                    if (verbose && i % 1000 == 999) {
+                        std::cout << "Preprocessing images: " << i+1 << " of " << num_images << "\n" << std::flush;
+                    }
+                    RenderedImage image;
+                    image.index = i;
+                    data_source.loadSimple(i, image.depth, image.partMask, skip_part_mask);
+                    queue.push(std::move(image));
+                }
+            }
+            if (--renderersLeft == 0) queue.close();
+        };
+        auto consumer = [&](int consumer_id) {
+            RenderedImage image;
+            while (queue.pop(image)) {
+                consume(image, consumer_id);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back(renderer);
+        }
+        for (int i = 0; i < numConsumers; ++i) {
+            threads.emplace_back(consumer, i);
+        }
+        for (auto& thd : threads) {
+            thd.join();
+        }
+    }
+
+    class AvatarForestTrainer;
+
     /** Fast, high memory trainer for avatar source only */
     class AvatarTrainerV3 {
+        friend class AvatarForestTrainer;
+        friend class AvatarTrainingWorker;
     public:
         struct Sample3 {
             Sample3 () {}
@@ -2361,38 +3851,78 @@ namespace ark {
         AvatarTrainerV3(AvatarTrainerV3&&) =delete;
 
         AvatarTrainerV3(std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes,
-                std::vector<RTree::Distribution>& leaf_data,
+                RTree::LeafTable& leaf_data,
                 AvatarDataSource& data_source,
                 int num_parts)
-            : nodes(nodes), leafData(leaf_data),
+            : nodes(nodes), leafData(leaf_data), data(ownData),
+              dataSource(data_source), numParts(num_parts) { }
+
+        /** Trainer using images rendered by someone else (see AvatarForestTrainer) */
+        AvatarTrainerV3(std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes,
+                RTree::LeafTable& leaf_data,
+                AvatarDataSource& data_source,
+                std::vector<SparseImage>& shared_data,
+                int num_parts)
+            : nodes(nodes), leafData(leaf_data), data(shared_data),
               dataSource(data_source), numParts(num_parts) { }
 
         /** Information gain computation state
          *  (one copy per thread) to save reallocations */
         struct IGTrainState3 {
             IGTrainState3(int numParts, int numThreshes) :
-                distLeft(numParts), distRight(numParts),
-                buckets(numParts, numThreshes) {}
-            RTree::Distribution distLeft, distRight;
-            Eigen::MatrixXf buckets;
+                histogram(numParts, numThreshes) {}
+            ScoreHistogram histogram;
+            // Score of each sample in the node being trained
+            // (if at most MAX_CACHED_SCORES samples)
+            std::vector<float> scores;
+            // Time spent scoring samples and searching thresholds (with telemetry)
+            double scoreMs = 0.0, searchMs = 0.0;
         };
 
+        /** Largest node for which optimalInformationGain3 keeps sample scores
+         *  between its two passes (16 MB per thread) */
+        static const size_t MAX_CACHED_SCORES = 1 << 22;
+
         void train(int num_images, int num_points_per_image, int num_features,
                    int max_probe_offset, int min_samples, int min_samples_per_feature,
                    int max_tree_depth, int num_threads,
                    const std::string& save_path,
-                   bool verbose) {
+                   bool verbose, int probe_ring_size = 0) {
             // Initialize
             if (save_path.size()) {
                 readSamples(save_path);
             }
             bool firstTime = samples.empty();
+            auto initStart = std::chrono::high_resolution_clock::now();
             initTraining(num_images, num_points_per_image, max_tree_depth, num_threads, verbose);
+            if (telemetry != nullptr) {
+                telemetry->write(telemetry->record("init")("trainer", "v3")
+                        ("images", num_images)("samples", samples.size())("init_ms", millisSince(initStart)));
+            }
 
             std::cout << "\nInit RTree (v3) training with maximum depth " << max_tree_depth << "\n" << std::flush;
+            trainSamples(num_features, max_probe_offset, min_samples, min_samples_per_feature,
+                    max_tree_depth, num_threads, save_path, verbose, firstTime, probe_ring_size);
+        }
 
-            // Train
+        /** True if training was stopped by SIGINT (after saving) */
+        bool halted = false;
+        /** Optional telemetry, written per node and level if set,
+         *  with field "tree": telemetryTree if not -1 */
+        TrainingTelemetry* telemetry = nullptr;
+        int telemetryTree = -1;
+    private:
+        /** Train tree on samples (after initTraining). first_time should be
+         *  true unless samples were read from a save file. If probe_ring_size
+         *  is at least 2, features are drawn from that many offsets per level
+         *  (see buildProbeRing) */
+        void trainSamples(int num_features,
+                   int max_probe_offset, int min_samples, int min_samples_per_feature,
+                   int max_tree_depth, int num_threads,
+                   const std::string& save_path,
+                   bool verbose, bool firstTime, int probe_ring_size = 0) {
             numFeatures = num_features;
+            probeRingSize = probe_ring_size >= 2 ? probe_ring_size : 0;
             maxProbeOffset = max_probe_offset;
             minSamples = min_samples;
             minSamplesPerFeature = min_samples_per_feature;
@@ -2413,16 +3943,16 @@ namespace ark {
                 }
             }
 
-            trainFromNode(0, max_tree_depth);
-            std::cout << "RTree v3 training finished (▀̿Ĺ̯▀̿ ̿)\n" << std::flush;
+            trainLevels(max_tree_depth);
+            std::vector<float>().swap(probeRing);
+            if (!halted) {
+                std::cout << "RTree v3 training finished (▀̿Ĺ̯▀̿ ̿)\n" << std::flush;
+            }
         }
 
-        volatile bool panicMode = false;
-    private:
         /** Initialization helper */
         void initTraining(int num_images, int num_points_per_image, int max_tree_depth, int num_threads, bool verbose) {
             // Choose num_points_per_image random foreground pixels from each image,
-            std::atomic<size_t> imageIndex(0);
             data.resize(num_images);
             bool firstTime = samples.empty();
             if (firstTime) {
@@ -2431,58 +3961,31 @@ namespace ark {
             } else {
                 std::cout << "Resuming training: reloading images...\n" << std::flush;
             }
-            auto worker = [&]() {
-                size_t i;
-                SampleVec3 threadSamples;
-                threadSamples.reserve(samples.capacity() / num_threads + 1);
-                while (true) {
-                    i = imageIndex++;
-                    if (i >= num_images) break;
-                    if (verbose && i % 1000 == 999) {
-                        std::cout << "Preprocessing images: " << i+1 << " of " << num_images << "\n" << std::flush;
-                    }
-
-                    cv::Mat mask, depth;
-                    dataSource.loadSimple(i, depth, mask, !firstTime);
-                    data[i] = depth;
-                    if (!firstTime) continue;
-                    // cv::Mat mask2 = dataLoader.get(Sample(chosenImages[i], 0, 0))[DATA_PART_MASK];
-                    // cv::hconcat(mask, mask2, mask);
-                    // cv::resize(mask, mask, mask.size() / 2);
-                    // cv::imshow("MASKCat", mask);
-                    // cv::waitKey(0);
-                    std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > candidates;
-                    for (int r = 0; r < mask.rows; ++r) {
-                        auto* ptr = mask.ptr<uint8_t>(r);
-                        for (int c = 0; c < mask.cols; ++c) {
-                            if (ptr[c] != 255) {
-                                candidates.emplace_back();
-                                candidates.back() << c, r;
-                            }
-                        }
-                    }
-                    std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > chosenCandidates =
-                        (candidates.size() > static_cast<size_t>(num_points_per_image)) ?
-                        random_util::choose(candidates, num_points_per_image) : std::move(candidates);
-                    for (auto& v : chosenCandidates) {
-                        threadSamples.emplace_back(i, v, mask.at<uint8_t>(v(1), v(0)));
-                    }
+            std::vector<SampleVec3> consumerSamples(numRenderConsumers(num_threads));
+            renderImages(dataSource, num_images, num_threads, !firstTime, verbose,
+                    [&](RenderedImage& image, int consumer_id) {
+                data[image.index] = image.depth;
+                if (!firstTime) return;
+                std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > candidates;
+                findCandidates(image.partMask, candidates);
+                std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > chosenCandidates =
+                    (candidates.size() > static_cast<size_t>(num_points_per_image)) ?
+                    random_util::choose(candidates, num_points_per_image) : std::move(candidates);
+                for (auto& v : chosenCandidates) {
+                    consumerSamples[consumer_id].emplace_back(image.index, v, image.partMask.at<uint8_t>(v(1), v(0)));
                 }
-                std::lock_guard<std::mutex> lock(trainMutex);
-                std::move(threadSamples.begin(), threadSamples.end(), std::back_inserter(samples));
-            };
-
-            {
-                std::vector<std::thread> threads;
-                for (int i = 0; i < num_threads; ++i) {
-                    threads.emplace_back(worker);
-                }
-                for (int i = 0; i < num_threads; ++i) {
-                    threads[i].join();
-                }
-            }
+            });
+            for (auto& consumerSample : consumerSamples) {
+                std::move(consumerSample.begin(), consumerSample.end(), std::back_inserter(samples));
+            }
 
             std::cout << "Preprocessing done, sparsely verifying data validity before training...\n" << std::flush;
+            verifySamples();
+            std::cout << "Result: data is valid\n" << std::flush;
+        }
+
+        /** Re-render images of about 100 samples and check none are background */
+        void verifySamples() {
             for (size_t i = 0; i < samples.size(); i += std::max<size_t>(samples.size() / 100, 1)) {
                 auto& sample = samples[i];
                 cv::Mat mask, depth;
@@ -2492,157 +3995,564 @@ namespace ark {
                     std::exit(0);
                 }
             }
-            std::cout << "Result: data is valid\n" << std::flush;
         }
 
         std::vector<uint8_t> samplesParts;
-        std::mutex trainMutex;
-        void trainFromNode(int node_id, uint32_t depth) {
-            auto& node = nodes[node_id];
-            size_t start = nodeInterval[node_id][0],
-                   end   = nodeInterval[node_id][1];
-            if (~node.leafid) return;
-            if (depth <= 1 || end - start <= minSamples) {
-                // Leaf
-                node.leafid = static_cast<int>(leafData.size());
-                if (verbose) {
-                    if (node.leafid % 500 == 0) {
-                        std::cout << "Added leaf node: id=" << node.leafid << "\n";
+
+        /** Node to be trained in the current level */
+        struct OpenNode {
+            int id;
+            // Remaining depth
+            uint32_t depth;
+            // Number of samples of each part in the node
+            RTree::Distribution counts;
+            // Samples {start ... end-1} are in the node
+            size_t start, end;
+        };
+
+        /** Best split found for an OpenNode */
+        struct NodeSplit {
+            Feature feature;
+            float thresh, infoGain;
+            // Samples {start ... mid-1} go left
+            size_t mid;
+            // False if not found (interrupted by panicMode)
+            bool found = false;
+            // Search statistics for telemetry: features evaluated, threads,
+            // time spent scoring samples, searching thresholds and splitting
+            int numFeatures = 0, numThreads = 1;
+            double scoreMs = 0.0, searchMs = 0.0, splitMs = 0.0;
+        };
+
+        /** Train all open nodes level by level. Each level is one pass over the
+         *  sample array: small nodes are trained one per thread, large nodes by
+         *  all threads. Per-part counts are computed only for the smaller child
+         *  of each split; the larger child's are the parent's minus these.
+         *  Pure nodes become leaves without searching for a split */
+        void trainLevels(uint32_t max_tree_depth) {
+            if (savePath.size()) openLog();
+            std::vector<OpenNode> level = findOpenNodes(max_tree_depth);
+            // Save once when training reaches remaining depth 15. A level may mix depths
+            // (e.g. on resume), so check the shallowest node rather than exact equality
+            auto minDepth = [](const std::vector<OpenNode>& nodes) {
+                uint32_t result = std::numeric_limits<uint32_t>::max();
+                for (const OpenNode& node : nodes) result = std::min(result, node.depth);
+                return result;
+            };
+            bool checkpointWritten = true;
+            for (const OpenNode& node : level) {
+                if (node.depth > 15) checkpointWritten = false;
+            }
+            while (!level.empty()) {
+                if (savePath.size() && !checkpointWritten && minDepth(level) <= 15) {
+                    std::cout << "Saving to " << savePath << "\n" << std::flush;
+                    writeSamples(savePath);
+                    std::cout << "Save complete\n" << std::flush;
+                    checkpointWritten = true;
+                }
+                level = trainLevel(level);
+                if (panicMode) {
+                    // Unfinished nodes stay open and are trained on resume
+                    if (savePath.size()) {
+                        std::cout << "Saving to " << savePath << "\n" << std::flush;
+                        writeSamples(savePath);
+                        std::cout << "Save complete\n" << std::flush;
                     }
+                    // Unwind; caller exits once all trainers have saved
+                    halted = true;
+                    return;
                 }
-                leafData.emplace_back(numParts);
-                leafData.back().setZero();
-                for (size_t i = start; i < end; ++i) {
-                    leafData.back()(samples[i].label) += 1.f;
+            }
+        }
+
+        /** Nodes not yet split or made leaves (only the root
+         *  unless resuming), with their remaining depth. Children of
+         *  a zero info gain split keep remaining depth 0 */
+        std::vector<OpenNode> findOpenNodes(uint32_t max_tree_depth) {
+            std::vector<OpenNode> open;
+            std::vector<std::pair<int, uint32_t> > stk;
+            stk.emplace_back(0, max_tree_depth);
+            while (stk.size()) {
+                int id = stk.back().first;
+                uint32_t depth = stk.back().second;
+                stk.pop_back();
+                const auto& node = nodes[id];
+                if (~node.leafid) continue;
+                if (~node.lnode && ~node.rnode) {
+                    uint32_t childDepth = isStopped(id) ? 0 : depth - 1;
+                    stk.emplace_back(node.rnode, childDepth);
+                    stk.emplace_back(node.lnode, childDepth);
+                    continue;
+                }
+                open.push_back({id, depth, countParts(nodeInterval[id][0], nodeInterval[id][1]),
+                        nodeInterval[id][0], nodeInterval[id][1]});
+            }
+            return open;
+        }
+
+        /** Number of samples of each part in {start ... end-1} */
+        RTree::Distribution countParts(size_t start, size_t end) {
+            RTree::Distribution counts(numParts);
+            counts.setZero();
+            for (size_t i = start; i < end; ++i) {
+                counts(samples[i].label) += 1.f;
+            }
+            return counts;
+        }
+
+        /** Train one level of open nodes, returning the next level */
+        std::vector<OpenNode> trainLevel(std::vector<OpenNode>& level) {
+            std::vector<OpenNode> nextLevel;
+            std::vector<OpenNode*> toSplit;
+            size_t levelSamples = 0;
+            for (auto& open : level) {
+                if (open.depth <= 1 || open.end - open.start <= minSamples ||
+                        (open.counts.array() > 0.f).count() <= 1) {
+                    makeLeaf(open.id, open.counts);
+                } else {
+                    toSplit.push_back(&open);
+                    levelSamples += open.end - open.start;
+                }
+            }
+            if (toSplit.empty()) return nextLevel;
+            auto levelStart = std::chrono::high_resolution_clock::now();
+            // A resumed level may mix depths
+            uint32_t minDepth = toSplit[0]->depth, maxDepth = toSplit[0]->depth;
+            for (const OpenNode* open : toSplit) {
+                minDepth = std::min(minDepth, open->depth);
+                maxDepth = std::max(maxDepth, open->depth);
+            }
+            if (maxDepth > 4 || verbose) {
+                std::cout << "RTree training (v3) for level with remaining depth: " << minDepth;
+                if (maxDepth > minDepth) std::cout << " to " << maxDepth;
+                std::cout << ". Internal nodes: " << toSplit.size() << ", samples: " << levelSamples << "\n" << std::flush;
+            }
+            double probeRingMs = 0.0;
+            if (probeRingSize) {
+                auto ringStart = std::chrono::high_resolution_clock::now();
+                buildProbeRing(toSplit);
+                probeRingMs = millisSince(ringStart);
+            }
+
+            // Large nodes are searched by all threads, one at a time
+            std::vector<size_t> smallNodes;
+            for (size_t i = 0; i < toSplit.size() && !panicMode; ++i) {
+                const OpenNode& open = *toSplit[i];
+                if ((open.end - open.start) * numThreads <= levelSamples) {
+                    smallNodes.push_back(i);
+                    continue;
+                }
+                if (open.depth > 4) {
+                    std::cout << "RTree training (v3) for internal node, remaining depth: " << open.depth <<
+                        ". Current data interval: " << open.start << " to " << open.end << "\n";
+                    if (open.depth > 6) std::cout << std::flush;
+                }
+                applySplit(open, findSplit(open, numThreads), nextLevel);
+            }
+
+            // Small nodes are searched by one thread each
+            std::atomic<size_t> smallIndex(0);
+            auto worker = [&]() {
+                while (!panicMode) {
+                    size_t i = smallIndex++;
+                    if (i >= smallNodes.size()) break;
+                    const OpenNode& open = *toSplit[smallNodes[i]];
+                    applySplit(open, findSplit(open, 1), nextLevel);
+                }
+            };
+            {
+                std::vector<std::thread> threadMgr;
+                for (int i = 0; i < std::min<int>(numThreads, static_cast<int>(smallNodes.size())); ++i) {
+                    threadMgr.emplace_back(worker);
+                }
+                for (auto& thd : threadMgr) {
+                    thd.join();
                 }
-                leafData.back() /= leafData.back().sum();
-                return;
             }
-            if (~node.lnode && ~node.rnode) {
-                trainFromNode(node.lnode, depth - 1);
-                trainFromNode(node.rnode, depth - 1);
+            if (telemetry != nullptr) {
+                auto record = telemetry->record("level");
+                record("trainer", "v3");
+                if (~telemetryTree) record("tree", telemetryTree);
+                record("remaining_depth", maxDepth)("min_remaining_depth", minDepth)
+                      ("nodes", toSplit.size())("leaves", level.size() - toSplit.size())
+                      ("samples", levelSamples)("level_ms", millisSince(levelStart));
+                if (probeRingSize) record("probe_ring_ms", probeRingMs);
+                telemetry->write(record);
+            }
+            return nextLevel;
+        }
+
+        /** Create children of open from its split (which has been applied to
+         *  the samples) and add them to next_level, logging the split.
+         *  Thread safe */
+        void applySplit(const OpenNode& open, const NodeSplit& split, std::vector<OpenNode>& next_level) {
+            if (!split.found) return;
+            // Count smaller child outside lock
+            bool leftSmaller = split.mid - open.start <= open.end - split.mid;
+            RTree::Distribution smallerCounts = leftSmaller ?
+                countParts(open.start, split.mid) : countParts(split.mid, open.end);
+
+            std::lock_guard<std::mutex> lock(nodesMutex);
+            bool forceLeaf = split.mid == open.end || split.mid == open.start;
+            if (telemetry != nullptr) {
+                auto record = telemetry->record("node");
+                record("trainer", "v3");
+                if (~telemetryTree) record("tree", telemetryTree);
+                telemetry->write(record("node", open.id)("remaining_depth", open.depth)
+                        ("samples", open.end - open.start)("features", split.numFeatures)
+                        ("threads", split.numThreads)("score_ms", split.scoreMs)
+                        ("search_ms", split.searchMs)("split_ms", split.splitMs)
+                        ("info_gain", split.infoGain)("result", forceLeaf ? "leaf" : "split"));
+            }
+            if (forceLeaf) {
+                makeLeaf(open.id, open.counts);
                 return;
             }
-            if (depth > 4) {
-                std::cout << "RTree training (v3) for internal node, remaining depth: " << depth <<
-                    ". Current data interval: " << start << " to " << end << "\n";
-               if (depth > 6) std::cout << std::flush;
+            int lnode = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+            nodeInterval.push_back({open.start, split.mid});
+
+            int rnode = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+            nodeInterval.push_back({split.mid, open.end});
+
+            auto& node = nodes[open.id];
+            node.thresh = split.thresh;
+            node.u = split.feature.u;
+            node.v = split.feature.v;
+            node.lnode = lnode;
+            node.rnode = rnode;
+
+            // If the 'info gain' [actually is -(expected new entropy)] was zero then
+            // it means all of children have same class, so we should stop
+            bool stop = split.infoGain == 0.f;
+            if (stop) setStopped(open.id);
+            logSplit(open.id);
+            uint32_t childDepth = stop ? 0 : open.depth - 1;
+            RTree::Distribution largerCounts = open.counts - smallerCounts;
+            next_level.push_back({lnode, childDepth, leftSmaller ? smallerCounts : largerCounts,
+                    open.start, split.mid});
+            next_level.push_back({rnode, childDepth, leftSmaller ? largerCounts : smallerCounts,
+                    split.mid, open.end});
+        }
+
+        /** Make node a leaf with distribution proportional to counts
+         *  and log it. Caller must hold nodesMutex if threads are running */
+        void makeLeaf(int id, const RTree::Distribution& counts) {
+            auto& node = nodes[id];
+            node.leafid = static_cast<int>(leafData.size());
+            if (verbose) {
+                if (node.leafid % 500 == 0) {
+                    std::cout << "Added leaf node: id=" << node.leafid << "\n";
+                }
+            }
+            RTree::LeafTable::Row leaf = leafData.emplace_back();
+            leaf = counts / counts.sum();
+            logLeaf(id);
+        }
+
+        /** Draw probeRingSize random probe offsets for this level and read the
+         *  depth at each offset from each sample in to_split (the probe ring),
+         *  so that features, which are then pairs of these offsets, are scored
+         *  by two sequential table lookups per sample instead of random image
+         *  reads. Probes are those scoreByFeature would read for the pair,
+         *  so chosen splits apply unchanged at inference */
+        void buildProbeRing(const std::vector<OpenNode*>& to_split) {
+            probeOffsets.resize(probeRingSize);
+            for (auto& offset : probeOffsets) {
+                offset.x() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
+                offset.y() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
+            }
+            size_t numSamples = samples.size();
+            if (probeRing.size() != numSamples * probeRingSize) {
+                probeRing.resize(numSamples * probeRingSize);
+                std::cout << "Probe ring: " << probeRingSize << " offsets per level, " <<
+                    (probeRing.size() * sizeof(float) >> 20) << " MB\n" << std::flush;
+            }
+
+            // Chunks of nodes' intervals, one per thread at a time
+            const size_t CHUNK_SIZE = 16384;
+            std::vector<std::pair<size_t, size_t> > chunks;
+            for (const OpenNode* open : to_split) {
+                for (size_t i = open->start; i < open->end; i += CHUNK_SIZE) {
+                    chunks.emplace_back(i, std::min(i + CHUNK_SIZE, open->end));
+                }
             }
-            if (savePath.size() && (depth == 15 || panicMode)) {
-                std::cout << "Saving to " << savePath << "\n" << std::flush;
-                writeSamples(savePath);
-                std::cout << "Save complete\n" << std::flush;
+            std::atomic<size_t> chunkIndex(0);
+            auto worker = [&]() {
+                while (true) {
+                    size_t c = chunkIndex++;
+                    if (c >= chunks.size()) break;
+                    for (size_t i = chunks[c].first; i < chunks[c].second; ++i) {
+                        const Sample3& sample = samples[i];
+                        const SparseImage& image = data[sample.index];
+                        float sampleDepth = image.at<float>(sample.pix.y(), sample.pix.x());
+                        for (int k = 0; k < probeRingSize; ++k) {
+                            probeRing[k * numSamples + i] =
+                                getProbeDepth(image, sample.pix, sampleDepth, probeOffsets[k]);
+                        }
+                    }
+                }
+            };
+            std::vector<std::thread> threadMgr;
+            for (int i = 0; i < numThreads; ++i) {
+                threadMgr.emplace_back(worker);
             }
-            if (panicMode) {
-                std::cout << "PANIC: Termination procedure complete\n" << std::flush;
-                std::exit(0);
+            for (auto& thd : threadMgr) {
+                thd.join();
             }
+        }
 
-            int mid;
-            float bestInfoGain;
-            {
-                Eigen::VectorXf bestInfoGains(numThreads, 1);
-                Eigen::VectorXf bestThreshs(numThreads, 1);
-                bestInfoGains.setConstant(-FLT_MAX);
-                std::vector<Feature> bestFeatures(numThreads);
-
-                std::atomic<int> featureCount(numFeatures);
-                // Mapreduce-ish
-                auto worker = [&](int thread_id) {
-                    // Thread-specific training data
-                    IGTrainState3 trainState(numParts, minSamplesPerFeature /*misnomer*/);
-                    float& bestInfoGain = bestInfoGains(thread_id);
-                    float& bestThresh = bestThreshs(thread_id);
-                    float optimalThresh;
-                    Feature& bestFeature = bestFeatures[thread_id];
-                    Feature feature;
-                    int threadFeatId;
-                    while (true) {
-                        threadFeatId = featureCount--;
-                        if (threadFeatId <= 0) break;
-                        if (end-start > 500000 && depth > 4) {
-                            if (threadFeatId % 500 == 0 ||
-                                (end-start > 10000000 &&
-                                 (threadFeatId % 100 == 0
-                                 || (end-start > 200000000
-                                     && threadFeatId % 10 == 0)))) {
-                                std::cout << threadFeatId << " features remain\n" << std::flush;
-                            }
+        /** Find best split of an open node over numFeatures random features
+         *  using num_threads threads, and split its samples accordingly */
+        NodeSplit findSplit(const OpenNode& open, int num_threads) {
+            size_t start = open.start, end = open.end;
+            uint32_t depth = open.depth;
+            NodeSplit result;
+
+            Eigen::VectorXf bestInfoGains(num_threads, 1);
+            Eigen::VectorXf bestThreshs(num_threads, 1);
+            bestInfoGains.setConstant(-FLT_MAX);
+            std::vector<Feature> bestFeatures(num_threads);
+
+            std::atomic<int> featureCount(numFeatures);
+            std::vector<IGTrainState3> trainStates(num_threads,
+                    IGTrainState3(numParts, minSamplesPerFeature /*misnomer*/));
+            std::vector<int> numEvaluated(num_threads);
+            // Mapreduce-ish
+            auto worker = [&](int thread_id) {
+                // Thread-specific training data
+                IGTrainState3& trainState = trainStates[thread_id];
+                float& bestInfoGain = bestInfoGains(thread_id);
+                float& bestThresh = bestThreshs(thread_id);
+                float optimalThresh;
+                Feature& bestFeature = bestFeatures[thread_id];
+                Feature feature;
+                int threadFeatId;
+                while (true) {
+                    threadFeatId = featureCount--;
+                    if (threadFeatId <= 0) break;
+                    if (end-start > 500000 && depth > 4) {
+                        if (threadFeatId % 500 == 0 ||
+                            (end-start > 10000000 &&
+                             (threadFeatId % 100 == 0
+                             || (end-start > 200000000
+                                 && threadFeatId % 10 == 0)))) {
+                            std::cout << threadFeatId << " features remain\n" << std::flush;
                         }
+                    }
 
+                    float infoGain;
+                    if (probeRingSize) {
+                        // Random pair of distinct probe ring offsets
+                        int uId = random_util::randint(0, probeRingSize - 1);
+                        int vId = random_util::randint(0, probeRingSize - 2);
+                        if (vId >= uId) ++vId;
+                        feature.u = probeOffsets[uId];
+                        feature.v = probeOffsets[vId];
+                        infoGain = optimalInformationGain3(trainState,
+                                start, end, feature, &optimalThresh,
+                                &probeRing[uId * samples.size()], &probeRing[vId * samples.size()]);
+                    } else {
                         // Create random feature in-place
                         feature.u.x() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
                         feature.u.y() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
                         feature.v.x() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
                         feature.v.y() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
-
-                        float infoGain = optimalInformationGain3(trainState,
+                        infoGain = optimalInformationGain3(trainState,
                                 start, end, feature, &optimalThresh);
+                    }
 
-                        if (infoGain >= bestInfoGain) {
-                            bestInfoGain = infoGain;
-                            bestThresh = optimalThresh;
-                            bestFeature = feature;
-                        }
-                        if (panicMode) break;
+                    ++numEvaluated[thread_id];
+                    if (infoGain >= bestInfoGain) {
+                        bestInfoGain = infoGain;
+                        bestThresh = optimalThresh;
+                        bestFeature = feature;
                     }
-                };
+                    if (panicMode) break;
+                }
+            };
 
+            if (num_threads == 1) {
+                worker(0);
+            } else {
                 std::vector<std::thread> threadMgr;
-                for (int i = 0; i < numThreads; ++i) {
+                for (int i = 0; i < num_threads; ++i) {
                     threadMgr.emplace_back(worker, i);
                 }
-
-                int bestThreadId = 0;
-                for (int i = 0; i < numThreads; ++i) {
+                for (int i = 0; i < num_threads; ++i) {
                     threadMgr[i].join();
-                    if (i && bestInfoGains(i) > bestInfoGains(bestThreadId)) {
-                        bestThreadId = i;
-                    }
                 }
-                if (panicMode) {
-                    trainFromNode(node_id, depth);
-                    return;
+            }
+            if (panicMode) return result;
+
+            int bestThreadId = 0;
+            for (int i = 1; i < num_threads; ++i) {
+                if (bestInfoGains(i) > bestInfoGains(bestThreadId)) {
+                    bestThreadId = i;
                 }
+            }
+            result.feature = bestFeatures[bestThreadId];
+            result.thresh = bestThreshs(bestThreadId);
+            result.infoGain = bestInfoGains(bestThreadId);
+            auto splitStart = std::chrono::high_resolution_clock::now();
+            result.mid = split(start, end, result.feature, result.thresh, num_threads);
+            result.found = true;
+            result.splitMs = millisSince(splitStart);
+            result.numThreads = num_threads;
+            for (int i = 0; i < num_threads; ++i) {
+                result.numFeatures += numEvaluated[i];
+                result.scoreMs += trainStates[i].scoreMs;
+                result.searchMs += trainStates[i].searchMs;
+            }
+            if (depth > 5 && num_threads > 1) {
+                std::cout << "> Best info gain " << result.infoGain << ", thresh " << result.thresh << ", feature.u " << result.feature.u.x() << "," << result.feature.u.y() <<", features.v" << result.feature.v.x() << "," << result.feature.v.y() << "\n" << std::flush;
+            }
+            return result;
+        }
 
-                mid = split(start, end, bestFeatures[bestThreadId], bestThreshs(bestThreadId));
+        /** Checkpoint log: completed nodes since the last save, appended
+         *  to savePath.log as they complete, so that a killed run resumes
+         *  from the last completed node. Each record is a split ('S': node,
+         *  children, feature, threshold, zero info gain stop flag) or a leaf
+         *  ('L': node, leaf id, distribution). Splits are replayed by
+         *  re-partitioning the node's samples, which is one feature
+         *  evaluation per sample */
+        void openLog() {
+            std::string logPath = savePath + ".log";
+            size_t validSize = replayLog(logPath);
+            if (validSize == 0) {
+                resetLog(logPath);
+            } else {
+                // Drop a record torn by the kill, if any
+                boost::filesystem::resize_file(logPath, validSize);
+            }
+            logFile.open(logPath, std::ios::out | std::ios::binary | std::ios::app);
+        }
 
-                if (panicMode) {
-                    trainFromNode(node_id, depth);
-                    return;
-                }
+        /** Start empty log (after a save) */
+        void resetLog(const std::string& path) {
+            logFile.close();
+            std::ofstream ofs(path, std::ios::out | std::ios::binary | std::ios::trunc);
+            ofs.write("RTREE_V3_LG2\n", 13);
+            util::write_bin(ofs, numParts);
+        }
 
-                bestInfoGain = bestInfoGains(bestThreadId);
-                if (depth > 5) {
-                    std::cout << "> Best info gain " << bestInfoGain << ", thresh " << bestThreshs(bestThreadId) << ", feature.u " << bestFeatures[bestThreadId].u.x() << "," << bestFeatures[bestThreadId].u.y() <<", features.v" << bestFeatures[bestThreadId].u.x() << "," << bestFeatures[bestThreadId].u.y() << "\n" << std::flush;
-                }
-                if (mid == end || mid == start) {
-                    // force leaf
-                    trainFromNode(node_id, 0);
-                    return;
+        /** Apply records in log at path not already in the tree (the log may
+         *  predate the last save if killed while saving). Returns size of
+         *  the valid part of the log, or 0 if there is no valid log to append
+         *  to. Old logs ('S' records without stop flag) are replayed, then restarted */
+        size_t replayLog(const std::string& path) {
+            std::ifstream ifs(path, std::ios::in | std::ios::binary);
+            if (!ifs) return 0;
+            char marker[13];
+            int logParts;
+            ifs.read(marker, 13);
+            util::read_bin(ifs, logParts);
+            bool oldLog = !strncmp(marker, "RTREE_V3_LOG\n", 13);
+            if (!ifs || (strncmp(marker, "RTREE_V3_LG2\n", 13) && !oldLog) || logParts != numParts) {
+                std::cerr << "WARNING: ignoring invalid checkpoint log " << path << "\n";
+                return 0;
+            }
+            size_t validSize = ifs.tellg(), numRecords = 0, numApplied = 0;
+            RTree::Distribution dist(numParts);
+            while (true) {
+                char type;
+                int id;
+                if (!ifs.read(&type, 1)) break;
+                util::read_bin(ifs, id);
+                if (type == 'S') {
+                    int lnode, rnode;
+                    Feature feature;
+                    float thresh;
+                    char stop = 0;
+                    util::read_bin(ifs, lnode);
+                    util::read_bin(ifs, rnode);
+                    ifs.read(reinterpret_cast<char*>(feature.u.data()), 2 * sizeof(float));
+                    ifs.read(reinterpret_cast<char*>(feature.v.data()), 2 * sizeof(float));
+                    util::read_bin(ifs, thresh);
+                    if (!oldLog) ifs.read(&stop, 1);
+                    if (!ifs) break;
+                    if (isOpen(id)) {
+                        size_t start = nodeInterval[id][0], end = nodeInterval[id][1];
+                        size_t mid = split(start, end, feature, thresh,
+                                end - start > 100000 ? numThreads : 1);
+                        size_t newSize = std::max<size_t>(nodes.size(), std::max(lnode, rnode) + 1);
+                        nodes.resize(newSize);
+                        nodeInterval.resize(newSize);
+                        nodeInterval[lnode] << start, mid;
+                        nodeInterval[rnode] << mid, end;
+                        auto& node = nodes[id];
+                        node.u = feature.u;
+                        node.v = feature.v;
+                        node.thresh = thresh;
+                        node.lnode = lnode;
+                        node.rnode = rnode;
+                        if (stop) setStopped(id);
+                        ++numApplied;
+                    }
+                } else if (type == 'L') {
+                    int leafid;
+                    util::read_bin(ifs, leafid);
+                    ifs.read(reinterpret_cast<char*>(dist.data()), numParts * sizeof(float));
+                    if (!ifs) break;
+                    if (isOpen(id)) {
+                        nodes[id].leafid = static_cast<int>(leafData.size());
+                        RTree::LeafTable::Row leaf = leafData.emplace_back();
+                        leaf = dist;
+                        ++numApplied;
+                    }
+                } else {
+                    break;
                 }
-                node.thresh = bestThreshs(bestThreadId);
-                node.u = bestFeatures[bestThreadId].u;
-                node.v = bestFeatures[bestThreadId].v;
+                validSize = ifs.tellg();
+                ++numRecords;
+            }
+            if (numRecords) {
+                std::cout << "Replayed checkpoint log " << path << ": " << numApplied << " of " <<
+                    numRecords << " completed nodes were not in the save\n" << std::flush;
             }
+            return oldLog ? 0 : validSize;
+        }
 
-            // If the 'info gain' [actually is -(expected new entropy)] was zero then
-            // it means all of children have same class, so we should stop
-            node.lnode = static_cast<int>(nodes.size());
-            nodes.emplace_back();
-            nodeInterval.push_back({start, mid});
+        /** True if node id exists and is neither split nor a leaf */
+        bool isOpen(int id) const {
+            return id >= 0 && id < static_cast<int>(nodes.size()) &&
+                nodes[id].leafid == -1 && nodes[id].lnode == -1;
+        }
 
-            node.rnode = static_cast<int>(nodes.size());
-            nodes.emplace_back();
-            nodeInterval.push_back({mid, end});
+        /** True if node id was split with zero info gain, so its children are not split */
+        bool isStopped(int id) const {
+            return id < static_cast<int>(stopped.size()) && stopped[id];
+        }
 
-            if (bestInfoGain == 0.0) {
-                trainFromNode(node.lnode, 0);
-                trainFromNode(node.rnode, 0);
-            } else {
-                trainFromNode(node.lnode, depth - 1);
-                trainFromNode(node.rnode, depth - 1);
-            }
+        void setStopped(int id) {
+            if (id >= static_cast<int>(stopped.size())) stopped.resize(id + 1);
+            stopped[id] = 1;
+        }
+
+        void logSplit(int id) {
+            if (!logFile.is_open()) return;
+            const auto& node = nodes[id];
+            logFile.put('S');
+            util::write_bin(logFile, id);
+            util::write_bin(logFile, node.lnode);
+            util::write_bin(logFile, node.rnode);
+            logFile.write(reinterpret_cast<const char*>(node.u.data()), 2 * sizeof(float));
+            logFile.write(reinterpret_cast<const char*>(node.v.data()), 2 * sizeof(float));
+            util::write_bin(logFile, node.thresh);
+            logFile.put(isStopped(id) ? 1 : 0);
+            logFile.flush();
+        }
+
+        void logLeaf(int id) {
+            if (!logFile.is_open()) return;
+            int leafid = nodes[id].leafid;
+            logFile.put('L');
+            util::write_bin(logFile, id);
+            util::write_bin(logFile, leafid);
+            logFile.write(reinterpret_cast<const char*>(leafData[leafid].data()), numParts * sizeof(float));
+            logFile.flush();
         }
 
         void writeSamples(const std::string & path) {
@@ -2678,10 +4588,17 @@ namespace ark {
             }
 
             util::write_bin<size_t>(ofs, leafData.size());
-            for (int i = 0; i < leafData.size(); ++i) {
-                ofs.write(reinterpret_cast<char*>(leafData[i].data()),
-                          numParts * sizeof(float));
+            ofs.write(reinterpret_cast<const char*>(leafData.data()),
+                      leafData.size() * numParts * sizeof(float));
+
+            // Zero info gain stops (optional section, absent in older saves)
+            std::vector<int> stoppedIds;
+            for (int i = 0; i < static_cast<int>(stopped.size()); ++i) {
+                if (stopped[i]) stoppedIds.push_back(i);
             }
+            ofs.write("Z\n", 2);
+            util::write_bin<size_t>(ofs, stoppedIds.size());
+            for (int id : stoppedIds) util::write_bin(ofs, id);
 
             ofs.write("S\n", 2);
             util::write_bin<size_t>(ofs, samples.size());
@@ -2698,6 +4615,10 @@ namespace ark {
                 boost::filesystem::remove(path);
             }
             boost::filesystem::rename(tmpPath, path);
+            // Log restarts from this save
+            bool logOpen = logFile.is_open();
+            resetLog(path + ".log");
+            if (logOpen) logFile.open(path + ".log", std::ios::out | std::ios::binary | std::ios::app);
         }
 
         void readSamples(const std::string & path) {
@@ -2746,14 +4667,26 @@ namespace ark {
 
             size_t leafsz;
             util::read_bin(ifs, leafsz);
-            leafData.resize(leafsz);
-            for (int i = 0; i < leafData.size(); ++i) {
-                leafData[i].resize(numParts);
-                ifs.read(reinterpret_cast<char*>(leafData[i].data()),
-                            numParts * sizeof(float));
-            }
+            leafData.reset(numParts, leafsz);
+            ifs.read(reinterpret_cast<char*>(leafData.data()),
+                        leafsz * numParts * sizeof(float));
 
             ifs.read(marker, 2);
+            stopped.clear();
+            if (!strncmp(marker, "Z\n", 2)) {
+                size_t stoppedsz;
+                util::read_bin(ifs, stoppedsz);
+                for (size_t i = 0; i < stoppedsz && ifs; ++i) {
+                    int id;
+                    util::read_bin(ifs, id);
+                    if (id < 0 || id >= static_cast<int>(nodesz)) {
+                        std::cerr << "ERROR: Invalid or corrupted samples file at " << path << " [Corrupted Z section]\n";
+                        std::exit(1);
+                    }
+                    setStopped(id);
+                }
+                ifs.read(marker, 2);
+            }
             if (strncmp(marker, "S\n", 2)) {
                 std::cerr << "ERROR: Invalid or corrupted samples file at " << path << " [Corrupted S section]\n";
                 std::exit(1);
@@ -2777,80 +4710,64 @@ namespace ark {
             ifs.close();
         }
 
-        // Compute information gain (mutual information scaled and shifted) by choosing optimal threshold
-        float optimalInformationGain3(IGTrainState3& state, size_t start, size_t end, const Feature& feature, float* optimal_thresh) {
+        // Compute information gain (mutual information scaled and shifted) by choosing optimal threshold.
+        // If ring_u, ring_v are given, they are the probe ring depths at feature.u, feature.v
+        float optimalInformationGain3(IGTrainState3& state, size_t start, size_t end, const Feature& feature, float* optimal_thresh,
+                const float* ring_u = nullptr, const float* ring_v = nullptr) {
+            auto scoreOf = [&](size_t i) {
+                if (ring_u) return ring_u[i] - ring_v[i];
+                const Sample3& sample = samples[i];
+                return scoreByFeature(data[sample.index], sample.pix, feature.u, feature.v);
+            };
 
-            // Initially everything is in left set
-            state.buckets.setZero();
-            state.distLeft.setZero();
-            state.distRight.setZero();
+            bool timed = telemetry != nullptr;
+            std::chrono::high_resolution_clock::time_point scoreStart;
+            if (timed) scoreStart = std::chrono::high_resolution_clock::now();
 
-            // Compute scores
-            // std::vector<std::pair<float, int> > samplesByScore;
+            // Compute scores; kept for bucketing unless the node is very large
+            // (or they are cheap probe ring lookups)
+            bool cacheScores = !ring_u && end - start <= MAX_CACHED_SCORES;
+            if (cacheScores) state.scores.resize(end - start);
             float minScore = std::numeric_limits<float>::max();
             float maxScore = std::numeric_limits<float>::lowest();
             for (size_t i = start; i < end; ++i) {
-                const Sample3& sample = samples[i];
-                float score = scoreByFeature(data[sample.index],
-                            sample.pix, feature.u, feature.v);
+                float score = scoreOf(i);
                 minScore = std::min(score, minScore);
                 maxScore = std::max(score, maxScore);
-                // samplesByScore.emplace_back(
-                        // , i);
-                state.distLeft[sample.label] += 1.f;
+                if (cacheScores) state.scores[i - start] = score;
             }
 
             if (panicMode || minScore > maxScore) return std::numeric_limits<float>::lowest();
 
-            float scoreStep = (maxScore - minScore + std::numeric_limits<float>::epsilon()) / (minSamplesPerFeature + 1.f);
-
             // Counts per part for each threshold bucket
+            state.histogram.reset(minScore, maxScore);
             for (size_t i = start; i < end; ++i) {
-                const Sample3& sample = samples[i];
-                float score = scoreByFeature(data[sample.index],
-                            sample.pix, feature.u, feature.v);
-                size_t buckId = static_cast<size_t>((score - minScore) / scoreStep);
-                if (buckId < minSamplesPerFeature) {
-                    state.buckets(sample.label, buckId) += 1.f;
-                }
+                float score = cacheScores ? state.scores[i - start] : scoreOf(i);
+                state.histogram.add(score, samples[i].label);
             }
 
             if (panicMode) return std::numeric_limits<float>::lowest();
 
-            // Start everything in the left set ...
+            std::chrono::high_resolution_clock::time_point searchStart;
+            if (timed) {
+                searchStart = std::chrono::high_resolution_clock::now();
+                state.scoreMs += std::chrono::duration<double, std::milli>(searchStart - scoreStart).count();
+            }
             float bestInfoGain = std::numeric_limits<float>::lowest();
             *optimal_thresh = minScore;
-            for (size_t i = 0; i < minSamplesPerFeature; ++i) {
-                // Update distributions for left, right sets
-                state.distLeft.noalias() -= state.buckets.col(i);
-                state.distRight.noalias() += state.buckets.col(i);
-
-                float leftSum = state.distLeft.sum(),
-                      rightSum = state.distRight.sum();
-                float left_entropy = entropy(state.distLeft / leftSum);
-                float right_entropy = entropy(state.distRight / rightSum);
-                // Compute the information gain
-                float infoGain = - (  leftSum * left_entropy
-                                    + rightSum * right_entropy);
-                if (infoGain > 0) {
-                    std::cerr << "FATAL ERROR: Possibly overflow detected during training, exiting. Internal data: left entropy "
-                        << left_entropy << " right entropy "
-                        << right_entropy << " information gain "
-                        << infoGain<< "\n";
-                    std::exit(2);
-                }
+            state.histogram.forEachSplit([&](float infoGain, float thresh) {
                 if (infoGain > bestInfoGain) {
-                    // If better then update optimal thresh to between samples
-                    *optimal_thresh = minScore + (i + 1) * scoreStep;
+                    *optimal_thresh = thresh;
                     bestInfoGain = infoGain;
                 }
-            }
+            });
+            if (timed) state.searchMs += millisSince(searchStart);
             return bestInfoGain;
         }
 
         // Split samples {start ... end-1} by feature+thresh in-place and return the dividing index
         // left (less) set willInit  be {start ... idx-1}, right (greater) set is {idx ... end-1}
-        size_t split(size_t start, size_t end, const Feature& feature, float thresh) {
+        size_t split(size_t start, size_t end, const Feature& feature, float thresh, int num_threads) {
             // size_t nextIndex = start;
             // for (size_t i = start; i < end; ++i) {
             //     const Sample3& sample = samples[i];
@@ -2868,8 +4785,8 @@ namespace ark {
             // SampleVec temp;
             // temp.reserve(end-start / 2);
             // More concurrency (LOL)
-            std::vector<SampleVec3> workerLefts(numThreads),
-                                   workerRights(numThreads);
+            std::vector<SampleVec3> workerLefts(num_threads),
+                                   workerRights(num_threads);
             auto worker = [&](int tid, size_t left, size_t right) {
                 auto& workerLeft = workerLefts[tid];
                 auto& workerRight = workerRights[tid];
@@ -2885,20 +4802,24 @@ namespace ark {
                     }
                 }
             };
-            size_t step = (end-start) / numThreads;
+            size_t step = (end-start) / num_threads;
             std::vector<std::thread> threadMgr;
-            for (int i = 0; i < numThreads - 1; ++i) {
-                threadMgr.emplace_back(worker, i,
-                        start + step * i, start + step * (i + 1));
+            if (num_threads == 1) {
+                worker(0, start, end);
+            } else {
+                for (int i = 0; i < num_threads - 1; ++i) {
+                    threadMgr.emplace_back(worker, i,
+                            start + step * i, start + step * (i + 1));
+                }
+                threadMgr.emplace_back(worker, num_threads - 1, start + step * (num_threads-1), end);
             }
-            threadMgr.emplace_back(worker, numThreads - 1, start + step * (numThreads-1), end);
-            for (int i = 0; i < numThreads; ++i) {
-                threadMgr[i].join();
+            for (int i = 0; i < num_threads; ++i) {
+                if (threadMgr.size()) threadMgr[i].join();
                 std::copy(workerLefts[i].begin(), workerLefts[i].end(), samples.begin() + nextIndex);
                 nextIndex += workerLefts[i].size();
             }
             size_t splitIndex = nextIndex;
-            for (int i = 0; i < numThreads; ++i) {
+            for (int i = 0; i < num_threads; ++i) {
                 std::copy(workerRights[i].begin(), workerRights[i].end(), samples.begin() + nextIndex);
                 nextIndex += workerRights[i].size();
             }
@@ -2933,12 +4854,24 @@ namespace ark {
         };
 
         std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes;
-        std::vector<RTree::Distribution>& leafData;
+        RTree::LeafTable& leafData;
         std::vector<Eigen::Matrix<size_t, 2, 1>, Eigen::aligned_allocator<Eigen::Matrix<size_t, 2, 1>> > nodeInterval;
         std::string savePath;
         SampleVec3 samples;
-        std::vector<SparseImage> data;
-        AvatarDataSource dataSource;
+        // Depth image of each image index; ownData unless shared
+        std::vector<SparseImage> ownData;
+        std::vector<SparseImage>& data;
+        AvatarDataSource& dataSource;
+        // Per node, 1 if split with zero info gain (children are not split further)
+        std::vector<uint8_t> stopped;
+        // Guards nodes, nodeInterval, leafData, stopped and logFile while training a level
+        std::mutex nodesMutex;
+        std::ofstream logFile;
+        // Probe offsets of the current level and depth of each sample at
+        // each offset, offset-major (see buildProbeRing); unused if probeRingSize is 0
+        std::vector<RTree::Vec2, Eigen::aligned_allocator<RTree::Vec2> > probeOffsets;
+        std::vector<float> probeRing;
+        int probeRingSize = 0;
         bool verbose;
         int numFeatures, maxProbeOffset, minSamples, numThreads, numParts, minSamplesPerFeature;
         size_t curStart, curEnd;
@@ -2946,83 +4879,1085 @@ namespace ark {
         const int IMREAD_FLAGS[2] = { cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH, cv::IMREAD_GRAYSCALE };
     };
 
-    // UGLY SIGINT handling
-    AvatarTrainerV3* currentTrainer = nullptr;
-    void sigHandler(int signal){
-        if (currentTrainer != nullptr) {
-            std::cout << "PANIC: RTree: received SIGINT, entering panic mode (tries to halt and save)\n" << std::flush;
-            currentTrainer->panicMode = true;
+    /** Trains several trees at once with AvatarTrainerV3, bagging:
+     *  images are rendered once into a shared cache and each tree
+     *  takes its samples from its own bootstrap sample of the images */
+    class AvatarForestTrainer {
+    public:
+        AvatarForestTrainer(std::vector<RTree>& trees,
+                AvatarDataSource& data_source,
+                int num_parts)
+            : dataSource(data_source), numParts(num_parts) {
+            for (auto& tree : trees) {
+                trainers.emplace_back(new AvatarTrainerV3(tree.nodes, tree.leafData,
+                            dataSource, data, numParts));
+            }
         }
-    }
 
-    // RTree implementation
-    RTree::RTree(int num_parts) : numParts(num_parts) {}
-    RTree::RTree(const std::string & path) {
-        if (!loadFile(path)) {
-            fprintf(stderr, "ERROR: RTree failed to initialize from %s\n", path.c_str());
+        void train(int num_images, int num_points_per_image, int num_features,
+                   int max_probe_offset, int min_samples, int min_samples_per_feature,
+                   int max_tree_depth, int num_threads,
+                   const std::string& save_path,
+                   bool verbose, int probe_ring_size = 0) {
+            int numTrees = static_cast<int>(trainers.size());
+            std::vector<std::string> savePaths(numTrees);
+            std::vector<char> firstTime(numTrees);
+            for (int t = 0; t < numTrees; ++t) {
+                if (save_path.size()) {
+                    savePaths[t] = save_path + ".tree" + std::to_string(t);
+                    trainers[t]->readSamples(savePaths[t]);
+                }
+                firstTime[t] = trainers[t]->samples.empty();
+                trainers[t]->telemetry = telemetry;
+                trainers[t]->telemetryTree = t;
+            }
+            auto initStart = std::chrono::high_resolution_clock::now();
+            initTraining(num_images, num_points_per_image, num_threads, verbose, firstTime);
+            if (telemetry != nullptr) {
+                telemetry->write(telemetry->record("init")("trainer", "v3")("trees", numTrees)
+                        ("images", num_images)("init_ms", millisSince(initStart)));
+            }
+
+            // Split threads evenly between trees
+            int threadsPerTree = std::max(num_threads / numTrees, 1);
+            std::cout << "\nInit RForest (v3) training of " << numTrees << " trees with maximum depth " <<
+                max_tree_depth << ", " << threadsPerTree << " threads per tree\n" << std::flush;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < numTrees; ++t) {
+                threads.emplace_back([&, t]() {
+                    trainers[t]->trainSamples(num_features, max_probe_offset, min_samples,
+                            min_samples_per_feature, max_tree_depth, threadsPerTree,
+                            savePaths[t], verbose, firstTime[t], probe_ring_size);
+                });
+            }
+            for (auto& thd : threads) {
+                thd.join();
+            }
         }
-    }
 
-    bool RTree::loadFile(const std::string & path) {
-        std::ifstream bifs(path, std::ios::in | std::ios::binary);
-        char marker;
-        bifs.get(marker);
-        if (marker == 'R') {
-            // New binary format
-            uint32_t nNodes, nLeafs;
-            util::read_bin<uint32_t>(bifs, nNodes);
-            util::read_bin<uint32_t>(bifs, nLeafs);
-            util::read_bin<int32_t>(bifs, numParts);
-            nodes.resize(nNodes);
-            leafData.resize(nLeafs);
-            uint32_t lastLeafId = 0;
-            for (size_t i = 0; i < nodes.size(); ++i) {
-                uint8_t isLeaf;
-                util::read_bin<uint8_t>(bifs, isLeaf);
-                if (isLeaf) {
-                    leafData[lastLeafId].resize(numParts);
-                    leafData[lastLeafId].setZero();
-                    uint8_t cnt = 0;
-                    util::read_bin<uint8_t>(bifs, cnt);
-                    if (cnt > numParts) {
-                        std::cerr << "FATAL: leaf has " << int(cnt) << " parts, expected " << numParts << " at most\n";
-                        std::exit(1);
-                    }
-                    for (uint8_t j = 0; j < cnt; ++j) {
-                        uint8_t k;
-                        util::read_bin<uint8_t>(bifs, k);
-                        if (k > numParts) {
-                            std::cerr << "FATAL: leaf index " << int(k) << " is out of bounds, at most " << numParts << "\n";
-                            std::exit(1);
-                        }
-                        util::read_bin<float>(bifs, leafData[lastLeafId](k));
-                    }
-                    nodes[i].leafid = lastLeafId++;
-                } else {
-                    util::read_bin<int32_t>(bifs, nodes[i].lnode);
-                    util::read_bin<int32_t>(bifs, nodes[i].rnode);
-                    util::read_bin<float>(bifs, nodes[i].thresh);
-                    bifs.read(reinterpret_cast<char*>(nodes[i].u.data()), sizeof(float) * 2);
-                    bifs.read(reinterpret_cast<char*>(nodes[i].v.data()), sizeof(float) * 2);
+        /** Optional telemetry, written per node and level of each tree if set */
+        TrainingTelemetry* telemetry = nullptr;
+
+        /** True if training was stopped by SIGINT (after saving) */
+        bool halted() const {
+            for (auto& trainer : trainers) {
+                if (trainer->halted) return true;
+            }
+            return false;
+        }
+
+    private:
+        /** Render all images into the shared cache and draw samples
+         *  for trees not resumed from a save file (first_time) */
+        void initTraining(int num_images, int num_points_per_image, int num_threads, bool verbose,
+                const std::vector<char>& first_time) {
+            int numTrees = static_cast<int>(trainers.size());
+            // Number of times each image is drawn in each tree's bootstrap
+            std::vector<std::vector<int> > draws(numTrees);
+            bool anyFirstTime = false;
+            for (int t = 0; t < numTrees; ++t) {
+                if (!first_time[t]) continue;
+                anyFirstTime = true;
+                draws[t].resize(num_images);
+                for (int i = 0; i < num_images; ++i) {
+                    ++draws[t][random_util::randint(0, num_images - 1)];
                 }
+                trainers[t]->samples.reserve(num_points_per_image * num_images);
             }
-            bifs.get(marker);
-            if (marker != 'T') {
-                std::cerr << "Error: incorrect RTree format, T end marker missing\n";
-                std::exit(1);
+            if (anyFirstTime) {
+                std::cout << "Initializing forest training: loading and preprocessing images...\n" << std::flush;
+            } else {
+                std::cout << "Resuming forest training: reloading images...\n" << std::flush;
             }
-            bifs.close();
-        } else {
-            std::cout << "Note: loading rtree stored in legacy text format\n" << std::flush;
-            // Legacy format
-            bifs.close();
-            size_t nNodes, nLeafs;
-            std::ifstream ifs(path);
-            if (!ifs) return false;
 
-            ifs >> nNodes >> nLeafs >> numParts;
-            nodes.resize(nNodes);
-            leafData.resize(nLeafs);
+            data.resize(num_images);
+            // Samples drawn by each consumer for each tree
+            std::vector<std::vector<AvatarTrainerV3::SampleVec3> > consumerSamples(
+                    numRenderConsumers(num_threads), std::vector<AvatarTrainerV3::SampleVec3>(numTrees));
+            renderImages(dataSource, num_images, num_threads, !anyFirstTime, verbose,
+                    [&](RenderedImage& image, int consumer_id) {
+                int i = image.index;
+                data[i] = image.depth;
+                if (!anyFirstTime) return;
+                std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > candidates;
+                findCandidates(image.partMask, candidates);
+                for (int t = 0; t < numTrees; ++t) {
+                    if (draws[t].empty() || draws[t][i] == 0) continue;
+                    // An image drawn k times contributes k times the pixels
+                    auto chosenCandidates = random_util::choose(candidates,
+                            static_cast<size_t>(draws[t][i]) * num_points_per_image);
+                    for (auto& v : chosenCandidates) {
+                        consumerSamples[consumer_id][t].emplace_back(i, v, image.partMask.at<uint8_t>(v(1), v(0)));
+                    }
+                }
+            });
+            for (auto& treeSamples : consumerSamples) {
+                for (int t = 0; t < numTrees; ++t) {
+                    auto& samples = trainers[t]->samples;
+                    std::move(treeSamples[t].begin(), treeSamples[t].end(), std::back_inserter(samples));
+                }
+            }
+
+            std::cout << "Preprocessing done, sparsely verifying data validity before training...\n" << std::flush;
+            for (int t = 0; t < numTrees; ++t) {
+                if (first_time[t]) trainers[t]->verifySamples();
+            }
+            std::cout << "Result: data is valid\n" << std::flush;
+        }
+
+        std::vector<std::unique_ptr<AvatarTrainerV3> > trainers;
+        std::vector<SparseImage> data;
+        AvatarDataSource& dataSource;
+        int numParts;
+    };
+
+#ifndef _WIN32
+    /** Message stream between a distributed training coordinator and one
+     *  worker over a stream socket. Each message is a type word, a payload
+     *  size and the payload, written with util::write_bin */
+    class TrainingConnection {
+    public:
+        enum MessageType : uint32_t {
+            // C->W: number of images, pixels per image, parts, histogram bins.
+            // W->C: per-part sample counts
+            MSG_CONFIG = 0x52545731,
+            // C->W: features of each node to split.
+            // W->C: min and max score of each (node, feature)
+            MSG_RANGES,
+            // C->W: global score range of each (node, feature).
+            // W->C: sparse per-part histogram of each (node, feature)
+            MSG_HISTOGRAMS,
+            // C->W: chosen splits and child node ids.
+            // W->C: per-part counts of each left child
+            MSG_SPLIT,
+            // C->W: training finished
+            MSG_DONE
+        };
+
+        explicit TrainingConnection(int fd = -1) : fd(fd) {}
+        TrainingConnection(const TrainingConnection&) =delete;
+        ~TrainingConnection() {
+            if (~fd) close(fd);
+        }
+
+        /** Listen at address, which is either unix:<path> or [host]:<port>.
+         *  Returns listening socket, or -1 on failure */
+        static int listenAt(const std::string& address, int backlog) {
+            int fd = openSocket(address, true);
+            if (~fd && listen(fd, backlog)) {
+                std::cerr << "ERROR: failed to listen at " << address << ": " << strerror(errno) << "\n";
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        /** Connect to address (see listenAt), retrying for up to timeout_s
+         *  seconds while the coordinator starts. Returns false on failure */
+        bool connectTo(const std::string& address, int timeout_s) {
+            for (int i = 0; i <= timeout_s * 10; ++i) {
+                fd = openSocket(address, false);
+                if (~fd) return true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            std::cerr << "ERROR: failed to connect to coordinator at " << address << "\n";
+            return false;
+        }
+
+        void send(MessageType type, const std::string& payload) {
+            std::ostringstream header;
+            util::write_bin<uint32_t>(header, type);
+            util::write_bin<uint64_t>(header, payload.size());
+            if (!writeAll(header.str().data(), header.str().size()) ||
+                !writeAll(payload.data(), payload.size())) {
+                std::cerr << "FATAL: distributed training connection lost while sending\n";
+                std::exit(1);
+            }
+        }
+
+        /** Receive next message, which must have the expected type */
+        std::string receive(MessageType expected_type) {
+            uint32_t type;
+            std::string payload = receive(type);
+            if (type != expected_type) {
+                std::cerr << "FATAL: distributed training protocol error: expected message " <<
+                    expected_type << ", got " << type << "\n";
+                std::exit(1);
+            }
+            return payload;
+        }
+
+        /** Receive next message of any type */
+        std::string receive(uint32_t& type) {
+            char header[sizeof(uint32_t) + sizeof(uint64_t)];
+            uint64_t size;
+            if (!readAll(header, sizeof header)) {
+                std::cerr << "FATAL: distributed training connection lost while receiving\n";
+                std::exit(1);
+            }
+            std::memcpy(&type, header, sizeof type);
+            std::memcpy(&size, header + sizeof type, sizeof size);
+            std::string payload(size, '\0');
+            if (size && !readAll(&payload[0], size)) {
+                std::cerr << "FATAL: distributed training connection lost while receiving\n";
+                std::exit(1);
+            }
+            return payload;
+        }
+
+        int fd;
+
+    private:
+        static int openSocket(const std::string& address, bool server) {
+            if (address.compare(0, 5, "unix:") == 0) {
+                std::string path = address.substr(5);
+                sockaddr_un addr;
+                if (path.empty() || path.size() >= sizeof addr.sun_path) {
+                    std::cerr << "ERROR: invalid unix socket path '" << path << "'\n";
+                    return -1;
+                }
+                std::memset(&addr, 0, sizeof addr);
+                addr.sun_family = AF_UNIX;
+                std::strcpy(addr.sun_path, path.c_str());
+                int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd == -1) {
+                    std::cerr << "ERROR: failed to create socket for " << address << ": " << strerror(errno) << "\n";
+                    return -1;
+                }
+                if (server) unlink(path.c_str());
+                if (server ? bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) :
+                             connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr)) {
+                    if (server) std::cerr << "ERROR: failed to bind " << address << ": " << strerror(errno) << "\n";
+                    close(fd);
+                    return -1;
+                }
+                return fd;
+            }
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos) {
+                std::cerr << "ERROR: invalid address '" << address << "', should be unix:<path> or [host]:<port>\n";
+                return -1;
+            }
+            std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+            addrinfo hints, *result;
+            std::memset(&hints, 0, sizeof hints);
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = server ? AI_PASSIVE : 0;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result)) {
+                std::cerr << "ERROR: failed to resolve address '" << address << "'\n";
+                return -1;
+            }
+            int fd = -1;
+            for (addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (fd == -1) continue;
+                int one = 1;
+                if (server) {
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+                    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+                } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                    break;
+                }
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(result);
+            if (fd == -1 && server) {
+                std::cerr << "ERROR: failed to bind " << address << "\n";
+            }
+            return fd;
+        }
+
+        bool writeAll(const char* buf, size_t size) {
+            while (size) {
+                ssize_t written = write(fd, buf, size);
+                if (written <= 0) {
+                    if (written < 0 && errno == EINTR) continue;
+                    return false;
+                }
+                buf += written;
+                size -= written;
+            }
+            return true;
+        }
+
+        bool readAll(char* buf, size_t size) {
+            while (size) {
+                ssize_t got = read(fd, buf, size);
+                if (got <= 0) {
+                    if (got < 0 && errno == EINTR) continue;
+                    return false;
+                }
+                buf += got;
+                size -= got;
+            }
+            return true;
+        }
+    };
+
+    /** Read a vector written with writeVector */
+    template<class T>
+    void readVector(std::istream& is, std::vector<T>& vec) {
+        uint64_t size;
+        util::read_bin(is, size);
+        vec.resize(size);
+        is.read(reinterpret_cast<char*>(vec.data()), size * sizeof(T));
+    }
+
+    /** Write size and contents of a vector of plain values */
+    template<class T>
+    void writeVector(std::ostream& os, const std::vector<T>& vec) {
+        util::write_bin<uint64_t>(os, vec.size());
+        os.write(reinterpret_cast<const char*>(vec.data()), vec.size() * sizeof(T));
+    }
+
+    /** Distributed training worker: renders and owns its own images and
+     *  samples (an AvatarTrainerV3 that never searches for splits itself),
+     *  and computes score ranges and histograms of the samples in each
+     *  node for the features the coordinator asks for */
+    class AvatarTrainingWorker {
+    public:
+        /** Configuration sent by the coordinator (MSG_CONFIG) */
+        struct Config {
+            int numImages, numPointsPerImage, numParts, numBins;
+
+            void write(std::ostream& os) const {
+                util::write_bin(os, numImages);
+                util::write_bin(os, numPointsPerImage);
+                util::write_bin(os, numParts);
+                util::write_bin(os, numBins);
+            }
+
+            void read(std::istream& is) {
+                util::read_bin(is, numImages);
+                util::read_bin(is, numPointsPerImage);
+                util::read_bin(is, numParts);
+                util::read_bin(is, numBins);
+            }
+        };
+
+        /** data_source should have config.numImages images */
+        AvatarTrainingWorker(AvatarDataSource& data_source, const Config& config, int num_threads, bool verbose)
+            : trainer(nodes, leafData, data_source, config.numParts), config(config),
+              numThreads(num_threads), verbose(verbose) {}
+
+        /** Render images, then serve coordinator until it finishes training */
+        void run(TrainingConnection& conn) {
+            trainer.initTraining(config.numImages, config.numPointsPerImage, 0, numThreads, verbose);
+            trainer.nodeInterval.resize(1);
+            trainer.nodeInterval[0][0] = 0;
+            trainer.nodeInterval[0][1] = trainer.samples.size();
+
+            std::ostringstream counts;
+            writeCounts(counts, trainer.countParts(0, trainer.samples.size()));
+            conn.send(TrainingConnection::MSG_CONFIG, counts.str());
+            std::cout << "Worker ready with " << trainer.samples.size() << " samples from " <<
+                config.numImages << " images\n" << std::flush;
+            serve(conn);
+            std::cout << "Worker finished\n" << std::flush;
+        }
+
+        /** Write per-part counts */
+        static void writeCounts(std::ostream& os, const RTree::Distribution& counts) {
+            for (int i = 0; i < counts.size(); ++i) {
+                util::write_bin(os, counts(i));
+            }
+        }
+
+    private:
+        /** Answer coordinator requests until MSG_DONE */
+        void serve(TrainingConnection& conn) {
+            while (true) {
+                uint32_t type;
+                std::istringstream is(conn.receive(type));
+                if (type == TrainingConnection::MSG_RANGES) {
+                    conn.send(TrainingConnection::MSG_RANGES, computeRanges(is));
+                } else if (type == TrainingConnection::MSG_HISTOGRAMS) {
+                    conn.send(TrainingConnection::MSG_HISTOGRAMS, computeHistograms(is));
+                } else if (type == TrainingConnection::MSG_SPLIT) {
+                    conn.send(TrainingConnection::MSG_SPLIT, splitNodes(is));
+                } else if (type == TrainingConnection::MSG_DONE) {
+                    break;
+                } else {
+                    std::cerr << "FATAL: distributed training protocol error: unexpected message " << type << "\n";
+                    std::exit(1);
+                }
+            }
+        }
+
+        /** Run fn(i) for i in [0, n) on numThreads threads */
+        template<class Fn>
+        void parallelFor(size_t n, Fn fn) {
+            std::atomic<size_t> index(0);
+            auto worker = [&]() {
+                while (true) {
+                    size_t i = index++;
+                    if (i >= n) break;
+                    fn(i);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (int i = 0; i < numThreads; ++i) {
+                threads.emplace_back(worker);
+            }
+            for (auto& thd : threads) {
+                thd.join();
+            }
+        }
+
+        std::string computeRanges(std::istream& is) {
+            readVector(is, roundNodes);
+            readVector(is, roundFeatures);
+            size_t featuresPerNode = roundFeatures.size() / std::max<size_t>(roundNodes.size(), 1);
+            size_t roundScores = 0;
+            for (int nodeId : roundNodes) {
+                roundScores += (trainer.nodeInterval[nodeId][1] - trainer.nodeInterval[nodeId][0]) * featuresPerNode;
+            }
+            // Keep scores for computeHistograms if they fit
+            scores.clear();
+            if (roundScores <= MAX_CACHED_SCORES) scores.resize(roundFeatures.size());
+            std::vector<float> minScores(roundFeatures.size()), maxScores(roundFeatures.size());
+            parallelFor(roundFeatures.size(), [&](size_t i) {
+                int nodeId = roundNodes[i / featuresPerNode];
+                const auto& feature = roundFeatures[i];
+                float minScore = std::numeric_limits<float>::max();
+                float maxScore = std::numeric_limits<float>::lowest();
+                size_t start = trainer.nodeInterval[nodeId][0], end = trainer.nodeInterval[nodeId][1];
+                if (scores.size()) scores[i].resize(end - start);
+                for (size_t j = start; j < end; ++j) {
+                    const auto& sample = trainer.samples[j];
+                    float score = scoreByFeature(trainer.data[sample.index],
+                            sample.pix, feature.u, feature.v);
+                    minScore = std::min(score, minScore);
+                    maxScore = std::max(score, maxScore);
+                    if (scores.size()) scores[i][j - start] = score;
+                }
+                minScores[i] = minScore;
+                maxScores[i] = maxScore;
+            });
+            std::ostringstream os;
+            writeVector(os, minScores);
+            writeVector(os, maxScores);
+            return os.str();
+        }
+
+        std::string computeHistograms(std::istream& is) {
+            std::vector<float> minScores, maxScores;
+            readVector(is, minScores);
+            readVector(is, maxScores);
+            size_t featuresPerNode = roundFeatures.size() / std::max<size_t>(roundNodes.size(), 1);
+            // Nonzero (bin * numParts + part, count) of each (node, feature)
+            std::vector<std::vector<uint32_t> > keys(roundFeatures.size()), counts(roundFeatures.size());
+            parallelFor(roundFeatures.size(), [&](size_t i) {
+                int nodeId = roundNodes[i / featuresPerNode];
+                size_t start = trainer.nodeInterval[nodeId][0], end = trainer.nodeInterval[nodeId][1];
+                if (start == end) return;
+                const auto& feature = roundFeatures[i];
+                // Bucketed as by the coordinator's histogram
+                ScoreHistogram histogram(config.numParts, config.numBins);
+                histogram.reset(minScores[i], maxScores[i]);
+                thread_local std::vector<uint32_t> dense;
+                dense.assign(static_cast<size_t>(config.numBins) * config.numParts, 0);
+                for (size_t j = start; j < end; ++j) {
+                    const auto& sample = trainer.samples[j];
+                    float score = scores.size() ? scores[i][j - start] :
+                        scoreByFeature(trainer.data[sample.index], sample.pix, feature.u, feature.v);
+                    ++dense[histogram.bin(score) * config.numParts + sample.label];
+                }
+                for (size_t k = 0; k < dense.size(); ++k) {
+                    if (dense[k]) {
+                        keys[i].push_back(static_cast<uint32_t>(k));
+                        counts[i].push_back(dense[k]);
+                    }
+                }
+            });
+            std::ostringstream os;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                writeVector(os, keys[i]);
+                writeVector(os, counts[i]);
+            }
+            return os.str();
+        }
+
+        std::string splitNodes(std::istream& is) {
+            uint64_t numSplits;
+            util::read_bin(is, numSplits);
+            std::ostringstream os;
+            for (uint64_t i = 0; i < numSplits; ++i) {
+                int nodeId, lnode, rnode;
+                AvatarTrainerV3::Feature feature;
+                float thresh;
+                util::read_bin(is, nodeId);
+                util::read_bin(is, lnode);
+                util::read_bin(is, rnode);
+                is.read(reinterpret_cast<char*>(feature.u.data()), 2 * sizeof(float));
+                is.read(reinterpret_cast<char*>(feature.v.data()), 2 * sizeof(float));
+                util::read_bin(is, thresh);
+
+                size_t start = trainer.nodeInterval[nodeId][0], end = trainer.nodeInterval[nodeId][1];
+                size_t mid = start == end ? start :
+                    trainer.split(start, end, feature, thresh,
+                            end - start > 100000 ? numThreads : 1);
+                trainer.nodeInterval.resize(std::max<size_t>(trainer.nodeInterval.size(), std::max(lnode, rnode) + 1));
+                trainer.nodeInterval[lnode] << start, mid;
+                trainer.nodeInterval[rnode] << mid, end;
+                writeCounts(os, trainer.countParts(start, mid));
+            }
+            return os.str();
+        }
+
+        // Unused: the coordinator owns the tree
+        std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> > nodes;
+        RTree::LeafTable leafData;
+        AvatarTrainerV3 trainer;
+        Config config;
+        int numThreads;
+        bool verbose;
+
+        // Nodes being split in current round, and features of each
+        // (features for node roundNodes[i] are i * featuresPerNode ...)
+        std::vector<int> roundNodes;
+        std::vector<AvatarTrainerV3::Feature> roundFeatures;
+        // Score of each sample for each (node, feature) of the round, if cached
+        std::vector<std::vector<float> > scores;
+
+        /** Most scores kept between computeRanges and computeHistograms (256 MB) */
+        static const size_t MAX_CACHED_SCORES = size_t(1) << 26;
+    };
+
+    /** Distributed training coordinator: trains the tree level by level
+     *  like AvatarTrainerV3 without holding any samples. For each batch of
+     *  open nodes, it draws random features, and reduces the workers'
+     *  score ranges and then score histograms to choose the splits,
+     *  which the workers then apply to their samples */
+    class AvatarTrainingCoordinator {
+    public:
+        AvatarTrainingCoordinator(std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes,
+                RTree::LeafTable& leaf_data, int num_parts)
+            : nodes(nodes), leafData(leaf_data), numParts(num_parts) {}
+
+        /** Accept num_workers workers on listening socket listen_fd and train.
+         *  num_images is divided between the workers */
+        void train(int listen_fd, int num_workers, int num_images, int num_points_per_image,
+                int num_features, int max_probe_offset, int min_samples, int min_samples_per_feature,
+                int max_tree_depth, int num_threads, bool verbose) {
+            numFeatures = num_features;
+            maxProbeOffset = max_probe_offset;
+            minSamples = min_samples;
+            numBins = min_samples_per_feature; // See IGTrainState3
+            numThreads = num_threads;
+            this->verbose = verbose;
+
+            std::cout << "Waiting for " << num_workers << " workers...\n" << std::flush;
+            for (int i = 0; i < num_workers; ++i) {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd == -1) {
+                    std::cerr << "FATAL: failed to accept worker: " << strerror(errno) << "\n";
+                    std::exit(1);
+                }
+                workers.emplace_back(new TrainingConnection(fd));
+                std::cout << "Worker " << i + 1 << " of " << num_workers << " connected\n" << std::flush;
+            }
+            RTree::Distribution rootCounts(numParts);
+            rootCounts.setZero();
+            for (int i = 0; i < num_workers; ++i) {
+                AvatarTrainingWorker::Config config;
+                config.numImages = num_images / num_workers + (i < num_images % num_workers);
+                config.numPointsPerImage = num_points_per_image;
+                config.numParts = numParts;
+                config.numBins = numBins;
+                std::ostringstream os;
+                config.write(os);
+                workers[i]->send(TrainingConnection::MSG_CONFIG, os.str());
+            }
+            for (auto& worker : workers) {
+                std::istringstream is(worker->receive(TrainingConnection::MSG_CONFIG));
+                rootCounts += readCounts(is);
+            }
+            std::cout << "All workers ready, " << rootCounts.sum() << " samples in total\n\n" <<
+                "Init distributed RTree training with maximum depth " << max_tree_depth << "\n" << std::flush;
+
+            nodes.resize(1);
+            std::vector<OpenNode> level;
+            level.push_back({0, static_cast<uint32_t>(max_tree_depth), rootCounts});
+            while (!level.empty()) {
+                level = trainLevel(level);
+            }
+            for (auto& worker : workers) {
+                worker->send(TrainingConnection::MSG_DONE, "");
+            }
+            std::cout << "Distributed RTree training finished\n" << std::flush;
+        }
+
+    private:
+        /** Node to be trained in the current level */
+        struct OpenNode {
+            int id;
+            // Remaining depth
+            uint32_t depth;
+            // Number of samples of each part in the node, over all workers
+            RTree::Distribution counts;
+        };
+
+        /** Upper limit on size of the histograms sent by all workers
+         *  in one round; levels with more nodes are split into rounds */
+        static const size_t MAX_ROUND_HISTOGRAM_BYTES = size_t(1) << 28;
+
+        RTree::Distribution readCounts(std::istream& is) {
+            RTree::Distribution counts(numParts);
+            for (int i = 0; i < numParts; ++i) {
+                util::read_bin(is, counts(i));
+            }
+            return counts;
+        }
+
+        std::vector<OpenNode> trainLevel(const std::vector<OpenNode>& level) {
+            std::vector<OpenNode> nextLevel;
+            std::vector<const OpenNode*> toSplit;
+            size_t levelSamples = 0;
+            for (auto& open : level) {
+                float total = open.counts.sum();
+                if (open.depth <= 1 || total <= minSamples ||
+                        (open.counts.array() > 0.f).count() <= 1) {
+                    makeLeaf(open.id, open.counts);
+                } else {
+                    toSplit.push_back(&open);
+                    levelSamples += static_cast<size_t>(total);
+                }
+            }
+            if (toSplit.empty()) return nextLevel;
+            std::cout << "Distributed RTree training for level with remaining depth: " << toSplit[0]->depth <<
+                ". Internal nodes: " << toSplit.size() << ", samples: " << levelSamples << "\n" << std::flush;
+
+            // Batch nodes so that histograms fit in memory; a histogram has at
+            // most one nonzero entry per sample on each worker
+            size_t batchStart = 0;
+            while (batchStart < toSplit.size()) {
+                size_t batchEnd = batchStart, batchBytes = 0;
+                while (batchEnd < toSplit.size()) {
+                    size_t nodeBytes = numFeatures * 2 * sizeof(uint32_t) *
+                        std::min(static_cast<size_t>(toSplit[batchEnd]->counts.sum()),
+                                static_cast<size_t>(numBins * numParts) * workers.size());
+                    if (batchEnd > batchStart && batchBytes + nodeBytes > MAX_ROUND_HISTOGRAM_BYTES) break;
+                    batchBytes += nodeBytes;
+                    ++batchEnd;
+                }
+                if (verbose && (batchStart > 0 || batchEnd < toSplit.size())) {
+                    std::cout << "Round with nodes " << batchStart << " to " << batchEnd - 1 << "\n" << std::flush;
+                }
+                trainRound(toSplit, batchStart, batchEnd, nextLevel);
+                batchStart = batchEnd;
+            }
+            return nextLevel;
+        }
+
+        /** Find and apply splits of nodes {start ... end-1} of to_split */
+        void trainRound(const std::vector<const OpenNode*>& to_split, size_t start, size_t end,
+                std::vector<OpenNode>& next_level) {
+            size_t numNodes = end - start, numPairs = numNodes * numFeatures;
+            std::vector<int> roundNodes;
+            std::vector<AvatarTrainerV3::Feature> features(numPairs);
+            for (size_t i = start; i < end; ++i) {
+                roundNodes.push_back(to_split[i]->id);
+            }
+            for (auto& feature : features) {
+                feature.u.x() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
+                feature.u.y() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
+                feature.v.x() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
+                feature.v.y() = random_util::uniform(0.5, maxProbeOffset) * (random_util::randint(0, 2) * 2 - 1);
+            }
+
+            // 1. Score ranges
+            std::ostringstream rangeRequest;
+            writeVector(rangeRequest, roundNodes);
+            writeVector(rangeRequest, features);
+            broadcast(TrainingConnection::MSG_RANGES, rangeRequest.str());
+            std::vector<float> minScores(numPairs, std::numeric_limits<float>::max()),
+                               maxScores(numPairs, std::numeric_limits<float>::lowest());
+            for (auto& worker : workers) {
+                std::istringstream is(worker->receive(TrainingConnection::MSG_RANGES));
+                std::vector<float> workerMin, workerMax;
+                readVector(is, workerMin);
+                readVector(is, workerMax);
+                for (size_t i = 0; i < numPairs; ++i) {
+                    minScores[i] = std::min(minScores[i], workerMin[i]);
+                    maxScores[i] = std::max(maxScores[i], workerMax[i]);
+                }
+            }
+
+            // 2. Histograms
+            std::ostringstream histRequest;
+            writeVector(histRequest, minScores);
+            writeVector(histRequest, maxScores);
+            broadcast(TrainingConnection::MSG_HISTOGRAMS, histRequest.str());
+            std::vector<std::string> replies;
+            for (auto& worker : workers) {
+                replies.push_back(worker->receive(TrainingConnection::MSG_HISTOGRAMS));
+            }
+            // Offset of each (node, feature) histogram in each reply
+            std::vector<std::vector<size_t> > offsets(workers.size(), std::vector<size_t>(numPairs));
+            for (size_t w = 0; w < workers.size(); ++w) {
+                size_t offset = 0;
+                for (size_t i = 0; i < numPairs; ++i) {
+                    offsets[w][i] = offset;
+                    uint64_t size;
+                    std::memcpy(&size, &replies[w][offset], sizeof size);
+                    offset += 2 * (sizeof size + size * sizeof(uint32_t));
+                }
+            }
+
+            // 3. Reduce histograms and choose best feature of each node
+            std::vector<float> bestInfoGains(numNodes, std::numeric_limits<float>::lowest()), bestThreshs(numNodes);
+            std::vector<size_t> bestPairs(numNodes);
+            std::atomic<size_t> nodeIndex(0);
+            auto worker = [&]() {
+                ScoreHistogram histogram(numParts, numBins);
+                while (true) {
+                    size_t n = nodeIndex++;
+                    if (n >= numNodes) break;
+                    for (size_t i = n * numFeatures; i < (n + 1) * numFeatures; ++i) {
+                        if (minScores[i] > maxScores[i]) continue;
+                        histogram.reset(minScores[i], maxScores[i]);
+                        for (size_t w = 0; w < workers.size(); ++w) {
+                            const char* ptr = &replies[w][offsets[w][i]];
+                            uint64_t size;
+                            std::memcpy(&size, ptr, sizeof size);
+                            const uint32_t* keys = reinterpret_cast<const uint32_t*>(ptr + sizeof size);
+                            const uint32_t* counts = reinterpret_cast<const uint32_t*>(ptr + 2 * sizeof size + size * sizeof(uint32_t));
+                            for (uint64_t k = 0; k < size; ++k) {
+                                histogram.addToBin(keys[k] / numParts, keys[k] % numParts, static_cast<float>(counts[k]));
+                            }
+                        }
+                        histogram.forEachSplit([&](float infoGain, float thresh) {
+                            if (infoGain > bestInfoGains[n]) {
+                                bestInfoGains[n] = infoGain;
+                                bestThreshs[n] = thresh;
+                                bestPairs[n] = i;
+                            }
+                        });
+                    }
+                }
+            };
+            {
+                std::vector<std::thread> threads;
+                for (int i = 0; i < numThreads; ++i) {
+                    threads.emplace_back(worker);
+                }
+                for (auto& thd : threads) {
+                    thd.join();
+                }
+            }
+
+            // 4. Split; nodes with no possible split become leaves
+            std::vector<size_t> splitNodes;
+            for (size_t n = 0; n < numNodes; ++n) {
+                const OpenNode& open = *to_split[start + n];
+                if (bestInfoGains[n] == std::numeric_limits<float>::lowest()) {
+                    makeLeaf(open.id, open.counts);
+                    continue;
+                }
+                splitNodes.push_back(n);
+                const auto& feature = features[bestPairs[n]];
+                auto& node = nodes[open.id];
+                node.u = feature.u;
+                node.v = feature.v;
+                node.thresh = bestThreshs[n];
+                node.lnode = static_cast<int>(nodes.size());
+                node.rnode = static_cast<int>(nodes.size()) + 1;
+                nodes.emplace_back();
+                nodes.emplace_back();
+            }
+            std::ostringstream splitOs;
+            util::write_bin<uint64_t>(splitOs, splitNodes.size());
+            for (size_t n : splitNodes) {
+                const auto& node = nodes[to_split[start + n]->id];
+                util::write_bin(splitOs, to_split[start + n]->id);
+                util::write_bin(splitOs, node.lnode);
+                util::write_bin(splitOs, node.rnode);
+                splitOs.write(reinterpret_cast<const char*>(node.u.data()), 2 * sizeof(float));
+                splitOs.write(reinterpret_cast<const char*>(node.v.data()), 2 * sizeof(float));
+                util::write_bin(splitOs, node.thresh);
+            }
+            broadcast(TrainingConnection::MSG_SPLIT, splitOs.str());
+            std::vector<RTree::Distribution> leftCounts(splitNodes.size(), RTree::Distribution::Zero(numParts));
+            for (auto& worker : workers) {
+                std::istringstream is(worker->receive(TrainingConnection::MSG_SPLIT));
+                for (auto& counts : leftCounts) {
+                    counts += readCounts(is);
+                }
+            }
+            for (size_t i = 0; i < splitNodes.size(); ++i) {
+                const OpenNode& open = *to_split[start + splitNodes[i]];
+                const auto& node = nodes[open.id];
+                RTree::Distribution rightCounts = open.counts - leftCounts[i];
+                // If the 'info gain' [actually is -(expected new entropy)] was zero then
+                // it means all of children have same class, so we should stop
+                uint32_t childDepth = bestInfoGains[splitNodes[i]] == 0.f ? 0 : open.depth - 1;
+                addChild(node.lnode, childDepth, leftCounts[i], open.counts, next_level);
+                addChild(node.rnode, childDepth, rightCounts, open.counts, next_level);
+            }
+        }
+
+        /** Add child to next level; a child without samples (possible only
+         *  from rounding at a bucket edge) is a leaf with its parent's distribution */
+        void addChild(int id, uint32_t depth, const RTree::Distribution& counts,
+                const RTree::Distribution& parent_counts, std::vector<OpenNode>& next_level) {
+            if (counts.sum() == 0.f) {
+                makeLeaf(id, parent_counts);
+            } else {
+                next_level.push_back({id, depth, counts});
+            }
+        }
+
+        void makeLeaf(int id, const RTree::Distribution& counts) {
+            nodes[id].leafid = static_cast<int>(leafData.size());
+            RTree::LeafTable::Row leaf = leafData.emplace_back();
+            leaf = counts / counts.sum();
+        }
+
+        void broadcast(TrainingConnection::MessageType type, const std::string& payload) {
+            for (auto& worker : workers) {
+                worker->send(type, payload);
+            }
+        }
+
+        std::vector<RTree::RNode, Eigen::aligned_allocator<RTree::RNode> >& nodes;
+        RTree::LeafTable& leafData;
+        std::vector<std::unique_ptr<TrainingConnection> > workers;
+        int numParts, numFeatures, maxProbeOffset, minSamples, numBins, numThreads;
+        bool verbose;
+    };
+#endif
+
+    // SIGINT handling: trainers poll panicMode
+    void sigHandler(int signal){
+        std::cout << "PANIC: RTree: received SIGINT, entering panic mode (tries to halt and save)\n" << std::flush;
+        panicMode = true;
+    }
+
+    // RTree implementation
+    RTree::RTree(int num_parts) : numParts(num_parts) {
+        leafData.reset(num_parts);
+    }
+    RTree::RTree(const std::string & path) {
+        if (!loadFile(path)) {
+            fprintf(stderr, "ERROR: RTree failed to initialize from %s\n", path.c_str());
+        }
+    }
+
+    bool RTree::loadFile(const std::string & path) {
+        std::ifstream bifs(path, std::ios::in | std::ios::binary);
+        char marker;
+        bifs.get(marker);
+        bool bestMatchLoaded = false, mapped = false;
+        if (marker == 'F') {
+            // Flat format, see exportFlatFile: map into memory, no parsing
+            bifs.close();
+            std::shared_ptr<char> mapping;
+            const char* base;
+            size_t fileSize;
+#ifndef _WIN32
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                if (fd >= 0) close(fd);
+                std::cerr << "ERROR: failed to open flat RTree file " << path << "\n";
+                return false;
+            }
+            fileSize = static_cast<size_t>(st.st_size);
+            void* addr = fileSize >= sizeof(FlatHeader) ?
+                mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (addr == MAP_FAILED) {
+                std::cerr << "ERROR: failed to memory map flat RTree file " << path << "\n";
+                return false;
+            }
+            mapping.reset(static_cast<char*>(addr), [fileSize](char* p) { munmap(p, fileSize); });
+            base = mapping.get();
+#else
+            // No mmap: read the file into a cache line aligned buffer instead
+            std::ifstream fifs(path, std::ios::in | std::ios::binary | std::ios::ate);
+            if (!fifs) {
+                std::cerr << "ERROR: failed to open flat RTree file " << path << "\n";
+                return false;
+            }
+            fileSize = static_cast<size_t>(fifs.tellg());
+            fifs.seekg(0);
+            mapping.reset(new char[fileSize + CACHE_LINE - 1], std::default_delete<char[]>());
+            char* buffer = reinterpret_cast<char*>(alignUp(
+                        reinterpret_cast<uintptr_t>(mapping.get()), CACHE_LINE));
+            if (fileSize < sizeof(FlatHeader) || !fifs.read(buffer, fileSize)) {
+                std::cerr << "ERROR: failed to read flat RTree file " << path << "\n";
+                return false;
+            }
+            base = buffer;
+#endif
+
+            const FlatHeader& header = *reinterpret_cast<const FlatHeader*>(base);
+            if (header.numParts <= 0 || header.numNodes == 0) {
+                std::cerr << "ERROR: flat RTree file " << path << " is corrupted (no parts or nodes)\n";
+                return false;
+            }
+            size_t leafDataOffset, bestMatchOffset, totalSize;
+            compactLayout(header.numNodes, header.numLeaves, header.numParts,
+                    leafDataOffset, bestMatchOffset, totalSize);
+            if (header.version != FLAT_FORMAT_VERSION || header.fileSize != fileSize ||
+                    header.nodesOffset % CACHE_LINE != 0 ||
+                    header.leafDataOffset != header.nodesOffset + leafDataOffset ||
+                    header.bestMatchOffset != header.nodesOffset + bestMatchOffset ||
+                    header.nodesOffset + totalSize > fileSize) {
+                std::cerr << "ERROR: flat RTree file " << path << " is corrupted or has unsupported version\n";
+                return false;
+            }
+            // Traversal trusts child and leaf indices: internal children come
+            // after their parent (breadth-first order, so no cycles), leaves
+            // and early exit leaves must exist, best matches must be parts
+            const CNode* cnodes = reinterpret_cast<const CNode*>(base + header.nodesOffset);
+            const uint8_t* bestMatch = reinterpret_cast<const uint8_t*>(base + header.bestMatchOffset);
+            for (uint32_t i = 0; i < header.numNodes; ++i) {
+                for (int j = 0; j < 2; ++j) {
+                    int32_t child = cnodes[i].child[j];
+                    if (child >= 0 ? child <= static_cast<int64_t>(i) || child >= static_cast<int64_t>(header.numNodes) :
+                                     ~child >= static_cast<int64_t>(header.numLeaves)) {
+                        std::cerr << "ERROR: flat RTree node " << i << " has invalid child\n";
+                        return false;
+                    }
+                }
+                if ((cnodes[i].earlyExit & 0xFFFFFF) > header.numLeaves) {
+                    std::cerr << "ERROR: flat RTree node " << i << " has invalid early exit leaf\n";
+                    return false;
+                }
+            }
+            for (uint32_t i = 0; i < header.numLeaves; ++i) {
+                if (bestMatch[i] >= header.numParts) {
+                    std::cerr << "ERROR: flat RTree leaf " << i << " has invalid best match\n";
+                    return false;
+                }
+            }
+            nodes.clear();
+            leafData.clear();
+            leafBestMatch.clear();
+            numParts = header.numParts;
+            compactData = mapping;
+            compactNodes = reinterpret_cast<const CNode*>(base + header.nodesOffset);
+            compactLeafData = reinterpret_cast<const float*>(base + header.leafDataOffset);
+            compactBestMatch = reinterpret_cast<const uint8_t*>(base + header.bestMatchOffset);
+            numCompactNodes = header.numNodes;
+            numCompactLeaves = header.numLeaves;
+            mapped = true;
+        } else if (marker == 'Q') {
+            // Quantized binary format, see exportQuantizedFile
+            uint8_t version, offsetShift;
+            uint32_t nNodes, nLeafs;
+            util::read_bin<uint8_t>(bifs, version);
+            if (version != QUANTIZED_FORMAT_VERSION) {
+                std::cerr << "ERROR: unsupported quantized RTree format version " << int(version) << "\n";
+                return false;
+            }
+            util::read_bin<uint32_t>(bifs, nNodes);
+            util::read_bin<uint32_t>(bifs, nLeafs);
+            util::read_bin<int32_t>(bifs, numParts);
+            util::read_bin<uint8_t>(bifs, offsetShift);
+            std::vector<QuantizedNode> qnodes(nNodes);
+            std::vector<uint8_t> qleaves(static_cast<size_t>(nLeafs) * (numParts + 1));
+            bifs.read(reinterpret_cast<char*>(qnodes.data()), sizeof(QuantizedNode) * nNodes);
+            bifs.read(reinterpret_cast<char*>(qleaves.data()), qleaves.size());
+            bifs.get(marker);
+            if (!bifs || marker != 'T') {
+                std::cerr << "ERROR: incorrect quantized RTree format, file truncated or T end marker missing\n";
+                return false;
+            }
+            bifs.close();
+
+            // Internal nodes (breadth-first order) followed by leaves
+            nodes.resize(nNodes + nLeafs);
+            leafData.reset(numParts, nLeafs);
+            leafBestMatch.resize(nLeafs);
+            const float offsetScale = 1.f / (1 << offsetShift);
+            for (uint32_t i = 0; i < nNodes; ++i) {
+                const QuantizedNode& qnode = qnodes[i];
+                RNode& node = nodes[i];
+                node.u = Vec2(qnode.u[0] * offsetScale, qnode.u[1] * offsetScale);
+                node.v = Vec2(qnode.v[0] * offsetScale, qnode.v[1] * offsetScale);
+                node.thresh = qnode.threshMM / 1000.f;
+                for (int j = 0; j < 2; ++j) {
+                    int32_t child = qnode.child[j] >= 0 ? qnode.child[j] : nNodes + ~qnode.child[j];
+                    if (child < 0 || child >= static_cast<int32_t>(nodes.size())) {
+                        std::cerr << "ERROR: quantized RTree node " << i << " has invalid child\n";
+                        return false;
+                    }
+                    (j ? node.rnode : node.lnode) = child;
+                }
+            }
+            for (uint32_t i = 0; i < nLeafs; ++i) {
+                const uint8_t* qleaf = &qleaves[static_cast<size_t>(i) * (numParts + 1)];
+                if (qleaf[0] >= numParts) {
+                    std::cerr << "ERROR: quantized RTree leaf " << i << " has invalid best match\n";
+                    return false;
+                }
+                nodes[nNodes + i].leafid = i;
+                leafBestMatch[i] = qleaf[0];
+                for (int j = 0; j < numParts; ++j) {
+                    leafData[i](j) = qleaf[j + 1] / 255.f;
+                }
+            }
+            bestMatchLoaded = true;
+        } else if (marker == 'R') {
+            // New binary format
+            uint32_t nNodes, nLeafs;
+            util::read_bin<uint32_t>(bifs, nNodes);
+            util::read_bin<uint32_t>(bifs, nLeafs);
+            util::read_bin<int32_t>(bifs, numParts);
+            nodes.resize(nNodes);
+            leafData.reset(numParts, nLeafs);
+            uint32_t lastLeafId = 0;
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                uint8_t isLeaf;
+                util::read_bin<uint8_t>(bifs, isLeaf);
+                if (isLeaf) {
+                    uint8_t cnt = 0;
+                    util::read_bin<uint8_t>(bifs, cnt);
+                    if (cnt > numParts) {
+                        std::cerr << "FATAL: leaf has " << int(cnt) << " parts, expected " << numParts << " at most\n";
+                        std::exit(1);
+                    }
+                    for (uint8_t j = 0; j < cnt; ++j) {
+                        uint8_t k;
+                        util::read_bin<uint8_t>(bifs, k);
+                        if (k > numParts) {
+                            std::cerr << "FATAL: leaf index " << int(k) << " is out of bounds, at most " << numParts << "\n";
+                            std::exit(1);
+                        }
+                        util::read_bin<float>(bifs, leafData[lastLeafId](k));
+                    }
+                    nodes[i].leafid = lastLeafId++;
+                } else {
+                    util::read_bin<int32_t>(bifs, nodes[i].lnode);
+                    util::read_bin<int32_t>(bifs, nodes[i].rnode);
+                    util::read_bin<float>(bifs, nodes[i].thresh);
+                    bifs.read(reinterpret_cast<char*>(nodes[i].u.data()), sizeof(float) * 2);
+                    bifs.read(reinterpret_cast<char*>(nodes[i].v.data()), sizeof(float) * 2);
+                }
+            }
+            bifs.get(marker);
+            if (marker != 'T') {
+                std::cerr << "Error: incorrect RTree format, T end marker missing\n";
+                std::exit(1);
+            }
+            bifs.close();
+        } else {
+            std::cout << "Note: loading rtree stored in legacy text format\n" << std::flush;
+            // Legacy format
+            bifs.close();
+            size_t nNodes, nLeafs;
+            std::ifstream ifs(path);
+            if (!ifs) return false;
+
+            ifs >> nNodes >> nLeafs >> numParts;
+            nodes.resize(nNodes);
+            leafData.reset(numParts, nLeafs);
 
             for (size_t i = 0; i < nNodes; ++i) {
                 ifs >> nodes[i].leafid;
@@ -3038,14 +5973,16 @@ namespace ark {
             }
 
             for (size_t i = 0; i < nLeafs; ++i) {
-                leafData[i].resize(numParts);
                 for (int j = 0 ; j < numParts; ++j){
                     ifs >> leafData[i](j);
                 }
             }
         }
 
-        updateBestMatchTable();
+        if (!mapped) {
+            if (!bestMatchLoaded) updateBestMatchTable();
+            compact();
+        }
 
         std::ifstream partmap_ifs(path + ".partmap");
         if (!partmap_ifs) {
@@ -3060,6 +5997,10 @@ namespace ark {
     }
 
     bool RTree::exportFile(const std::string & path) {
+        if (nodes.empty()) {
+            std::cerr << "ERROR: RTree has no nodes (memory mapped?), use exportFlatFile or exportQuantizedFile instead\n";
+            return false;
+        }
         std::ofstream ofs(path, std::ios::out | std::ios::binary);
         ofs.put('R');
         util::write_bin<uint32_t>(ofs, nodes.size());
@@ -3089,170 +6030,318 @@ namespace ark {
                 }
             }
         }
-        ofs.put('T');
-        ofs.close();
-        // Note: below code is for writing legacy format, disabled
-        // ofs << std::fixed << std::setprecision(8);
-        // ofs << nodes.size() << " " << leafData.size() << " " << numParts << "\n";
-        // for (size_t i = 0; i < nodes.size(); ++i) {
-        //     ofs << " " << nodes[i].leafid;
-        //     if (nodes[i].leafid < 0) {
-        //         ofs << "  " << nodes[i].lnode <<
-        //             " " << nodes[i].rnode <<
-        //             " " << nodes[i].thresh <<
-        //             " " << nodes[i].u[0] <<
-        //             " " << nodes[i].u[1] <<
-        //             " " << nodes[i].v[0] <<
-        //             " " << nodes[i].v[1];
-        //     }
-        //     ofs << "\n";
-        // }
-        // for (size_t i = 0; i < leafData.size(); ++i) {
-        //     ofs << " ";
-        //     for (int j = 0 ; j < numParts; ++j){
-        //         ofs << leafData[i](j) << " ";
-        //     }
-        //     ofs << "\n";
-        // }
-        // ofs.close();
+        ofs.put('T');
+        ofs.close();
+        // Note: below code is for writing legacy format, disabled
+        // ofs << std::fixed << std::setprecision(8);
+        // ofs << nodes.size() << " " << leafData.size() << " " << numParts << "\n";
+        // for (size_t i = 0; i < nodes.size(); ++i) {
+        //     ofs << " " << nodes[i].leafid;
+        //     if (nodes[i].leafid < 0) {
+        //         ofs << "  " << nodes[i].lnode <<
+        //             " " << nodes[i].rnode <<
+        //             " " << nodes[i].thresh <<
+        //             " " << nodes[i].u[0] <<
+        //             " " << nodes[i].u[1] <<
+        //             " " << nodes[i].v[0] <<
+        //             " " << nodes[i].v[1];
+        //     }
+        //     ofs << "\n";
+        // }
+        // for (size_t i = 0; i < leafData.size(); ++i) {
+        //     ofs << " ";
+        //     for (int j = 0 ; j < numParts; ++j){
+        //         ofs << leafData[i](j) << " ";
+        //     }
+        //     ofs << "\n";
+        // }
+        // ofs.close();
+        return true;
+    }
+
+    bool RTree::exportQuantizedFile(const std::string & path) {
+        // Nodes are written in compact (breadth-first) order
+        bool hadCompact = compactNodes != nullptr;
+        if (!hadCompact) compact();
+        if (compactNodes == nullptr) return false;
+
+        float maxOffset = 0.f;
+        for (int i = 0; i < numCompactNodes; ++i) {
+            const CNode& cnode = compactNodes[i];
+            for (int j = 0; j < 2; ++j) {
+                maxOffset = std::max(maxOffset, std::max(std::fabs(cnode.u[j]), std::fabs(cnode.v[j])));
+            }
+        }
+        // Largest number of fractional bits such that all offsets fit in int16
+        uint8_t offsetShift = 0;
+        while (offsetShift < 14 && maxOffset * (1 << (offsetShift + 1)) <= 32767.f) {
+            ++offsetShift;
+        }
+        const float offsetScale = static_cast<float>(1 << offsetShift);
+
+        std::ofstream ofs(path, std::ios::out | std::ios::binary);
+        if (!ofs) return false;
+        ofs.put('Q');
+        util::write_bin<uint8_t>(ofs, QUANTIZED_FORMAT_VERSION);
+        util::write_bin<uint32_t>(ofs, numCompactNodes);
+        util::write_bin<uint32_t>(ofs, numCompactLeaves);
+        util::write_bin<int32_t>(ofs, numParts);
+        util::write_bin<uint8_t>(ofs, offsetShift);
+        std::vector<QuantizedNode> qnodes(numCompactNodes);
+        for (int i = 0; i < numCompactNodes; ++i) {
+            const CNode& cnode = compactNodes[i];
+            QuantizedNode& qnode = qnodes[i];
+            for (int j = 0; j < 2; ++j) {
+                qnode.u[j] = saturateInt16(cnode.u[j] * offsetScale);
+                qnode.v[j] = saturateInt16(cnode.v[j] * offsetScale);
+                qnode.child[j] = cnode.child[j];
+            }
+            qnode.threshMM = saturateInt16(cnode.thresh * 1000.f);
+            qnode.reserved = 0;
+        }
+        ofs.write(reinterpret_cast<const char*>(qnodes.data()), sizeof(QuantizedNode) * qnodes.size());
+        // Leaves: best match, followed by distribution quantized to 1/255
+        std::vector<uint8_t> qleaf(numParts + 1);
+        for (int i = 0; i < numCompactLeaves; ++i) {
+            const float* leaf = compactLeafData + static_cast<size_t>(i) * numParts;
+            qleaf[0] = compactBestMatch[i];
+            for (int j = 0; j < numParts; ++j) {
+                qleaf[j + 1] = static_cast<uint8_t>(std::max(0.f,
+                            std::min(255.f, std::round(leaf[j] * 255.f))));
+            }
+            ofs.write(reinterpret_cast<const char*>(qleaf.data()), qleaf.size());
+        }
+        ofs.put('T');
+        ofs.close();
+
+        if (!hadCompact) releaseCompact();
+        return true;
+    }
+
+    bool RTree::exportFlatFile(const std::string & path) {
+        bool hadCompact = compactNodes != nullptr;
+        if (!hadCompact) compact();
+        if (compactNodes == nullptr) return false;
+
+        size_t leafDataOffset, bestMatchOffset, totalSize;
+        compactLayout(numCompactNodes, numCompactLeaves, numParts,
+                leafDataOffset, bestMatchOffset, totalSize);
+        FlatHeader header;
+        header.marker = 'F';
+        header.version = FLAT_FORMAT_VERSION;
+        header.reserved = 0;
+        header.numParts = numParts;
+        header.numNodes = numCompactNodes;
+        header.numLeaves = numCompactLeaves;
+        header.nodesOffset = alignUp(sizeof(FlatHeader), CACHE_LINE);
+        header.leafDataOffset = header.nodesOffset + leafDataOffset;
+        header.bestMatchOffset = header.nodesOffset + bestMatchOffset;
+        header.fileSize = header.nodesOffset + totalSize;
+
+        std::ofstream ofs(path, std::ios::out | std::ios::binary);
+        if (!ofs) return false;
+        std::vector<char> padding(CACHE_LINE, 0);
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(FlatHeader));
+        ofs.write(padding.data(), header.nodesOffset - sizeof(FlatHeader));
+        ofs.write(reinterpret_cast<const char*>(compactNodes), sizeof(CNode) * numCompactNodes);
+        ofs.write(padding.data(), leafDataOffset - sizeof(CNode) * numCompactNodes);
+        ofs.write(reinterpret_cast<const char*>(compactLeafData),
+                sizeof(float) * numCompactLeaves * numParts);
+        ofs.write(reinterpret_cast<const char*>(compactBestMatch), numCompactLeaves);
+        ofs.close();
+
+        if (!hadCompact) releaseCompact();
+        return static_cast<bool>(ofs);
+    }
+
+    bool RTree::exportCompiledSource(const std::string & path) {
+        bool hadCompact = compactNodes != nullptr;
+        if (!hadCompact) compact();
+        if (compactNodes == nullptr) return false;
+
+        std::ofstream ofs(path);
+        if (!ofs) return false;
+        // Enough digits to round trip, and always a decimal point
+        ofs << std::showpoint << std::setprecision(std::numeric_limits<float>::max_digits10);
+        ofs << "// Random tree with " << numCompactNodes << " internal nodes and "
+            << numCompactLeaves << " leaves as straight-line code.\n"
+            << "// Generated by RTree::exportCompiledSource, do not edit.\n"
+            << "// Load with RTree::loadCompiled\n"
+            << "#include <cmath>\n#include <cstddef>\n#include <cstdint>\n\n"
+            << "namespace {\n"
+            << "struct Pixel {\n"
+            << "    const float* depth;\n"
+            << "    int depthStep, r, c;\n"
+            << "    float z;\n"
+            << "    int tlX, tlY, brX, brY;\n"
+            << "};\n\n"
+            << "inline float probe(const Pixel& p, int x, int y) {\n"
+            << "    if (x < p.tlX || y < p.tlY || x > p.brX || y > p.brY) return "
+            << BACKGROUND_DEPTH << "f;\n"
+            << "    float z = p.depth[static_cast<ptrdiff_t>(y) * p.depthStep + x];\n"
+            << "    return z == 0.0 ? " << BACKGROUND_DEPTH << "f : z;\n"
+            << "}\n\n"
+            << "inline bool goLeft(const Pixel& p, float ux, float uy, float vx, float vy, float thresh) {\n"
+            << "    float zu = probe(p, static_cast<int32_t>(std::round(ux / p.z)) + p.c,\n"
+            << "                        static_cast<int32_t>(std::round(uy / p.z)) + p.r),\n"
+            << "          zv = probe(p, static_cast<int32_t>(std::round(vx / p.z)) + p.c,\n"
+            << "                        static_cast<int32_t>(std::round(vy / p.z)) + p.r);\n"
+            << "    return zu - zv < thresh;\n"
+            << "}\n\n";
+
+        // Functions are emitted in breadth-first order of their roots;
+        // declare all of them first
+        std::vector<int32_t> roots(1, 0);
+        std::ostringstream body;
+        body << std::showpoint << std::setprecision(std::numeric_limits<float>::max_digits10);
+        for (size_t i = 0; i < roots.size(); ++i) {
+            body << "\nint node" << roots[i] << "(const Pixel& p) {\n";
+            writeCompiledSubtree(body, compactNodes, roots[i], 0, roots);
+            body << "}\n";
+        }
+        for (int32_t root : roots) {
+            ofs << "int node" << root << "(const Pixel& p);\n";
+        }
+        ofs << body.str() << "}\n\n";
+
+        ofs << "extern \"C\" {\n"
+            << "uint64_t openark_rtree_fingerprint() {\n"
+            << "    return " << compactFingerprint(compactNodes, numCompactNodes) << "ULL;\n"
+            << "}\n\n"
+            << "void openark_rtree_traverse(const float* depth, int depth_step, int r,\n"
+            << "        const int* cols, int n, int tl_x, int tl_y, int br_x, int br_y, int* leaves) {\n"
+            << "    Pixel p = { depth, depth_step, r, 0, 0.f, tl_x, tl_y, br_x, br_y };\n"
+            << "    const float* row = depth + static_cast<ptrdiff_t>(r) * depth_step;\n"
+            << "    for (int i = 0; i < n; ++i) {\n"
+            << "        p.c = cols[i];\n"
+            << "        p.z = row[p.c];\n"
+            << "        leaves[i] = node0(p);\n"
+            << "    }\n"
+            << "}\n"
+            << "}\n";
+        ofs.close();
+
+        if (!hadCompact) releaseCompact();
+        return static_cast<bool>(ofs);
+    }
+
+    bool RTree::loadCompiled(const std::string & path) {
+        if (compactNodes == nullptr) {
+            std::cerr << "ERROR: compact layout required to use compiled tree\n";
+            return false;
+        }
+#ifdef _WIN32
+        std::cerr << "ERROR: compiled trees are not supported on Windows, cannot load " << path << "\n";
+        return false;
+#else
+        void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr) {
+            std::cerr << "ERROR: failed to load compiled tree " << path << ": " << dlerror() << "\n";
+            return false;
+        }
+        std::shared_ptr<void> lib(handle, [](void* h) { dlclose(h); });
+        typedef uint64_t (*FingerprintFn)();
+        FingerprintFn fingerprint = reinterpret_cast<FingerprintFn>(
+                dlsym(handle, "openark_rtree_fingerprint"));
+        CompiledTraversal traverse = reinterpret_cast<CompiledTraversal>(
+                dlsym(handle, "openark_rtree_traverse"));
+        if (fingerprint == nullptr || traverse == nullptr) {
+            std::cerr << "ERROR: " << path << " is not a compiled random tree\n";
+            return false;
+        }
+        if (fingerprint() != compactFingerprint(compactNodes, numCompactNodes)) {
+            std::cerr << "ERROR: compiled tree " << path << " was generated from a different model\n";
+            return false;
+        }
+        compiledLib = lib;
+        compiledTraversal = traverse;
         return true;
+#endif
+    }
+
+    int RTree::findLeaf(const cv::Mat& depth, const Vec2i& pix) const {
+        return traverseTreeROI(*this, depth, pix.y(), pix.x(),
+                depth.at<float>(pix.y(), pix.x()), cv::Point(0, 0),
+                cv::Point(depth.cols - 1, depth.rows - 1));
     }
 
-     RTree::Distribution RTree::predictRecursive(int nodeid, const cv::Mat& depth, const Vec2i& pix) {
-         auto& node = nodes[nodeid];
-         if (node.leafid == -1) {
-             if (scoreByFeature(depth, pix, node.u, node.v) < node.thresh) {
-                 return predictRecursive(node.lnode, depth, pix);
-             } else {
-                 return predictRecursive(node.rnode, depth, pix);
-             }
-         } else {
-             return leafData[node.leafid];
-         }
-     }
-
-     uint8_t RTree::predictRecursiveBest(int nodeid, const cv::Mat& depth, const Vec2i& pix) {
-         auto& node = nodes[nodeid];
-         if (node.leafid == -1) {
-             if (scoreByFeature(depth, pix, node.u, node.v) < node.thresh) {
-                 return predictRecursiveBest(node.lnode, depth, pix);
-             } else {
-                 return predictRecursiveBest(node.rnode, depth, pix);
-             }
-         } else {
-             return leafBestMatch[node.leafid];
-         }
-     }
+    const float* RTree::leafDistribution(int leafid) const {
+        if (compactNodes != nullptr) {
+            return compactLeafData + static_cast<size_t>(leafid) * numParts;
+        }
+        return leafData[leafid].data();
+    }
 
     RTree::Distribution RTree::predict(const cv::Mat& depth, const Vec2i& pix) {
-        return predictRecursive(0, depth, pix);
+        return Eigen::Map<const Distribution>(leafDistribution(findLeaf(depth, pix)), numParts);
     }
 
     uint8_t RTree::predictBest(const cv::Mat& depth, const Vec2i& pix) {
-        return predictRecursiveBest(0, depth, pix);
+        int leafid = findLeaf(depth, pix);
+        return compactNodes != nullptr ? compactBestMatch[leafid] : leafBestMatch[leafid];
     }
 
-    std::vector<cv::Mat> RTree::predict(const cv::Mat& depth) {
-        std::vector<cv::Mat> result;
-        result.reserve(numParts);
-        for (int i = 0; i < numParts; ++i) {
-            result.emplace_back(depth.size(), CV_32F);
-            result[i].setTo(0.f);
-        }
-        Vec2i pix;
-        Distribution distr;
-        std::vector<float*> ptr(numParts);
-        for (int r = 0; r < depth.rows; ++r) {
-            pix(1) = r;
-            for (int i = 0; i < numParts; ++i) {
-                ptr[i] = result[i].ptr<float>(r);
-            }
-            const auto* inPtr = depth.ptr<float>(r);
-            for (int c = 0; c < depth.cols; ++c) {
-                if (inPtr[c] <= 0.f) continue;
-                pix(0) = c;
-                distr = predictRecursive(0, depth, pix);
-                for (int i = 0; i < numParts; ++i) {
-                    ptr[i][c] = distr(i);
-                }
-            }
-        }
+    void RTree::predict(const cv::Mat& depth, cv::Mat& output, int num_threads,
+            int interval, cv::Point top_left, cv::Point bot_right) const {
+        cv::Size gridSize = predictionGrid(depth, interval, top_left, bot_right);
+        // Does not reallocate if output already has the right size and type
+        output.create(gridSize, CV_32FC(numParts));
+        if (gridSize.area() == 0) return;
+        const size_t distSize = numParts * sizeof(float);
+        traverseTreeGrid(*this, depth, num_threads, interval, gridSize,
+                top_left, bot_right,
+                [&](int i, const int* cols, const int* leaves, int n) {
+                    float* ptr = output.ptr<float>(i);
+                    memset(ptr, 0, gridSize.width * distSize);
+                    for (int k = 0; k < n; ++k) {
+                        // Read directly from leaf table
+                        memcpy(ptr + (cols[k] - top_left.x) / interval * numParts,
+                               leafDistribution(leaves[k]), distSize);
+                    }
+                });
+    }
+
+    cv::Mat RTree::predict(const cv::Mat& depth, int num_threads, int interval,
+            cv::Point top_left, cv::Point bot_right) const {
+        cv::Mat result;
+        predict(depth, result, num_threads, interval, top_left, bot_right);
         return result;
     }
 
+    void RTree::predictLeaves(const cv::Mat& depth, cv::Mat& output, int num_threads,
+            int interval, cv::Point top_left, cv::Point bot_right) const {
+        cv::Size gridSize = predictionGrid(depth, interval, top_left, bot_right);
+        output.create(gridSize, CV_32S);
+        if (gridSize.area() == 0) return;
+        traverseTreeGrid(*this, depth, num_threads, interval, gridSize,
+                top_left, bot_right,
+                [&](int i, const int* cols, const int* leaves, int n) {
+                    int32_t* ptr = output.ptr<int32_t>(i);
+                    std::fill(ptr, ptr + gridSize.width, -1);
+                    for (int k = 0; k < n; ++k) {
+                        ptr[(cols[k] - top_left.x) / interval] = leaves[k];
+                    }
+                });
+    }
+
     cv::Mat RTree::predictBest(const cv::Mat& depth, int num_threads, int interval,
             cv::Point top_left,
             cv::Point bot_right,
-            bool fill_in_gaps) {
+            bool fill_in_gaps,
+            bool adaptive) {
         cv::Mat result(depth.size(), CV_8U);
         result.setTo(255);
         if (bot_right.x == -1) {
             bot_right.x = depth.cols - 1;
             bot_right.y = depth.rows - 1;
         }
-        std::atomic<int> row(top_left.y);
-        auto worker = [&]() {
-            Vec2i pix;
-            uint8_t* ptr;
-            int r;
-            while(true) {
-                r = (row += interval);
-                if (r > bot_right.y) break;
-                pix(1) = r;
-                ptr = result.ptr<uint8_t>(r);
-                const auto* inPtr = depth.ptr<float>(r);
-                for (int c = top_left.x; c <= bot_right.x; c += interval) {
-                    if (inPtr[c] == 0.f) continue;
-                    pix(0) = c;
-                    int nodeid = 0;
-                    float sampleDepth = inPtr[c];
-                    while (nodes[nodeid].leafid == -1) {
-                        auto& node = nodes[nodeid];
-
-                        // Add feature u,v and round
-                        Eigen::Vector2f ut = node.u / sampleDepth,
-                            vt = node.v / sampleDepth;
-                        Eigen::Vector2i uti, vti;
-                        uti[0] = static_cast<int32_t>(std::round(ut.x()));
-                        uti[1] = static_cast<int32_t>(std::round(ut.y()));
-                        vti[0] = static_cast<int32_t>(std::round(vt.x()));
-                        vti[1] = static_cast<int32_t>(std::round(vt.y()));
-                        uti += pix.cast<int32_t>(); vti += pix.cast<int32_t>();
-
-                        float zu, zv;
-                        if (uti.x() < top_left.x || uti.y() < top_left.y ||
-                            uti.x() > bot_right.x || uti.y() > bot_right.y) {
-                            zu = ark::RTree::BACKGROUND_DEPTH;
-                        } else {
-                            zu = depth.at<float>(uti.y(), uti.x());
-                            if (zu == 0.0) zu = ark::RTree::BACKGROUND_DEPTH;
-                        }
-                        if (vti.x() < top_left.x || vti.y() < top_left.y ||
-                            vti.x() > bot_right.x || vti.y() > bot_right.y) {
-                            zv = ark::RTree::BACKGROUND_DEPTH;
-                        } else {
-                            zv = depth.at<float>(vti.y(), vti.x());
-                            if (zv == 0.0) zv = ark::RTree::BACKGROUND_DEPTH;
-                        }
-
-                        if (zu - zv < node.thresh) {
-                            nodeid = node.lnode;
-                        } else {
-                            nodeid = node.rnode;
-                        }
-                    }
-                    ptr[c] = leafBestMatch[nodes[nodeid].leafid];
-                }
-            }
-        };
-        // int step = depth.rows / num_threads;
-        std::vector<std::thread> threadMgr;
-        for (int i = 0; i < num_threads; ++i) {
-            threadMgr.emplace_back(worker);
-        }
-        for (int i = 0; i < num_threads; ++i) {
-            threadMgr[i].join();
+        if (adaptive && interval > 1) {
+            labelAdaptive<TreeLabeler>(*this, result, depth, num_threads, interval,
+                    top_left, bot_right);
+            return result;
         }
+        labelGrid<TreeLabeler>(*this, result, depth, num_threads, interval,
+                top_left, bot_right);
 
         if (fill_in_gaps && interval > 1) {
             upscaleGrid(result, interval, num_threads, top_left, bot_right);
@@ -3276,16 +6365,22 @@ namespace ark {
                    int threshes_per_feature,
                    int max_images_loaded,
                    int mem_limit_mb,
-                   const std::string& train_partial_save_path
+                   const std::string& train_partial_save_path,
+                   const std::string& image_store_path,
+                   const std::string& telemetry_path
                ) {
         nodes.reserve(1 << std::min(max_tree_depth, 22));
+        leafData.reset(numParts);
         FileDataSource dataSource(depth_dir, part_mask_dir);
         TrainerV2<FileDataSource> trainer(nodes, leafData, dataSource, numParts, static_cast<size_t>(max_images_loaded));
+        TrainingTelemetry telemetry;
+        if (!telemetry_path.empty() && telemetry.open(telemetry_path)) trainer.telemetry = &telemetry;
         trainer.train(num_images, num_points_per_image, num_features,
                 num_features_filtered,
                 max_probe_offset, min_samples, max_tree_depth, min_samples_per_feature, frac_samples_per_feature, threshes_per_feature,
-                num_threads, train_partial_save_path, mem_limit_mb, verbose);
+                num_threads, train_partial_save_path, mem_limit_mb, verbose, image_store_path);
         updateBestMatchTable();
+        compact();
     }
 
     void RTree::trainFromAvatar(AvatarModel& avatar_model,
@@ -3307,108 +6402,196 @@ namespace ark {
                    const std::vector<int>& part_map,
                    int max_images_loaded,
                    int mem_limit_mb,
-                   const std::string& train_partial_save_path
+                   const std::string& train_partial_save_path,
+                   int probe_ring_size,
+                   const std::string& telemetry_path
                ) {
         nodes.reserve(1 << std::min(max_tree_depth, 22));
+        leafData.reset(numParts);
         AvatarDataSource dataSource(avatar_model, pose_seq, intrin, image_size, num_images, part_map);
         // TrainerV2<AvatarDataSource> trainer(nodes, leafData, dataSource, numParts, static_cast<size_t>(max_images_loaded));
         // trainer.train(num_images, num_points_per_image, num_features, num_features_filtered,
                 // max_probe_offset, min_samples, max_tree_depth, min_samples_per_feature, frac_samples_per_feature,
                 // threshes_per_feature, num_threads, train_partial_save_path, mem_limit_mb, verbose);
         AvatarTrainerV3 trainer(nodes, leafData, dataSource, numParts);
-        // Ugly way to save when we get SIGINT
-        currentTrainer = &trainer;
+        TrainingTelemetry telemetry;
+        if (!telemetry_path.empty() && telemetry.open(telemetry_path)) trainer.telemetry = &telemetry;
+        // Save when we get SIGINT
         signal(SIGINT, sigHandler);
         trainer.train(num_images, num_points_per_image, num_features,
                    max_probe_offset, min_samples, min_samples_per_feature,
                    max_tree_depth, num_threads,
-                   train_partial_save_path, verbose);
-        currentTrainer = nullptr;
+                   train_partial_save_path, verbose, probe_ring_size);
+        if (trainer.halted) {
+            std::cout << "PANIC: Termination procedure complete\n" << std::flush;
+            std::exit(0);
+        }
         partMap = part_map;
         updateBestMatchTable();
+        compact();
     }
 
-    void RTree::trainTransfer(AvatarModel& avatar_model,
-            AvatarPoseSequence& pose_seq,
-            CameraIntrin& intrin,
-            cv::Size& image_size,
-            int num_threads,
-            bool verbose,
-            int num_images
-            ) {
-
-        Eigen::Matrix<uint64_t, Eigen::Dynamic, Eigen::Dynamic> newLeafData(numParts, leafData.size());
-        newLeafData.setZero();
+    bool RTree::trainDistributed(const std::string& address,
+                   int num_workers,
+                   int num_threads,
+                   bool verbose,
+                   int num_images,
+                   int num_points_per_image,
+                   int num_features,
+                   int max_probe_offset,
+                   int min_samples,
+                   int max_tree_depth,
+                   int min_samples_per_feature,
+                   const std::vector<int>& part_map
+               ) {
+#ifdef _WIN32
+        std::cerr << "ERROR: distributed training is not supported on Windows\n";
+        return false;
+#else
+        int listenFd = TrainingConnection::listenAt(address, num_workers);
+        if (listenFd == -1) return false;
+        nodes.clear();
+        nodes.reserve(1 << std::min(max_tree_depth, 22));
+        leafData.reset(numParts);
+        AvatarTrainingCoordinator coordinator(nodes, leafData, numParts);
+        coordinator.train(listenFd, num_workers, num_images, num_points_per_image,
+                num_features, max_probe_offset, min_samples, min_samples_per_feature,
+                max_tree_depth, num_threads, verbose);
+        close(listenFd);
+        partMap = part_map;
+        updateBestMatchTable();
+        compact();
+        return true;
+#endif
+    }
 
-        {
-            AvatarDataSource dataSource(avatar_model, pose_seq, intrin, image_size, num_images, partMap);
-            std::atomic<size_t> atomicImageCnt(0);
-            std::mutex transMutex;
-            auto worker = [&]() {
-                Eigen::Matrix<uint64_t, Eigen::Dynamic, Eigen::Dynamic> threadLeafData(numParts, leafData.size());
-                threadLeafData.setZero();
-                size_t i;
-                while (true) {
-                    i = atomicImageCnt++;
-                    if (i >= num_images) break;
-                    cv::Mat depth, mask;
-                    if (i % 1000 == 999) {
-                        std::cout << "Training on images: " << i+1 << " of " << num_images << "\n" << std::flush;
-                    }
-                    dataSource.loadSimple(i, depth, mask);
+    bool RTree::runTrainingWorker(const std::string& address,
+                   AvatarModel& avatar_model,
+                   AvatarPoseSequence& pose_seq,
+                   CameraIntrin& intrin,
+                   cv::Size& image_size,
+                   const std::vector<int>& part_map,
+                   int num_threads,
+                   bool verbose
+               ) {
+#ifdef _WIN32
+        std::cerr << "ERROR: distributed training is not supported on Windows\n";
+        return false;
+#else
+        TrainingConnection conn;
+        std::cout << "Connecting to coordinator at " << address << "...\n" << std::flush;
+        if (!conn.connectTo(address, 60)) return false;
+        AvatarTrainingWorker::Config config;
+        std::istringstream is(conn.receive(TrainingConnection::MSG_CONFIG));
+        config.read(is);
+        AvatarDataSource dataSource(avatar_model, pose_seq, intrin, image_size, config.numImages, part_map);
+        AvatarTrainingWorker worker(dataSource, config, num_threads, verbose);
+        worker.run(conn);
+        return true;
+#endif
+    }
 
-                    // std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > candidates;
-                    // candidates.reserve(mask.rows * mask.cols / 15);
-                    RTree::Vec2i v;
-                    for (int r = 0; r < mask.rows; ++r) {
-                        v[1] = r;
-                        auto* ptr = mask.ptr<uint8_t>(r);
-                        for (int c = 0; c < mask.cols; ++c) {
-                            if (ptr[c] != 255) {
-                                v[0] = c;
-                                // candidates.emplace_back();
-                                int nodeid = 0;
-                                while (nodes[nodeid].leafid == -1) {
-                                    auto& node = nodes[nodeid];
-                                    if (scoreByFeature(depth, v, node.u, node.v) < node.thresh) {
-                                        nodeid = nodes[nodeid].lnode;
-                                    } else {
-                                        nodeid = nodes[nodeid].rnode;
-                                    }
+    /** Re-estimate leaf distributions of tree from num_images images of
+     *  data_source: each thread counts the parts of the labelled pixels
+     *  reaching each leaf into its own table, and the tables are merged at
+     *  the end, so threads never share counts. Unvisited leaves keep their
+     *  distribution. Caller must update the best match table and compact
+     *  layout. Returns false if tree has no leaf table */
+    template<class DataSource>
+    bool transferLeaves(RTree& tree, DataSource& data_source, int num_images,
+            int num_threads, bool verbose) {
+        if (tree.leafData.size() == 0) {
+            std::cerr << "ERROR: re-estimating leaves requires a tree with a leaf table (not memory mapped)\n";
+            return false;
+        }
+        const int numParts = tree.numParts;
+        const size_t numLeaves = tree.leafData.size();
+        num_threads = std::max(num_threads, 1);
+        using LeafCounts = Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic>;
+        Eigen::Matrix<uint64_t, Eigen::Dynamic, Eigen::Dynamic> counts(numParts, numLeaves);
+        counts.setZero();
+        std::vector<LeafCounts> threadCounts(num_threads);
+
+        std::atomic<int> imageIndex(0);
+        std::atomic<size_t> numSkipped(0);
+        // Only taken to empty a thread's counts before they could overflow
+        std::mutex overflowMutex;
+        auto worker = [&](int thread_id) {
+            LeafCounts& threadCount = threadCounts[thread_id];
+            threadCount.setZero(numParts, numLeaves);
+            size_t numCounted = 0, threadSkipped = 0;
+            while (true) {
+                int i = imageIndex++;
+                if (i >= num_images) break;
+                if (i % 1000 == 999 || (verbose && i % 100 == 99)) {
+                    std::cout << "Training on images: " << i+1 << " of " << num_images << "\n" << std::flush;
+                }
+                const std::array<cv::Mat, 2>& arr = data_source.load(i);
+                const cv::Mat& depth = arr[DATA_DEPTH];
+                const cv::Mat& mask = arr[DATA_PART_MASK];
+                if (depth.empty() || depth.type() != CV_32F || depth.size() != mask.size()) {
+                    std::cerr << "WARNING: skipping image " << i << " (missing or mismatched depth/part mask)\n";
+                    continue;
+                }
+                if (numCounted + depth.total() > std::numeric_limits<uint32_t>::max()) {
+                    std::lock_guard<std::mutex> lock(overflowMutex);
+                    counts += threadCount.cast<uint64_t>();
+                    threadCount.setZero();
+                    numCounted = 0;
+                }
+                traverseTreeGrid(tree, depth, 1, 1, depth.size(), cv::Point(0, 0),
+                        cv::Point(depth.cols - 1, depth.rows - 1),
+                        [&](int r, const int* cols, const int* leaves, int n) {
+                            const auto* maskPtr = mask.ptr<uint8_t>(r);
+                            for (int k = 0; k < n; ++k) {
+                                int partId = maskPtr[cols[k]];
+                                if (partId == 255) continue;
+                                if (partId >= numParts) {
+                                    ++threadSkipped;
+                                    continue;
                                 }
-
-                                int partId = mask.at<uint8_t>(v(1), v(0));
-                                int leafId = nodes[nodeid].leafid;
-                                threadLeafData(partId, leafId) += 1;
+                                ++threadCount(partId, leaves[k]);
                             }
-                        }
-                    }
-                    // std::vector<RTree::Vec2i, Eigen::aligned_allocator<RTree::Vec2i> > chosenCandidates =
-                    //     (candidates.size() > static_cast<size_t>(num_points_per_image)) ?
-                    //     random_util::choose(candidates, num_points_per_image) : std::move(candidates);
-                    // for (auto& v : chosenCandidates) {
-                    // }
-                }
-                {
-                    std::lock_guard<std::mutex> lock(transMutex);
-                    newLeafData += threadLeafData;
+                            numCounted += n;
+                        });
+            }
+            numSkipped += threadSkipped;
+        };
+        {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < num_threads; ++i) {
+                threads.emplace_back(worker, i);
+            }
+            for (auto& thd : threads) {
+                thd.join();
+            }
+        }
+        // Merge, each thread summing all tables for a range of leaves
+        {
+            size_t step = (numLeaves + num_threads - 1) / num_threads;
+            auto merger = [&](size_t start) {
+                size_t n = std::min(step, numLeaves - start);
+                for (const auto& threadCount : threadCounts) {
+                    counts.middleCols(start, n) += threadCount.middleCols(start, n).cast<uint64_t>();
                 }
             };
-
             std::vector<std::thread> threads;
-            for (int i = 0; i < num_threads; ++i) {
-                threads.emplace_back(worker);
+            for (size_t start = 0; start < numLeaves; start += step) {
+                threads.emplace_back(merger, start);
             }
-            for (int i = 0; i < num_threads; ++i) {
-                threads[i].join();
+            for (auto& thd : threads) {
+                thd.join();
             }
         }
+        if (numSkipped) {
+            std::cout << "WARNING: " << numSkipped << " pixels had part labels >= " << numParts << " and were ignored.\n";
+        }
 
         size_t zeroCnt = 0;
-        for (size_t i = 0; i < leafData.size(); ++i) {
-            uint64_t sum = newLeafData.col(i).sum();
-            if (sum > 0.0) {
-                leafData[i] = newLeafData.col(i).cast<float>() / static_cast<float>(sum);
+        for (size_t i = 0; i < numLeaves; ++i) {
+            uint64_t sum = counts.col(i).sum();
+            if (sum > 0) {
+                tree.leafData[i] = counts.col(i).cast<float>() / static_cast<float>(sum);
             } else {
                 ++zeroCnt;
             }
@@ -3416,6 +6599,40 @@ namespace ark {
         if (zeroCnt) {
             std::cout << "WARNING: " << zeroCnt << " leaves were unvisited, keeping old weights.\n";
         }
+        return true;
+    }
+
+    bool RTree::trainTransfer(AvatarModel& avatar_model,
+            AvatarPoseSequence& pose_seq,
+            CameraIntrin& intrin,
+            cv::Size& image_size,
+            int num_threads,
+            bool verbose,
+            int num_images
+            ) {
+        AvatarDataSource dataSource(avatar_model, pose_seq, intrin, image_size, num_images, partMap);
+        if (!transferLeaves(*this, dataSource, num_images, num_threads, verbose)) return false;
+        updateBestMatchTable();
+        compact();
+        return true;
+    }
+
+    bool RTree::trainTransfer(const std::string& depth_dir,
+            const std::string& part_mask_dir,
+            int num_threads,
+            bool verbose,
+            int num_images
+            ) {
+        FileDataSource dataSource(depth_dir, part_mask_dir);
+        if (dataSource._data_paths[DATA_DEPTH].size() != dataSource._data_paths[DATA_PART_MASK].size()) {
+            std::cerr << "ERROR: " << depth_dir << " and " << part_mask_dir << " have different numbers of images\n";
+            return false;
+        }
+        if (num_images < 0 || num_images > dataSource.size()) num_images = dataSource.size();
+        if (!transferLeaves(*this, dataSource, num_images, num_threads, verbose)) return false;
+        updateBestMatchTable();
+        compact();
+        return true;
     }
 
     void RTree::postProcess(cv::Mat& image,
@@ -3461,6 +6678,86 @@ namespace ark {
         }
     }
 
+    void RTree::compact() {
+        // Nothing to build from (e.g. memory mapped tree)
+        if (nodes.empty()) return;
+        // Compiled traversal may not match the new layout
+        compiledTraversal = nullptr;
+        compiledLib.reset();
+        // Breadth-first order of internal nodes (original indices)
+        std::vector<int> order;
+        order.reserve(nodes.size() / 2 + 1);
+        if (nodes[0].leafid < 0) order.push_back(0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            const RNode& node = nodes[order[i]];
+            if (nodes[node.lnode].leafid < 0) order.push_back(node.lnode);
+            if (nodes[node.rnode].leafid < 0) order.push_back(node.rnode);
+        }
+        // Single leaf tree: use one dummy node pointing to the leaf
+        size_t numCNodes = std::max<size_t>(order.size(), 1);
+
+        size_t leafDataOffset, bestMatchOffset, totalSize;
+        compactLayout(numCNodes, leafData.size(), numParts,
+                leafDataOffset, bestMatchOffset, totalSize);
+        compactData.reset(new char[totalSize + CACHE_LINE - 1],
+                std::default_delete<char[]>());
+        char* base = reinterpret_cast<char*>(alignUp(
+                    reinterpret_cast<uintptr_t>(compactData.get()), CACHE_LINE));
+        CNode* cnodes = reinterpret_cast<CNode*>(base);
+
+        if (order.empty()) {
+            CNode& cnode = cnodes[0];
+            cnode.u[0] = cnode.u[1] = cnode.v[0] = cnode.v[1] = 0.f;
+            cnode.thresh = 0.f;
+            cnode.child[0] = cnode.child[1] = ~nodes[0].leafid;
+            cnode.earlyExit = 0;
+        } else {
+            std::vector<int> newId(nodes.size(), -1);
+            for (size_t i = 0; i < order.size(); ++i) {
+                newId[order[i]] = static_cast<int>(i);
+            }
+            for (size_t i = 0; i < order.size(); ++i) {
+                const RNode& node = nodes[order[i]];
+                CNode& cnode = cnodes[i];
+                cnode.u[0] = node.u.x(); cnode.u[1] = node.u.y();
+                cnode.v[0] = node.v.x(); cnode.v[1] = node.v.y();
+                cnode.thresh = node.thresh;
+                const int children[2] = { node.lnode, node.rnode };
+                for (int j = 0; j < 2; ++j) {
+                    const RNode& child = nodes[children[j]];
+                    cnode.child[j] = child.leafid < 0 ? newId[children[j]] : ~child.leafid;
+                }
+                cnode.earlyExit = 0;
+            }
+        }
+
+        // Dense leaf distributions and best matches
+        float* leafTable = reinterpret_cast<float*>(base + leafDataOffset);
+        uint8_t* bestMatch = reinterpret_cast<uint8_t*>(base + bestMatchOffset);
+        std::copy(leafData.data(), leafData.data() + leafData.size() * numParts, leafTable);
+        std::copy(leafBestMatch.begin(), leafBestMatch.end(), bestMatch);
+        if (!leafBestMatch.empty()) {
+            SubtreeLeaves leaves;
+            computeEarlyExit(cnodes, 0, leafTable, bestMatch, numParts, leaves);
+        }
+
+        compactNodes = cnodes;
+        compactLeafData = leafTable;
+        compactBestMatch = bestMatch;
+        numCompactNodes = static_cast<int>(numCNodes);
+        numCompactLeaves = static_cast<int>(leafData.size());
+    }
+
+    void RTree::releaseCompact() {
+        compactNodes = nullptr;
+        compactLeafData = nullptr;
+        compactBestMatch = nullptr;
+        numCompactNodes = numCompactLeaves = 0;
+        compactData.reset();
+        compiledTraversal = nullptr;
+        compiledLib.reset();
+    }
+
     bool RTree::readPartMap(std::istream& is, std::vector<int>& result, int& num_new_parts, int& partmap_type) {
         std::string marker;
         is >> marker;
@@ -3506,4 +6803,149 @@ namespace ark {
         }
         return true;
     }
+
+    // RForest implementation
+    RForest::RForest() : numParts(0) {}
+    RForest::RForest(int num_parts) : numParts(num_parts) {}
+    RForest::RForest(const std::vector<std::string>& paths) : numParts(0) {
+        trees.reserve(paths.size());
+        for (auto& path : paths) {
+            if (!loadFile(path)) {
+                fprintf(stderr, "ERROR: RForest failed to load tree from %s\n", path.c_str());
+            }
+        }
+    }
+
+    bool RForest::loadFile(const std::string& path) {
+        {
+            // Forest file: "forest <num_trees>" then tree paths relative to it
+            std::ifstream ifs(path);
+            std::string marker;
+            if (ifs >> marker && marker == "forest") {
+                size_t numTrees;
+                ifs >> numTrees;
+                boost::filesystem::path dir = boost::filesystem::path(path).parent_path();
+                for (size_t t = 0; t < numTrees; ++t) {
+                    std::string treePath;
+                    if (!(ifs >> treePath)) {
+                        std::cerr << "ERROR: forest file " << path << " lists fewer than " << numTrees << " trees\n";
+                        return false;
+                    }
+                    if (!loadFile((dir / treePath).string())) return false;
+                }
+                return true;
+            }
+        }
+        RTree tree(0);
+        if (!tree.loadFile(path)) return false;
+        if (trees.size() && tree.numParts != numParts) {
+            std::cerr << "ERROR: tree at " << path << " has " << tree.numParts <<
+                " parts, but forest has " << numParts << " parts\n";
+            return false;
+        }
+        if (trees.empty()) {
+            numParts = tree.numParts;
+            partMap = tree.partMap;
+            partMapType = tree.partMapType;
+        }
+        trees.push_back(std::move(tree));
+        return true;
+    }
+
+    bool RForest::exportFile(const std::string& path) {
+        std::ofstream ofs(path);
+        if (!ofs) {
+            std::cerr << "ERROR: failed to write forest file " << path << "\n";
+            return false;
+        }
+        ofs << "forest " << trees.size() << "\n";
+        std::string name = boost::filesystem::path(path).filename().string();
+        for (size_t t = 0; t < trees.size(); ++t) {
+            std::string treeName = name + ".tree" + std::to_string(t);
+            if (!trees[t].exportFile(path + ".tree" + std::to_string(t))) return false;
+            ofs << treeName << "\n";
+        }
+        return true;
+    }
+
+    void RForest::trainFromAvatar(AvatarModel& avatar_model,
+                   AvatarPoseSequence& pose_seq,
+                   CameraIntrin& intrin,
+                   cv::Size& image_size,
+                   int num_trees,
+                   int num_threads,
+                   bool verbose,
+                   int num_images,
+                   int num_points_per_image,
+                   int num_features,
+                   int max_probe_offset,
+                   int min_samples,
+                   int max_tree_depth,
+                   int min_samples_per_feature,
+                   const std::vector<int>& part_map,
+                   const std::string& train_partial_save_path,
+                   int probe_ring_size,
+                   const std::string& telemetry_path
+               ) {
+        trees.assign(num_trees, RTree(numParts));
+        for (auto& tree : trees) {
+            tree.nodes.reserve(1 << std::min(max_tree_depth, 22));
+            tree.leafData.reset(numParts);
+        }
+        AvatarDataSource dataSource(avatar_model, pose_seq, intrin, image_size, num_images, part_map);
+        AvatarForestTrainer trainer(trees, dataSource, numParts);
+        TrainingTelemetry telemetry;
+        if (!telemetry_path.empty() && telemetry.open(telemetry_path)) trainer.telemetry = &telemetry;
+        // Save all trees when we get SIGINT
+        signal(SIGINT, sigHandler);
+        trainer.train(num_images, num_points_per_image, num_features,
+                   max_probe_offset, min_samples, min_samples_per_feature,
+                   max_tree_depth, num_threads,
+                   train_partial_save_path, verbose, probe_ring_size);
+        if (trainer.halted()) {
+            std::cout << "PANIC: Termination procedure complete\n" << std::flush;
+            std::exit(0);
+        }
+        partMap = part_map;
+        for (auto& tree : trees) {
+            tree.partMap = part_map;
+            tree.updateBestMatchTable();
+            tree.compact();
+        }
+    }
+
+    cv::Mat RForest::predictBest(const cv::Mat& depth, int num_threads, int interval,
+            cv::Point top_left,
+            cv::Point bot_right,
+            bool fill_in_gaps,
+            bool adaptive) const {
+        cv::Mat result(depth.size(), CV_8U);
+        result.setTo(255);
+        if (bot_right.x == -1) {
+            bot_right.x = depth.cols - 1;
+            bot_right.y = depth.rows - 1;
+        }
+        if (adaptive && interval > 1) {
+            labelAdaptive<ForestLabeler>(*this, result, depth, num_threads, interval,
+                    top_left, bot_right);
+            return result;
+        }
+        labelGrid<ForestLabeler>(*this, result, depth, num_threads, interval,
+                top_left, bot_right);
+
+        if (fill_in_gaps && interval > 1) {
+            upscaleGrid(result, interval, num_threads, top_left, bot_right);
+        }
+        return result;
+    }
+
+    void RForest::postProcess(cv::Mat& image,
+            Eigen::Matrix<double, 2, Eigen::Dynamic>& com_pre,
+            int interval,
+            int num_threads,
+            cv::Point top_left, cv::Point bot_right,
+            double dist_to_pre_weight) const {
+        trees[0].postProcess(image, com_pre, interval, num_threads,
+                top_left, bot_right, dist_to_pre_weight);
+    }
 }
@@ -69,11 +69,14 @@ namespace ark {
         cv::Mat result(rows, cols, CV_32FC1);
         for (int i = 0; i < rows; ++i) {
             int left = starts[(i << 1) | 1];
-            if (left == std::numeric_limits<int>::max()) continue;
+            auto* rowPtr = result.ptr<float>(i);
+            if (left == std::numeric_limits<int>::max()) {
+                std::fill(rowPtr, rowPtr + cols, 0.0f);
+                continue;
+            }
             int delta = starts[i << 1];
             int deltaNext = starts[(i+1) << 1];
             int right = left + (deltaNext - delta);
-            auto* rowPtr = result.ptr<float>(i);
             std::fill(rowPtr, rowPtr + left, 0.0f);
             std::fill(rowPtr + right, rowPtr + cols, 0.0f);
             std::copy(data.begin() + delta, data.begin() + deltaNext, rowPtr + left);
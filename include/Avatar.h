@@ -49,9 +49,20 @@ namespace ark {
          *                   mesh as triangles (mesh.txt),
          *                   and shape keys aka. blendshapes (shapekey/name.pcd).
          *                   Joint 0 is expected to be root.
+         *                   If the directory has a binary bundle (model.bundle, see exportBundle)
+         *                   that is newer than the files above, it is loaded instead.
          * @param limit_one_joint_per_point only use one assigned joint for each point. This improved performance at the cost of some accuracy.
+         * @param use_bundle if false, always parse the model files and ignore model.bundle
          */
-        explicit AvatarModel(const std::string & model_dir = "", bool limit_one_joint_per_point = false);
+        explicit AvatarModel(const std::string & model_dir = "", bool limit_one_joint_per_point = false,
+                bool use_bundle = true);
+
+        /** Write the model to a single binary bundle at 'path', which the constructor
+         *  loads without parsing if it is named model.bundle in the model directory
+         *  (see smplbundle). Shape key compression (see compressShapeKeys) is kept.
+         *  Must be called on a model loaded with
+         *  limit_one_joint_per_point = false. @return true on success */
+        bool exportBundle(const std::string & path) const;
 
         /** Get number of joints */
         inline int numJoints() const { return parent.rows(); }
@@ -59,6 +70,11 @@ namespace ark {
         inline int numPoints() const { return assignWeights.cols(); }
         /** Get number of shape keys */
         inline int numShapeKeys() const { return keyClouds.cols(); }
+        /** Get number of columns of the float skinning shape basis
+         *  (number of shape keys, unless reduced by compressShapeKeys) */
+        inline int numShapeBasis() const {
+            return shapeBasisCoeffs.rows() > 0 ? static_cast<int>(shapeBasisCoeffs.rows()) : numShapeKeys();
+        }
         /** Get number of polygon faces */
         inline int numFaces() const { return mesh.cols(); }
         /** Get whether a mesh is available */
@@ -122,8 +138,71 @@ namespace ark {
          *  terminated with num assignments total */
         Eigen::VectorXi assignStarts;
 
+        /** ADVANCED: Number of points rounded up to a multiple of 16; the float32
+         *  skinning data below is padded to this many points (padding has zero weight) */
+        int numPointsPadded = 0;
+
+        /** ADVANCED: baseCloud in float32 as x, y, z planes (3 * numPointsPadded) */
+        Eigen::VectorXf baseCloudSoA;
+
+        /** ADVANCED: Shape basis used for skinning in float32 as x, y, z planes
+         *  (3 * numPointsPadded, numShapeBasis()): keyClouds, or their truncated PCA
+         *  basis if shapeKeyRank is set. Empty if halfShapeKeys is set */
+        Eigen::MatrixXf keyCloudsSoA;
+
+        /** ADVANCED: keyCloudsSoA as IEEE float16 bits, same layout; only used if halfShapeKeys is set */
+        std::vector<uint16_t> keyCloudsHalf;
+
+        /** ADVANCED: Maps shape key weights to weights of the truncated PCA basis in
+         *  keyCloudsSoA (shapeKeyRank, num keys); empty if shape keys are used directly */
+        Eigen::MatrixXd shapeBasisCoeffs;
+
+        /** ADVANCED: Rank of the truncated PCA shape basis used for skinning,
+         *  0 to use all shape keys (see compressShapeKeys) */
+        int shapeKeyRank = 0;
+
+        /** ADVANCED: Whether the skinning shape basis is stored as float16 (see compressShapeKeys) */
+        bool halfShapeKeys = false;
+
+        /** ADVANCED: Greatest number of joints assigned to one point */
+        int maxInfluences = 0;
+
+        /** ADVANCED: Joint index and weight of k-th assignment of each point, at
+         *  k * numPointsPadded + point, sorted by descending weight; unused slots
+         *  have weight 0 (maxInfluences * numPointsPadded) */
+        Eigen::VectorXi skinJoints;
+        Eigen::VectorXf skinWeights;
+
+        /** ADVANCED: Bit mask of the joints assigned to each group of 16 points,
+         *  used to re-skin only points moved by changed joints; empty if more than 64 joints */
+        std::vector<uint64_t> skinGroupJoints;
+
+        /** ADVANCED: Rebuild the float32 skinning data above from baseCloud, keyClouds
+         *  and assignedJoints. Called by the constructor, call again after modifying those. */
+        void prepareSkinning();
+
+        /** Approximate the shape keys by a truncated PCA basis of 'rank' vectors (0 or at
+         *  least the number of shape keys: keep all), optionally storing the float skinning basis
+         *  as float16. Cuts memory and time of applying shape keys in Avatar::update and AvatarBatch.
+         *  keyClouds (and jointShapeReg, if used) are replaced by their rank 'rank' approximation,
+         *  so that all code paths agree (see smplcompress for the resulting vertex error).
+         *  This is one-way: calling again with a higher rank or 0 does not restore the
+         *  original shape keys, reload the model for that */
+        void compressShapeKeys(int rank, bool half_precision = false);
+
         /** The directory the avatar's model was imported from */
         const std::string MODEL_DIR;
+
+    private:
+        /** Parse the text model files in 'model_dir' */
+        void loadText(const std::string & model_dir);
+
+        /** Load binary bundle at 'path' (see exportBundle),
+         *  @return false if it is invalid, leaving the model unchanged */
+        bool loadBundle(const std::string & path);
+
+        /** Build assignedPoints, assignWeights and assignStarts from assignedJoints */
+        void setupAssignments(bool limit_one_joint_per_point);
     };
 
     /** Represents a generic avatar instance. The user should construct an AvatarModel first and
@@ -139,9 +218,15 @@ namespace ark {
          *  Must be called at least once after initializing the avatar.
          *  WARNING: this is relatively expensive, so don't call it until you really need
          *  to get the joints/points of the avatar (updating takes 0.3-0.6 ms typically)
+         *  Only recomputes what changed since the last call: shape keys and joint regression
+         *  are skipped if w is unchanged, and only points assigned to joints whose rotation
+         *  (or an ancestor's, or p) changed are re-skinned.
          */
         void update();
 
+        /** Make the next update() recompute everything, e.g. after modifying the model */
+        void invalidate();
+
         /** Randomize avatar's pose and shape according to PCA (shape) and GMM model (pose). */
         void randomize(bool randomize_pose = true, bool randomize_shape = true,
                        bool randomize_root_pos_rot = true, uint32_t seed = -1);
@@ -181,13 +266,88 @@ namespace ark {
         /** Current joint rotations */
         std::vector<Eigen::Matrix3d, Mat3Alloc> jointRot;
 
+        /** If true, update() does shape keys and skinning in float32 on the
+         *  structure-of-arrays data in AvatarModel (AVX2/AVX-512 if available).
+         *  Points then agree with the double precision path to about 1e-6 m. */
+        bool fastSkinning = true;
+
     private:
+        friend class AvatarBatch;
+
+        /** INTERNAL: Compute jointPos and jointRot from restJointPos, r and p */
+        void poseJoints();
 
         /** INTERNAL for caching use: baseCloud after applying shape keys (3 * num points) */
         Eigen::VectorXd shapedCloudVec;
 
-        /** INTERNAL for caching use: Position of points relative to each assigned point (3, num assignments total) */
+        /** INTERNAL for caching use: Position of points relative to each assigned joint,
+         *  before posing (3, num assignments total) */
+        CloudType restAssignVecs;
+
+        /** INTERNAL for caching use: Posed position of points for each assigned joint (3, num assignments total) */
         CloudType assignVecs;
+
+        /** INTERNAL for fastSkinning: shapedCloudVec as x, y, z planes (3 * numPointsPadded) */
+        Eigen::VectorXf shapedCloudSoA;
+
+        /** INTERNAL for fastSkinning: joint positions before posing (3, num joints) */
+        CloudType restJointPos;
+
+        /** INTERNAL for fastSkinning: Each joint's transform from rest to posed position,
+         *  columns are rotation entries in row-major order then translation (num joints, 12) */
+        Eigen::Matrix<float, Eigen::Dynamic, 12> jointTransforms;
+
+        /** INTERNAL for dirty tracking: w, r, p and whether fastSkinning was used at the last update() */
+        Eigen::VectorXd lastW;
+        std::vector<Eigen::Matrix3d, Mat3Alloc> lastR;
+        Eigen::Vector3d lastP;
+        bool lastFastSkinning = false;
+
+        /** INTERNAL for dirty tracking: false until update() is called, or after invalidate() */
+        bool updated = false;
+
+        /** INTERNAL for dirty tracking: whether each joint's transform changed in this update() */
+        std::vector<char> jointDirty;
+    };
+
+    /** A batch of avatars of one model that are updated together, for throughput
+     *  workloads such as synthetic data generation. Set each avatar's w, r and p as
+     *  usual, then call update(): points are skinned for several avatars at once,
+     *  one avatar per SIMD lane, so shape keys and joint transforms are read once
+     *  per batch instead of once per avatar. Results agree with Avatar::update()
+     *  to about 1e-6 m and do not depend on the batch size or the avatar's index. */
+    class AvatarBatch {
+    public:
+        /** Create a batch of batch_size avatars of the given model */
+        AvatarBatch(const AvatarModel& model, int batch_size);
+
+        /** Update joints and skin points of every avatar in the batch.
+         *  Always recomputes everything; the avatars' own update() starts over afterwards. */
+        void update();
+
+        /** Get number of avatars in the batch */
+        inline int size() const { return static_cast<int>(avatars.size()); }
+
+        /** Number of avatars skinned together */
+        static const int SKIN_LANES = 16;
+
+        /** The avatar model */
+        const AvatarModel& model;
+
+        /** The avatars in the batch */
+        std::vector<Avatar> avatars;
+
+    private:
+        /** Batch size rounded up to a multiple of SKIN_LANES */
+        int numLanes;
+
+        /** Joint regressor applied to base cloud (3 * num joints) and to shape keys (3 * num joints, num keys) */
+        Eigen::VectorXd jointRegBase;
+        Eigen::MatrixXd jointRegKeys;
+
+        /** Shape key weights (num keys, numLanes) and joint transforms
+         *  (num joints, 12, numLanes) as in Avatar::jointTransforms, lane-minor */
+        Eigen::VectorXf weights, transforms;
     };
 
     /** A sequence of avatar poses */
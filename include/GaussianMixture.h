@@ -10,6 +10,10 @@ namespace ark {
         /** load Gaussian Mixture parameters from 'path' */
         void load(const std::string & path);
 
+        /** compute leading constants and Cholesky decompositions from nComps, nDims,
+         *  weight, mean and cov; call after setting those directly (load calls this) */
+        void init();
+
         /** get number of Gaussian mixture components */
         int numComponents() const;
 
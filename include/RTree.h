@@ -41,16 +41,105 @@ namespace ark {
             EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
         };
 
+        /** Compact internal node used for inference (see compact()).
+         *  32 bytes, so two nodes fit exactly in a cache line */
+        struct CNode {
+            // Feature data
+            float u[2], v[2];
+            float thresh;
+
+            // Children: index of child CNode if internal,
+            // ~leafid (negative) if leaf
+            int32_t child[2];
+
+            // Early exit data of subtree (see earlyExit), set by compact():
+            // bits 0-23: 1 + id of a leaf in the subtree whose best match is the
+            // subtree's most likely part, or 0 if no early exit is possible;
+            // bits 24-31: minimum probability of that part over the subtree's
+            // leaves in 1/254 steps (rounded down), or 255 if it is the best
+            // match of all of them
+            uint32_t earlyExit;
+        };
+
+        /** Leaf probability distributions, stored contiguously as a
+         *  numLeaves x numParts row-major table. Rows are Eigen maps
+         *  into the table, so they can be used like a Distribution
+         *  without copying */
+        class LeafTable {
+        public:
+            typedef Eigen::Map<Distribution> Row;
+            typedef Eigen::Map<const Distribution> ConstRow;
+
+            /** Clear table and set number of parts (row length) */
+            void reset(int num_parts, size_t num_leaves = 0) {
+                parts = num_parts;
+                table.assign(num_leaves * num_parts, 0.f);
+            }
+
+            /** Resize to num_leaves rows; new rows are zero */
+            void resize(size_t num_leaves) { table.resize(num_leaves * parts, 0.f); }
+
+            /** Append a zero row and return it */
+            Row emplace_back() {
+                table.resize(table.size() + parts, 0.f);
+                return back();
+            }
+
+            void clear() { table.clear(); }
+            size_t size() const { return parts ? table.size() / parts : 0; }
+            bool empty() const { return table.empty(); }
+            int numParts() const { return parts; }
+
+            Row operator[](size_t i) { return Row(table.data() + i * parts, parts); }
+            ConstRow operator[](size_t i) const { return ConstRow(table.data() + i * parts, parts); }
+            Row back() { return (*this)[size() - 1]; }
+
+            float* data() { return table.data(); }
+            const float* data() const { return table.data(); }
+
+        private:
+            int parts = 0;
+            std::vector<float> table;
+        };
+
         /** Create empty RTree with number of different parts */
         explicit RTree(int num_parts);
 
         /** Load data from path */
         explicit RTree(const std::string & path);
 
-        /** Serialization */
+        /** Serialization. loadFile detects the format automatically;
+         *  flat files (see exportFlatFile) are memory mapped (read in one
+         *  piece on Windows) rather than parsed, and nodes and leafData are
+         *  left empty, so that the tree can only be used for inference */
         bool loadFile(const std::string & path);
         bool exportFile(const std::string & path);
 
+        /** Export in compact quantized format (loadFile detects it automatically):
+         *  probe offsets as int16 fixed point, thresholds as int16 millimeters,
+         *  leaf distributions as uint8 (1/255 steps) with leafBestMatch
+         *  stored inline. Lossy, but exporting a loaded quantized
+         *  model again gives an identical file */
+        bool exportQuantizedFile(const std::string & path);
+
+        /** Export in flat format: a copy of the compact inference layout
+         *  (nodes, dense leaf distributions and best matches), which loadFile
+         *  memory maps and uses directly. Loading is near instant, and
+         *  processes loading the same file share its pages */
+        bool exportFlatFile(const std::string & path);
+
+        /** Export the tree as C++ source with the traversal as straight-line
+         *  code and node parameters as constants (see rtree-codegen).
+         *  Compile it into a shared object and load with loadCompiled */
+        bool exportCompiledSource(const std::string & path);
+
+        /** Load a shared object compiled from exportCompiledSource's output
+         *  and use it for traversal in prediction. Fails if it was generated
+         *  from a different model. compact() and releaseCompact() unload it.
+         *  Takes precedence over SIMD traversal; use rtree-bench to check
+         *  that it is faster on the target machine. Not supported on Windows */
+        bool loadCompiled(const std::string & path);
+
         /** Predict distribution for a sample.
          *  Do not call unless model has been trained or loaded */
         Distribution predict(const cv::Mat& depth, const Vec2i& pix);
@@ -59,9 +148,33 @@ namespace ark {
          *  Do not call unless model has been trained or loaded */
         uint8_t predictBest(const cv::Mat& depth, const Vec2i& pix);
 
-        /** Predict distribution for all of image. Returns vector of CV_32F Mat 
+        /** Predict distribution for each pixel in ROI with x, y = 0 mod interval
+         *  (relative to top_left), see predictBest for arguments.
+         *  Writes an ROI-cropped CV_32FC(numParts) Mat to output, where element
+         *  (i, j) is the distribution of pixel top_left + interval * (j, i),
+         *  or all zeros if the pixel has no depth. output is only reallocated
+         *  if its size or type changes, so reusing it across frames is allocation free.
          *  Do not call unless model has been trained or loaded */
-        std::vector<cv::Mat> predict(const cv::Mat& depth);
+        void predict(const cv::Mat& depth, cv::Mat& output, int num_threads = 1,
+                int interval = 1,
+                cv::Point top_left = cv::Point(0,0),
+                cv::Point bot_right = cv::Point(-1, -1)) const;
+
+        /** Predict distribution for each pixel in ROI, returns the output of
+         *  predict(depth, output, ...) (by default, for all of image) */
+        cv::Mat predict(const cv::Mat& depth, int num_threads = 1,
+                int interval = 1,
+                cv::Point top_left = cv::Point(0,0),
+                cv::Point bot_right = cv::Point(-1, -1)) const;
+
+        /** Sparse version of predict: writes an ROI-cropped CV_32S Mat of leaf ids
+         *  laid out as in predict, with -1 for pixels with no depth.
+         *  The distribution of each pixel is leafDistribution(leaf id), which
+         *  avoids copying numParts floats per pixel */
+        void predictLeaves(const cv::Mat& depth, cv::Mat& output, int num_threads = 1,
+                int interval = 1,
+                cv::Point top_left = cv::Point(0,0),
+                cv::Point bot_right = cv::Point(-1, -1)) const;
 
         /** Predict best match for each pixel in image. Returns CV_8U Mat 
          *  Do not call unless model has been trained or loaded.
@@ -72,19 +185,30 @@ namespace ark {
          *  @param bot_right bottom left of ROI to compute (by default, uses entire image)
          *  @param fill_in_gaps if interval is > 1, setting this to false leaves
          *  pixels not at the interval black. Otherwise fills with the computed pixel
-         *  to the top left.  */
+         *  to the top left.
+         *  @param adaptive if interval is > 1, refine coarse-to-fine instead:
+         *  interval x interval cells whose corner labels agree are filled with
+         *  that label, other cells (usually part boundaries) are computed at
+         *  every pixel. Covers all of ROI; fill_in_gaps is ignored */
         cv::Mat predictBest(const cv::Mat& depth, int num_threads,
                 int interval = 1,
                 cv::Point top_left = cv::Point(0,0),
                 cv::Point bot_right = cv::Point(-1, -1),
-                bool fill_in_gaps = true);
+                bool fill_in_gaps = true,
+                bool adaptive = false);
 
         /** Train from images and part-masks in OpenARK DataSet format,
          *  with num_images random images and num_points_per_image random pixels
          *  from each image.
-         *  WARNING: Do not call train ON ANY RTree while training is on-going in the
-         *  same process, that is, one RTree can be trained at a time in the same process.
-         *  TODO: Maybe fix this limitation */
+         *  If image_store_path is given, the chosen images are compressed once
+         *  into an on-disk store in that directory and read from there instead
+         *  of the dataset. The store is reused if it was built from the same
+         *  dataset, otherwise rebuilt.
+         *  If telemetry_path is given, a JSON object per node split and tree
+         *  level (sample counts, time per phase, image cache hits/misses,
+         *  peak RSS) is appended to that file as a line.
+         *  Do not call train again while training is on-going
+         *  on the same RTree. */
         void train(const std::string& depth_dir,
                    const std::string& part_mask_dir,
                    int num_threads = std::thread::hardware_concurrency(),
@@ -101,14 +225,21 @@ namespace ark {
                    int threshes_per_feature = 15,
                    int max_images_loaded = 50,
                    int mem_limit_mb = 12000,
-                   const std::string& train_partial_save_path = ""
+                   const std::string& train_partial_save_path = "",
+                   const std::string& image_store_path = "",
+                   const std::string& telemetry_path = ""
                    );
 
         /** Train directly from avatar by rendering simulated images,
          * with num_images random images and
          *  num_points_per_image random pixels from each image.
+         *  If probe_ring_size is at least 2, candidate features at each
+         *  level are pairs of that many random probe offsets, whose depths
+         *  are read once per sample (uses probe_ring_size floats per sample).
+         *  telemetry_path is as in train.
          *  Do not call train again while training is on-going
-         *  on the same RTree. */
+         *  on the same RTree. To train several trees at once,
+         *  use RForest::trainFromAvatar */
         void trainFromAvatar(AvatarModel& avatar_model,
                    AvatarPoseSequence& pose_seq,
                    CameraIntrin& intrin,
@@ -128,12 +259,52 @@ namespace ark {
                    const std::vector<int>& part_map = {}, // part map
                    int max_images_loaded = 50,
                    int mem_limit_mb = 12000,
-                   const std::string& train_partial_save_path = ""
+                   const std::string& train_partial_save_path = "",
+                   int probe_ring_size = 0,
+                   const std::string& telemetry_path = ""
+                   );
+
+        /** Train as the coordinator of distributed training from simulated
+         *  images: waits for num_workers workers (see runTrainingWorker)
+         *  at address, which is unix:<path> or [host]:<port>. The
+         *  num_images images are divided between the workers, which render
+         *  and keep them; the coordinator only chooses the splits from
+         *  score histograms reduced over the workers. Other arguments are
+         *  as in trainFromAvatar. Returns false if address cannot be
+         *  listened on */
+        bool trainDistributed(const std::string& address,
+                   int num_workers,
+                   int num_threads = std::thread::hardware_concurrency(),
+                   bool verbose = false,
+                   int num_images = 30000,
+                   int num_points_per_image = 5000,
+                   int num_features = 2000,
+                   int max_probe_offset = 225,
+                   int min_samples = 100,      // term crit
+                   int max_tree_depth = 20,    // term crit
+                   int min_samples_per_feature = 20,
+                   const std::vector<int>& part_map = {}
+                   );
+
+        /** Run a distributed training worker for the coordinator at
+         *  address (see trainDistributed), rendering its share of the
+         *  images from the avatar. Returns true once training finishes,
+         *  false if the coordinator cannot be reached */
+        static bool runTrainingWorker(const std::string& address,
+                   AvatarModel& avatar_model,
+                   AvatarPoseSequence& pose_seq,
+                   CameraIntrin& intrin,
+                   cv::Size& image_size,
+                   const std::vector<int>& part_map = {},
+                   int num_threads = std::thread::hardware_concurrency(),
+                   bool verbose = false
                    );
 
         /** Re-evaluate leaf distributions on a pre-trained trees
-         *  by sampling from simulated images */
-        void trainTransfer(AvatarModel& avatar_model,
+         *  by sampling from simulated images. Images are processed in
+         *  parallel, each thread counting into its own table of leaf counts.
+         *  Returns false if the tree has no leaf table (memory mapped) */
+        bool trainTransfer(AvatarModel& avatar_model,
                    AvatarPoseSequence& pose_seq,
                    CameraIntrin& intrin,
                    cv::Size& image_size,
@@ -142,6 +313,17 @@ namespace ark {
                    int num_images = 10000
                    );
 
+        /** Re-evaluate leaf distributions on a pre-trained tree from real
+         *  labelled recordings in OpenARK DataSet format (as for train; part
+         *  mask labels must be the tree's parts), streaming the first
+         *  num_images images (all if -1) from disk */
+        bool trainTransfer(const std::string& depth_dir,
+                   const std::string& part_mask_dir,
+                   int num_threads = std::thread::hardware_concurrency(),
+                   bool verbose = false,
+                   int num_images = -1
+                   );
+
         /** Utility function for post-processing an output body part labels image
          * obtained from predictBest (or manually computed from predict), in order
          * to get higher confidence results.
@@ -163,22 +345,161 @@ namespace ark {
                 cv::Point bot_right = cv::Point(-1, -1),
                 double dist_to_pre_weight = 0.001) const;
 
+        /** Distribution of leaf with given id (numParts floats), read
+         *  directly from the compact layout if available, otherwise
+         *  from leafData. Do not call unless model has been trained or loaded */
+        const float* leafDistribution(int leafid) const;
+
         /** Utility for reading a partmap file from an input stream */
         static bool readPartMap(std::istream& is, std::vector<int>& result, int& num_new_parts, int& partmap_type);
 
+        /** Build the compact inference layout (compactNodes) from nodes:
+         *  internal nodes only, reordered breadth-first so that the top levels
+         *  of the tree share a few cache lines, with leaf ids stored directly
+         *  in the child indices. Leaf data is copied to a dense table.
+         *  Called automatically after loading or training; call again
+         *  after modifying nodes manually. Does nothing if nodes is empty */
+        void compact();
+
+        /** Release the compact inference layout; inference falls back
+         *  to traversing nodes directly (slower). Do not call on a memory
+         *  mapped tree */
+        void releaseCompact();
+
         std::vector<RNode, Eigen::aligned_allocator<RNode> > nodes;
-        std::vector<Distribution> leafData;
+        LeafTable leafData;
         std::vector<uint8_t> leafBestMatch;
 
+        /** Compact breadth-first inference layout, cache line aligned.
+         *  Root is at index 0. nullptr if not built */
+        const CNode* compactNodes = nullptr;
+        /** Leaf distributions of compact layout, numCompactLeaves x numParts
+         *  row-major */
+        const float* compactLeafData = nullptr;
+        /** Best match for each leaf of compact layout */
+        const uint8_t* compactBestMatch = nullptr;
+        int numCompactNodes = 0, numCompactLeaves = 0;
+
+        /** Traverse several pixels at once with AVX2/AVX-512 gathers in
+         *  predictBest, if compiled with AVX2 support and compactNodes is
+         *  available. Otherwise pixels are traversed one at a time */
+        bool enableSIMD = true;
+
+        /** Stop traversal in predictBest at subtrees where all leaves have
+         *  the same best match, which gives the same result with fewer node
+         *  visits. Requires compactNodes; has no effect with compiledTraversal */
+        bool earlyExit = false;
+
+        /** If earlyExit is set, also stop at subtrees where every leaf gives
+         *  the subtree's most likely part at least this probability (approximate).
+         *  1 to only stop where the result is unchanged */
+        float earlyExitConfidence = 1.f;
+
+        /** Traversal function of a compiled tree: finds compact leaf ids of the
+         *  n pixels (r, cols[i]) of a depth image with rows depth_step floats
+         *  apart, treating probes outside of the ROI as background */
+        typedef void (*CompiledTraversal)(const float* depth, int depth_step, int r,
+                const int* cols, int n, int tl_x, int tl_y, int br_x, int br_y,
+                int* leaves);
+
+        /** Used for traversal instead of compactNodes if not nullptr
+         *  (see loadCompiled) */
+        CompiledTraversal compiledTraversal = nullptr;
+
         int numParts;
 
         std::vector<int> partMap;
         int partMapType = -1;
 
     private:
-        Distribution predictRecursive(int nodeid, const cv::Mat& depth, const Vec2i& pix);
-        uint8_t predictRecursiveBest(int nodeid, const cv::Mat& depth, const Vec2i& pix);
+        friend class RForest;
+
+        /** Leaf reached by a sample (using compact layout if available) */
+        int findLeaf(const cv::Mat& depth, const Vec2i& pix) const;
 
         void updateBestMatchTable();
+
+        // Owns memory of compact layout (heap buffer or file mapping)
+        std::shared_ptr<char> compactData;
+        // Owns shared object handle of compiledTraversal
+        std::shared_ptr<void> compiledLib;
+    };
+
+    /** Random forest: ensemble of RTrees with the same number of parts,
+     *  all evaluated in a single pass over the image */
+    class RForest {
+    public:
+        /** Create empty forest */
+        RForest();
+
+        /** Create empty forest to be trained, with num_parts parts */
+        explicit RForest(int num_parts);
+
+        /** Load trees from each path */
+        explicit RForest(const std::vector<std::string>& paths);
+
+        /** Load a tree from path and add it to the forest.
+         *  Fails if the tree has a different number of parts from trees
+         *  already in the forest. If path is a forest file
+         *  (see exportFile), loads all trees listed in it */
+        bool loadFile(const std::string& path);
+
+        /** Write forest file to path: a short text file listing the trees,
+         *  which are written next to it as path.tree0, path.tree1, ... */
+        bool exportFile(const std::string& path);
+
+        /** Train num_trees trees at once from simulated avatar images
+         *  (replacing any trees in the forest). The num_images images are
+         *  rendered once and shared; each tree is trained on its own
+         *  bootstrap sample of them (drawn with replacement), using
+         *  num_threads / num_trees threads. If train_partial_save_path is
+         *  given, tree t saves/resumes from train_partial_save_path.tree<t>.
+         *  Other arguments are as in RTree::trainFromAvatar */
+        void trainFromAvatar(AvatarModel& avatar_model,
+                   AvatarPoseSequence& pose_seq,
+                   CameraIntrin& intrin,
+                   cv::Size& image_size,
+                   int num_trees,
+                   int num_threads = std::thread::hardware_concurrency(),
+                   bool verbose = false,
+                   int num_images = 30000,
+                   int num_points_per_image = 5000,
+                   int num_features = 2000,
+                   int max_probe_offset = 225,
+                   int min_samples = 100,      // term crit
+                   int max_tree_depth = 20,    // term crit
+                   int min_samples_per_feature = 20,
+                   const std::vector<int>& part_map = {},
+                   const std::string& train_partial_save_path = "",
+                   int probe_ring_size = 0,
+                   const std::string& telemetry_path = ""
+                   );
+
+        /** Predict best match for each pixel in image, averaging the leaf
+         *  distributions of all trees. Returns CV_8U Mat.
+         *  Do not call unless at least one tree has been loaded.
+         *  Arguments are the same as for RTree::predictBest */
+        cv::Mat predictBest(const cv::Mat& depth, int num_threads,
+                int interval = 1,
+                cv::Point top_left = cv::Point(0,0),
+                cv::Point bot_right = cv::Point(-1, -1),
+                bool fill_in_gaps = true,
+                bool adaptive = false) const;
+
+        /** Post-process output of predictBest, see RTree::postProcess
+         *  (uses the part map of the first tree) */
+        void postProcess(cv::Mat& image,
+                Eigen::Matrix<double, 2, Eigen::Dynamic>& com_pre,
+                int interval = 1, int num_threads = 1,
+                cv::Point top_left = cv::Point(0,0),
+                cv::Point bot_right = cv::Point(-1, -1),
+                double dist_to_pre_weight = 0.001) const;
+
+        std::vector<RTree> trees;
+
+        int numParts;
+
+        std::vector<int> partMap;
+        int partMapType = -1;
     };
 }
@@ -0,0 +1,188 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <Eigen/Core>
+#include "RTree.h"
+
+namespace {
+/** A named inference configuration to benchmark.
+ *  setup is applied to a fresh copy of the loaded tree */
+struct BenchConfig {
+    std::string name;
+    std::function<void(ark::RTree&)> setup;
+    // Skipped for trees without nodes (memory mapped)
+    bool requiresNodes;
+};
+
+int countMismatches(const cv::Mat& a, const cv::Mat& b) {
+    int cnt = 0;
+    for (int r = 0; r < a.rows; ++r) {
+        const auto* aPtr = a.ptr<uint8_t>(r);
+        const auto* bPtr = b.ptr<uint8_t>(r);
+        for (int c = 0; c < a.cols; ++c) {
+            if (aPtr[c] != bPtr[c]) ++cnt;
+        }
+    }
+    return cnt;
+}
+}
+
+int main(int argc, char** argv) {
+    std::string model_path, dataset_path, compiled_path;
+    int num_threads, interval, num_frames, num_repeats;
+    float exit_confidence;
+
+    namespace po = boost::program_options;
+    po::options_description desc("Option arguments");
+    po::options_description descPositional("OpenARK Random Tree inference benchmark: times predictBest over a recorded depth sequence\nPositional arguments");
+    po::options_description descCombined("");
+
+    desc.add_options()
+        ("help", "Produce help message")
+        ("threads,j", po::value<int>(&num_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads")
+        ("interval,i", po::value<int>(&interval)->default_value(2), "Sampling interval passed to predictBest")
+        ("adaptive,a", "Use coarse-to-fine sampling in predictBest (refine cells whose corner labels disagree)")
+        ("frames,n", po::value<int>(&num_frames)->default_value(100), "Maximum number of frames to load")
+        ("repeats,r", po::value<int>(&num_repeats)->default_value(3), "Number of passes over the frames per configuration (best pass is reported)")
+        ("exit-confidence,e", po::value<float>(&exit_confidence)->default_value(1.f), "earlyExitConfidence for the early exit configuration (1: exact)")
+        ("compiled,c", po::value<std::string>(&compiled_path)->default_value(""), "Also benchmark this compiled tree (shared object built from rtree-codegen output for the same model)")
+    ;
+
+    descPositional.add_options()
+        ("model", po::value<std::string>(&model_path)->required(), "Model path (from rtree-train)")
+        ("dataset", po::value<std::string>(&dataset_path)->required(), "Dataset root path (should have depth_exr subdir)")
+        ;
+
+    descCombined.add(descPositional);
+    descCombined.add(desc);
+    po::variables_map vm;
+
+    po::positional_options_description posopt;
+    posopt.add("model", 1);
+    posopt.add("dataset", 1);
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(descCombined)
+                .positional(posopt).run(),
+                vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if ( vm.count("help")  )
+    {
+        std::cout << descPositional << "\n" << desc << "\n";
+        return 0;
+    }
+
+    try {
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    using boost::filesystem::path;
+    using boost::filesystem::directory_iterator;
+
+    bool adaptive = vm.count("adaptive") > 0;
+
+    ark::RTree rtree(0);
+    if (!rtree.loadFile(model_path)) {
+        std::cerr << "Error: failed to load model " << model_path << "\n";
+        return 1;
+    }
+
+    // Load frames up front so that disk IO is not timed
+    path depth_dir = path(dataset_path) / "depth_exr";
+    if (!boost::filesystem::is_directory(depth_dir)) {
+        std::cerr << "Error: " << depth_dir.string() << " is not a directory\n";
+        return 1;
+    }
+    std::vector<std::string> frame_paths;
+    for (directory_iterator it(depth_dir); it != directory_iterator(); ++it) {
+        if (it->path().extension() == ".exr") frame_paths.push_back(it->path().string());
+    }
+    std::sort(frame_paths.begin(), frame_paths.end());
+    if (static_cast<int>(frame_paths.size()) > num_frames) frame_paths.resize(num_frames);
+
+    std::vector<cv::Mat> frames;
+    for (const auto& frame_path : frame_paths) {
+        cv::Mat image = cv::imread(frame_path, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH);
+        if (image.empty() || image.type() != CV_32F) {
+            std::cerr << "Warning: skipping unreadable frame " << frame_path << "\n";
+            continue;
+        }
+        frames.push_back(image);
+    }
+    if (frames.empty()) {
+        std::cerr << "Error: no depth frames found in " << depth_dir.string() << "\n";
+        return 1;
+    }
+    std::cout << "Model: " << model_path << " (" << rtree.numCompactNodes << " internal nodes, "
+        << rtree.numCompactLeaves << " leaves" << (rtree.nodes.empty() ? ", memory mapped" : "") << ")\n";
+    std::cout << "Frames: " << frames.size() << ", threads: " << num_threads
+        << ", interval: " << interval << (adaptive ? " (adaptive)" : "") << "\n\n";
+
+    // First configuration is the baseline
+    std::vector<BenchConfig> configs = {
+        { "nodes", [](ark::RTree& tree) { tree.releaseCompact(); }, true },
+        { "compact", [](ark::RTree& tree) { tree.compact(); tree.enableSIMD = false; }, false },
+        { "simd", [](ark::RTree& tree) { tree.compact(); tree.enableSIMD = true; }, false },
+        { "early-exit", [&](ark::RTree& tree) { tree.compact(); tree.earlyExit = true;
+                tree.earlyExitConfidence = exit_confidence; }, false },
+    };
+    if (!compiled_path.empty()) {
+        ark::RTree test = rtree;
+        if (!test.loadCompiled(compiled_path)) return 1;
+        configs.push_back({ "compiled", [&](ark::RTree& tree) {
+                    tree.compact(); tree.loadCompiled(compiled_path); }, false });
+    }
+
+    std::vector<cv::Mat> baseline;
+    double baseline_ms = 0.0;
+    for (size_t i = 0; i < configs.size(); ++i) {
+        if (configs[i].requiresNodes && rtree.nodes.empty()) continue;
+        ark::RTree tree = rtree;
+        configs[i].setup(tree);
+
+        std::vector<cv::Mat> results(frames.size());
+        double best_ms = std::numeric_limits<double>::max();
+        for (int rep = 0; rep < num_repeats; ++rep) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t j = 0; j < frames.size(); ++j) {
+                results[j] = tree.predictBest(frames[j], num_threads, interval,
+                        cv::Point(0, 0), cv::Point(-1, -1), true, adaptive);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            double ms = std::chrono::duration<double, std::milli>(end - start).count();
+            best_ms = std::min(best_ms, ms / frames.size());
+        }
+
+        int64_t mismatches = 0;
+        if (baseline.empty()) {
+            baseline = results;
+            baseline_ms = best_ms;
+        } else {
+            for (size_t j = 0; j < frames.size(); ++j) {
+                mismatches += countMismatches(baseline[j], results[j]);
+            }
+        }
+        std::cout << std::left << std::setw(12) << configs[i].name << std::right
+            << std::fixed << std::setprecision(3) << std::setw(10) << best_ms << " ms/frame"
+            << std::setprecision(2) << std::setw(8) << baseline_ms / best_ms << "x"
+            << "  mismatched pixels: " << mismatches << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include "RTree.h"
+
+int main(int argc, char** argv) {
+    std::string model_path, output_path;
+
+    namespace po = boost::program_options;
+    po::options_description desc("Option arguments");
+    po::options_description descPositional("OpenARK Random Tree code generator: generates C++ source with the tree as straight-line code, to be compiled into a shared object and loaded with RTree::loadCompiled\nPositional arguments");
+    po::options_description descCombined("");
+
+    desc.add_options()
+        ("help", "Produce help message")
+        ("output,o", po::value<std::string>(&output_path)->default_value(""), "Output file; default is <model>.compiled.cpp")
+    ;
+
+    descPositional.add_options()
+        ("model", po::value<std::string>(&model_path)->required(), "Model path (any format)")
+        ;
+
+    descCombined.add(descPositional);
+    descCombined.add(desc);
+    po::variables_map vm;
+
+    po::positional_options_description posopt;
+    posopt.add("model", 1);
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(descCombined)
+                .positional(posopt).run(),
+                vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if ( vm.count("help")  )
+    {
+        std::cout << descPositional << "\n" << desc << "\n";
+        return 0;
+    }
+
+    try {
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    using boost::filesystem::path;
+    using boost::filesystem::exists;
+    if (output_path.empty()) {
+        output_path = (path(model_path).parent_path() / path(model_path).stem()).string() + ".compiled.cpp";
+    }
+
+    ark::RTree rtree(0);
+    if (!rtree.loadFile(model_path)) {
+        std::cerr << "Error: failed to load model " << model_path << "\n";
+        return 1;
+    }
+    if (!rtree.exportCompiledSource(output_path)) {
+        std::cerr << "Error: failed to write " << output_path << "\n";
+        return 1;
+    }
+    std::cout << "Wrote " << output_path << " (" << rtree.numCompactNodes << " internal nodes, "
+        << rtree.numCompactLeaves << " leaves)\n";
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include "RTree.h"
+
+int main(int argc, char** argv) {
+    std::string model_path, output_path;
+
+    namespace po = boost::program_options;
+    po::options_description desc("Option arguments");
+    po::options_description descPositional("OpenARK Random Tree flattening tool: converts a model to the flat format, which is memory mapped on load\nPositional arguments");
+    po::options_description descCombined("");
+
+    desc.add_options()
+        ("help", "Produce help message")
+        ("output,o", po::value<std::string>(&output_path)->default_value(""), "Output file; default is <model>.flat.srtr")
+    ;
+
+    descPositional.add_options()
+        ("model", po::value<std::string>(&model_path)->required(), "Model path (any format)")
+        ;
+
+    descCombined.add(descPositional);
+    descCombined.add(desc);
+    po::variables_map vm;
+
+    po::positional_options_description posopt;
+    posopt.add("model", 1);
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(descCombined)
+                .positional(posopt).run(),
+                vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if ( vm.count("help")  )
+    {
+        std::cout << descPositional << "\n" << desc << "\n";
+        return 0;
+    }
+
+    try {
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    using boost::filesystem::path;
+    using boost::filesystem::exists;
+    if (output_path.empty()) {
+        output_path = (path(model_path).parent_path() / path(model_path).stem()).string() + ".flat.srtr";
+    }
+
+    ark::RTree rtree(0);
+    if (!rtree.loadFile(model_path)) {
+        std::cerr << "Error: failed to load model " << model_path << "\n";
+        return 1;
+    }
+    if (!rtree.exportFlatFile(output_path)) {
+        std::cerr << "Error: failed to write " << output_path << "\n";
+        return 1;
+    }
+    if (exists(model_path + ".partmap")) {
+        boost::filesystem::remove(output_path + ".partmap");
+        boost::filesystem::copy_file(model_path + ".partmap", output_path + ".partmap");
+    }
+    std::cout << "Wrote " << output_path << " (" << rtree.numCompactNodes << " internal nodes, "
+        << rtree.numCompactLeaves << " leaves, " << boost::filesystem::file_size(output_path) << " bytes)\n";
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <Eigen/Core>
+#include "RTree.h"
+
+namespace {
+bool filesEqual(const std::string& a, const std::string& b) {
+    std::ifstream ifsA(a, std::ios::binary), ifsB(b, std::ios::binary);
+    if (!ifsA || !ifsB) return false;
+    return std::equal(std::istreambuf_iterator<char>(ifsA), std::istreambuf_iterator<char>(),
+            std::istreambuf_iterator<char>(ifsB)) &&
+        ifsB.peek() == std::char_traits<char>::eof();
+}
+}
+
+int main(int argc, char** argv) {
+    std::string model_path, output_path, dataset_path;
+    int num_threads, num_frames;
+
+    namespace po = boost::program_options;
+    po::options_description desc("Option arguments");
+    po::options_description descPositional("OpenARK Random Tree quantization tool: converts a model to the compact quantized format and reports the accuracy delta\nPositional arguments");
+    po::options_description descCombined("");
+
+    desc.add_options()
+        ("help", "Produce help message")
+        ("output,o", po::value<std::string>(&output_path)->default_value(""), "Output file; default is <model>.q.srtr")
+        ("dataset,d", po::value<std::string>(&dataset_path)->default_value(""), "Dataset root path (should have depth_exr, part_mask subdirs) to compare accuracy on; skipped if not given")
+        ("frames,n", po::value<int>(&num_frames)->default_value(100), "Maximum number of dataset frames to evaluate")
+        ("threads,j", po::value<int>(&num_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads")
+    ;
+
+    descPositional.add_options()
+        ("model", po::value<std::string>(&model_path)->required(), "Model path (from rtree-train)")
+        ;
+
+    descCombined.add(descPositional);
+    descCombined.add(desc);
+    po::variables_map vm;
+
+    po::positional_options_description posopt;
+    posopt.add("model", 1);
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(descCombined)
+                .positional(posopt).run(),
+                vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if ( vm.count("help")  )
+    {
+        std::cout << descPositional << "\n" << desc << "\n";
+        return 0;
+    }
+
+    try {
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    using boost::filesystem::path;
+    using boost::filesystem::exists;
+    using boost::filesystem::file_size;
+    if (output_path.empty()) {
+        output_path = (path(model_path).parent_path() / path(model_path).stem()).string() + ".q.srtr";
+    }
+
+    ark::RTree rtree(0);
+    if (!rtree.loadFile(model_path)) {
+        std::cerr << "Error: failed to load model " << model_path << "\n";
+        return 1;
+    }
+    if (!rtree.exportQuantizedFile(output_path)) {
+        std::cerr << "Error: failed to write " << output_path << "\n";
+        return 1;
+    }
+    if (exists(model_path + ".partmap")) {
+        boost::filesystem::remove(output_path + ".partmap");
+        boost::filesystem::copy_file(model_path + ".partmap", output_path + ".partmap");
+    }
+
+    ark::RTree quantized(0);
+    if (!quantized.loadFile(output_path)) {
+        std::cerr << "Error: failed to reload quantized model " << output_path << "\n";
+        return 1;
+    }
+    // Quantizing an already quantized model should be lossless
+    std::string round_trip_path = output_path + ".tmp";
+    quantized.exportQuantizedFile(round_trip_path);
+    bool lossless = filesEqual(output_path, round_trip_path);
+    boost::filesystem::remove(round_trip_path);
+
+    std::cout << "Float model:     " << model_path << " (" << file_size(model_path) << " bytes)\n";
+    std::cout << "Quantized model: " << output_path << " (" << file_size(output_path) << " bytes)\n";
+    std::cout << "Round trip:      " << (lossless ? "lossless" : "NOT LOSSLESS") << "\n";
+
+    if (dataset_path.empty()) return lossless ? 0 : 1;
+
+    path depth_dir = path(dataset_path) / "depth_exr";
+    path part_mask_dir = path(dataset_path) / "part_mask";
+    if (!boost::filesystem::is_directory(depth_dir)) {
+        std::cerr << "Error: " << depth_dir.string() << " is not a directory\n";
+        return 1;
+    }
+    std::vector<path> frame_paths;
+    for (boost::filesystem::directory_iterator it(depth_dir);
+            it != boost::filesystem::directory_iterator(); ++it) {
+        if (it->path().extension() == ".exr") frame_paths.push_back(it->path());
+    }
+    std::sort(frame_paths.begin(), frame_paths.end());
+    if (static_cast<int>(frame_paths.size()) > num_frames) frame_paths.resize(num_frames);
+
+    int64_t total = 0, correct_float = 0, correct_quantized = 0, agree = 0;
+    int num_evaluated = 0;
+    for (const auto& frame_path : frame_paths) {
+        // depth_XXXXXXXX.exr -> part_mask_XXXXXXXX.{tiff,png}
+        std::string id = frame_path.stem().string().substr(std::string("depth_").size());
+        path mask_path = part_mask_dir / ("part_mask_" + id + ".tiff");
+        if (!exists(mask_path)) mask_path = part_mask_dir / ("part_mask_" + id + ".png");
+
+        cv::Mat depth = cv::imread(frame_path.string(), cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH);
+        cv::Mat mask = cv::imread(mask_path.string(), cv::IMREAD_GRAYSCALE);
+        if (depth.empty() || mask.empty() || depth.size() != mask.size()) {
+            std::cerr << "Warning: skipping frame " << id << " (missing or mismatched depth/part mask)\n";
+            continue;
+        }
+        cv::Mat result_float = rtree.predictBest(depth, num_threads);
+        cv::Mat result_quantized = quantized.predictBest(depth, num_threads);
+        for (int r = 0; r < depth.rows; ++r) {
+            const auto* depthPtr = depth.ptr<float>(r);
+            const auto* maskPtr = mask.ptr<uint8_t>(r);
+            const auto* floatPtr = result_float.ptr<uint8_t>(r);
+            const auto* quantizedPtr = result_quantized.ptr<uint8_t>(r);
+            for (int c = 0; c < depth.cols; ++c) {
+                if (depthPtr[c] == 0.f || maskPtr[c] == 255) continue;
+                int label = maskPtr[c];
+                if (!rtree.partMap.empty()) {
+                    if (label >= static_cast<int>(rtree.partMap.size())) continue;
+                    label = rtree.partMap[label];
+                }
+                ++total;
+                if (floatPtr[c] == label) ++correct_float;
+                if (quantizedPtr[c] == label) ++correct_quantized;
+                if (floatPtr[c] == quantizedPtr[c]) ++agree;
+            }
+        }
+        ++num_evaluated;
+    }
+    if (total == 0) {
+        std::cerr << "Error: no labelled pixels found in dataset\n";
+        return 1;
+    }
+
+    double acc_float = 100.0 * correct_float / total,
+           acc_quantized = 100.0 * correct_quantized / total;
+    std::cout << std::fixed << std::setprecision(4);
+    std::cout << "\nEvaluated " << num_evaluated << " frames, " << total << " labelled pixels\n";
+    std::cout << "Float accuracy:     " << acc_float << "%\n";
+    std::cout << "Quantized accuracy: " << acc_quantized << "%\n";
+    std::cout << "Accuracy delta:     " << acc_quantized - acc_float << "%\n";
+    std::cout << "Label agreement:    " << 100.0 * agree / total << "%\n";
+    return lossless ? 0 : 1;
+}
@@ -35,7 +35,7 @@ cv::Vec3b paletteColor(int color_index, bool bgr)
 
 int main(int argc, char** argv) {
 
-    std::vector<std::string> model_paths;
+    std::vector<std::string> model_paths, compiled_paths;
     std::string dataset_path;
     int image_index;
 
@@ -46,6 +46,8 @@ int main(int argc, char** argv) {
 
     desc.add_options()
         ("help", "Produce help message")
+        ("compiled,c", po::value<std::vector<std::string> >(&compiled_paths)->composing(), "Compiled tree (shared object built from rtree-codegen output) to use for inference, "
+                            "for each model in order (can be specified multiple times)")
     ;
 
     descPositional.add_options()
@@ -95,9 +97,17 @@ int main(int argc, char** argv) {
 
     using boost::filesystem::path;
     using boost::filesystem::exists;
-    std::vector<ark::RTree> rtrees;
-    for (auto& model_path: model_paths) {
-        rtrees.emplace_back(model_path);
+    ark::RForest forest(model_paths);
+    if (forest.trees.empty()) {
+        std::cerr << "Error: failed to load any model" << "\n";
+        return 1;
+    }
+    if (compiled_paths.size() > forest.trees.size()) {
+        std::cerr << "Error: more compiled trees than models" << "\n";
+        return 1;
+    }
+    for (size_t i = 0; i < compiled_paths.size(); ++i) {
+        if (!forest.trees[i].loadCompiled(compiled_paths[i])) return 1;
     }
     bool show_mask = false;
     while (true) {
@@ -125,47 +135,13 @@ int main(int argc, char** argv) {
 
             cv::Mat image = cv::imread(image_path, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH);
             cv::Mat visual = cv::Mat::zeros(image.size(), CV_8UC3);
-            if (rtrees.size() > 1) {
-                std::vector<cv::Mat> result;
-                for (auto& rtree : rtrees) {
-                    std::vector<cv::Mat> model_results = rtree.predict(image);
-                    if (result.empty()) result = model_results;
-                    else {
-                        for (size_t i = 0; i < result.size(); ++i) {
-                            result[i] += model_results[i];
-                        }
-                    }
-                }
-                // for (size_t i = 0; i < result.size(); ++i) {
-                //     result[i] /= model_paths.size();
-                // }
-
-                cv::Mat maxVals(image.size(), CV_32F);
-                maxVals.setTo(0);
-                for (size_t i = 0; i < result.size(); ++i) {
-                    for (int r = 0; r < image.rows; ++r) {
-                        auto* imPtr = image.ptr<float>(r);
-                        auto* inPtr = result[i].ptr<float>(r);
-                        auto* maxValPtr = maxVals.ptr<float>(r);
-                        auto* visualPtr = visual.ptr<cv::Vec3b>(r);
-                        for (int c = 0; c < image.cols; ++c){
-                            if (imPtr[c] == 0.0) continue;
-                            if (inPtr[c] > maxValPtr[c]) {
-                                maxValPtr[c] = inPtr[c];
-                                visualPtr[c] = paletteColor(i, true);
-                            }
-                        }
-                    }
-                }
-            } else {
-                cv::Mat result = rtrees[0].predictBest(image, std::thread::hardware_concurrency());
-                for (int r = 0; r < image.rows; ++r) {
-                    auto* inPtr = result.ptr<uint8_t>(r);
-                    auto* visualPtr = visual.ptr<cv::Vec3b>(r);
-                    for (int c = 0; c < image.cols; ++c){
-                        if (inPtr[c] == 255) continue;
-                        visualPtr[c] = paletteColor(inPtr[c], true);
-                    }
+            cv::Mat result = forest.predictBest(image, std::thread::hardware_concurrency());
+            for (int r = 0; r < image.rows; ++r) {
+                auto* inPtr = result.ptr<uint8_t>(r);
+                auto* visualPtr = visual.ptr<cv::Vec3b>(r);
+                for (int c = 0; c < image.cols; ++c){
+                    if (inPtr[c] == 255) continue;
+                    visualPtr[c] = paletteColor(inPtr[c], true);
                 }
             }
             cv::imshow(WIND_NAME, visual);
@@ -10,11 +10,12 @@ constexpr char WIND_NAME[] = "Image";
 }
 
 int main(int argc, char** argv) {
-    std::string partmap_path, data_path, output_path, intrin_path, resume_file;
+    std::string partmap_path, data_path, output_path, intrin_path, resume_file, store_path,
+        coordinator_address, worker_address, telemetry_path;
     bool verbose, preload;
-    int num_threads, num_images, num_points_per_image, num_features, num_features_filtered, max_probe_offset, min_samples, max_tree_depth,
+    int num_threads, num_trees, num_workers, num_images, num_points_per_image, num_features, num_features_filtered, max_probe_offset, min_samples, max_tree_depth,
         min_samples_per_feature, threshes_per_feature, cache_size,
-        mem_limit_mb;
+        mem_limit_mb, probe_ring_size;
     float frac_samples_per_feature;
     cv::Size size;
 
@@ -26,6 +27,8 @@ int main(int argc, char** argv) {
     desc.add_options()
         ("help", "Produce help message")
         ("output,o", po::value<std::string>(&output_path)->default_value("output.rtree"), "Output file")
+        ("trees,K", po::value<int>(&num_trees)->default_value(1), "Number of trees to train at once on bootstrap samples of the same images; "
+                            "if more than 1, output is a forest file listing the trees (written beside it as <output>.tree0, ...). Only supported with synthetic data input")
         ("threads,j", po::value<int>(&num_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads")
         ("verbose,v", po::bool_switch(&verbose), "Enable verbose output")
         ("preload", po::bool_switch(&preload), "Preload avatar pose sequence in memory to speed up random pose; only useful if using synthetic data input")
@@ -43,11 +46,25 @@ int main(int argc, char** argv) {
           "(Deprecated) Proportion of samples to use in each node training step to sparsely propose thresholds.")
         ("threshes_per_feature", po::value<int>(&threshes_per_feature)->default_value(15),
           "(Deprecated) Maximum number of candidates thresholds to optimize over for each feature (different from Kinect)")
+        ("probe_ring,R", po::value<int>(&probe_ring_size)->default_value(0), "Probe ring size: if at least 2, draw features at each tree level from pairs of this many random probe offsets, "
+                            "whose depths are read once per sample, so evaluating a feature is two table lookups instead of two random image reads. "
+                            "Uses 4 bytes per sample per offset; only supported with synthetic data input (0: off)")
         ("depth,d", po::value<int>(&max_tree_depth)->default_value(20), "Maximum tree depth; Kinect used 20")
         ("width", po::value<int>(&size.width)->default_value(1280), "Width of generated images; only useful if using synthetic data input")
         ("height", po::value<int>(&size.height)->default_value(720), "Height of generated imaes; only useful if using synthetic data input")
         ("cache_size,c", po::value<int>(&cache_size)->default_value(50), "Max number of images in cache during training")
-        ("resume,s", po::value<std::string>(&resume_file)->default_value(""), "Training save state file, used to save checkpoints. Training with same file later will resume from savepoint. (previously known as 'samples' file, now more general).")
+        ("resume,s", po::value<std::string>(&resume_file)->default_value(""), "Training save state file, used to save checkpoints. Training with same file later will resume from savepoint. (previously known as 'samples' file, now more general). "
+                            "With synthetic data, nodes completed since the last save are also logged to <file>.log, so a killed run resumes from the last completed node.")
+        ("coordinator", po::value<std::string>(&coordinator_address)->default_value(""), "Distributed training: coordinate workers (see --worker) at this address, "
+                            "unix:<socket path> or [host]:<port>. Images (-i) are divided between the workers, which render and keep them. Only supported with synthetic data input")
+        ("workers,W", po::value<int>(&num_workers)->default_value(1), "Distributed training: number of workers the coordinator waits for")
+        ("worker", po::value<std::string>(&worker_address)->default_value(""), "Distributed training: run as a worker for the coordinator at this address "
+                            "(training options are taken from the coordinator; no output is written)")
+        ("store", po::value<std::string>(&store_path)->default_value(""), "Image store directory: chosen images are compressed into on-disk shards there once "
+                            "and streamed from them during training instead of the dataset; reused if it was built from the same dataset, otherwise rebuilt. Only supported with dataset input")
+        ("telemetry", po::value<std::string>(&telemetry_path)->default_value(""), "Append training telemetry to this file as JSON lines: one object per node split "
+                            "(samples, features evaluated, scoring/threshold search time) and per tree level (time per phase, image cache hits/misses), with peak RSS. "
+                            "Not supported in distributed training")
         ("memory,M", po::value<int>(&mem_limit_mb)->default_value(12000), "Maximum training memory (for counting part; actual usage may be 2x) in MB.")
     ;
 
@@ -92,6 +109,42 @@ int main(int argc, char** argv) {
         std::cerr << "WARNING: min_samples (-m) cannot be less than 1, defaulting to 1...\n";
         min_samples = 1;
     }
+    if (num_trees < 1) {
+        std::cerr << "WARNING: number of trees (-K) cannot be less than 1, defaulting to 1...\n";
+        num_trees = 1;
+    }
+    if (num_trees > 1 && data_path != "://SMPLSYNTH") {
+        std::cerr << "ERROR: training multiple trees (-K) is only supported with synthetic data input, exiting\n";
+        return 1;
+    }
+    if ((!coordinator_address.empty() || !worker_address.empty()) && data_path != "://SMPLSYNTH") {
+        std::cerr << "ERROR: distributed training is only supported with synthetic data input, exiting\n";
+        return 1;
+    }
+    if (!coordinator_address.empty() && (!worker_address.empty() || num_trees > 1)) {
+        std::cerr << "ERROR: --coordinator cannot be combined with --worker or -K, exiting\n";
+        return 1;
+    }
+    if (num_workers < 1) {
+        std::cerr << "WARNING: number of workers (-W) cannot be less than 1, defaulting to 1...\n";
+        num_workers = 1;
+    }
+    if (!resume_file.empty() && (!coordinator_address.empty() || !worker_address.empty())) {
+        std::cerr << "WARNING: training save state (-s) is not supported in distributed training, ignoring...\n";
+    }
+    if (probe_ring_size == 1 || probe_ring_size < 0) {
+        std::cerr << "WARNING: probe ring size (-R) must be 0 or at least 2, defaulting to 0...\n";
+        probe_ring_size = 0;
+    }
+    if (probe_ring_size && (data_path != "://SMPLSYNTH" || !coordinator_address.empty())) {
+        std::cerr << "WARNING: probe ring (-R) is only used in non-distributed training with synthetic data input, ignoring...\n";
+    }
+    if (!telemetry_path.empty() && (!coordinator_address.empty() || !worker_address.empty())) {
+        std::cerr << "WARNING: telemetry (--telemetry) is not supported in distributed training, ignoring...\n";
+    }
+    if (!store_path.empty() && data_path == "://SMPLSYNTH") {
+        std::cerr << "WARNING: image store (--store) is only used with dataset input, ignoring...\n";
+    }
 
     std::vector<int> partMap;
     int numNewParts;
@@ -105,7 +158,12 @@ int main(int argc, char** argv) {
     }
 
     ark::RTree rtree(numNewParts);
-    if (data_path == "://SMPLSYNTH") {
+    if (!coordinator_address.empty()) {
+        if (!rtree.trainDistributed(coordinator_address, num_workers, num_threads, verbose, num_images, num_points_per_image,
+                    num_features, max_probe_offset, min_samples, max_tree_depth, min_samples_per_feature, partMap)) {
+            return 1;
+        }
+    } else if (data_path == "://SMPLSYNTH") {
         ark::AvatarModel model;
         ark::AvatarPoseSequence poseSequence;
         if (poseSequence.numFrames) {
@@ -128,13 +186,25 @@ int main(int argc, char** argv) {
             intrin.cx = 637.294;
             intrin.cy = 366.992;
         }
+        if (!worker_address.empty()) {
+            return ark::RTree::runTrainingWorker(worker_address, model, poseSequence, intrin, size,
+                    partMap, num_threads, verbose) ? 0 : 1;
+        }
+        if (num_trees > 1) {
+            ark::RForest forest(numNewParts);
+            forest.trainFromAvatar(model, poseSequence, intrin, size, num_trees, num_threads, verbose, num_images, num_points_per_image,
+                    num_features, max_probe_offset, min_samples, max_tree_depth, min_samples_per_feature, partMap, resume_file,
+                    probe_ring_size, telemetry_path);
+            forest.exportFile(output_path);
+            return 0;
+        }
         rtree.trainFromAvatar(model, poseSequence, intrin, size, num_threads, verbose, num_images, num_points_per_image,
                 num_features, num_features_filtered, max_probe_offset, min_samples, max_tree_depth, min_samples_per_feature, frac_samples_per_feature,
-                threshes_per_feature, partMap, cache_size, mem_limit_mb, resume_file);
+                threshes_per_feature, partMap, cache_size, mem_limit_mb, resume_file, probe_ring_size, telemetry_path);
     } else {
         rtree.train(data_path + "/depth_exr", data_path + "/part_mask", num_threads, verbose, num_images, num_points_per_image,
                 num_features, num_features_filtered, max_probe_offset, min_samples, max_tree_depth, min_samples_per_feature, frac_samples_per_feature, threshes_per_feature,
-                cache_size, mem_limit_mb, resume_file);
+                cache_size, mem_limit_mb, resume_file, store_path, telemetry_path);
     }
     rtree.exportFile(output_path);
 
@@ -9,7 +9,7 @@ constexpr char WIND_NAME[] = "Image";
 }
 
 int main(int argc, char** argv) {
-    std::string partmap_path, input_path, output_path, intrin_path, resume_file;
+    std::string partmap_path, input_path, output_path, intrin_path, resume_file, data_path;
     bool verbose, preload;
     int num_threads, num_images;
     float frac_samples_per_feature;
@@ -26,7 +26,10 @@ int main(int argc, char** argv) {
         ("threads,j", po::value<int>(&num_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads")
         ("verbose,v", po::bool_switch(&verbose), "Enable verbose output")
         ("preload", po::bool_switch(&preload), "Preload avatar pose sequence in memory to speed up random pose; only useful if using synthetic data input")
-        ("images,i", po::value<int>(&num_images)->default_value(100), "Number of random images to train on; Kinect used 1 million")
+        ("images,i", po::value<int>(&num_images)->default_value(100), "Number of random images to train on; Kinect used 1 million. "
+                            "With --data, number of recorded frames to use (default: all)")
+        ("data,d", po::value<std::string>(&data_path)->default_value(""), "Dataset root path of real labelled recordings (should have depth_exr, part_mask subdirs, "
+                            "with the tree's part labels) to re-estimate leaves from, instead of simulated images")
         ("intrin_path", po::value<std::string>(&intrin_path)->default_value(""), "Path to camera intrinsics file (default: uses hardcoded K4A intrinsics)")
         ("width", po::value<int>(&size.width)->default_value(1280), "Width of generated images; only useful if using synthetic data input")
         ("height", po::value<int>(&size.height)->default_value(720), "Height of generated imaes; only useful if using synthetic data input")
@@ -66,6 +69,24 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (output_path.empty()) {
+        output_path = input_path;
+        if (input_path.size() > 5 && !input_path.compare(input_path.size()-5, input_path.size(), ".srtr")) {
+            for (int i = 0; i < 5; ++i) output_path.pop_back();
+        }
+        output_path.append(".refine.srtr");
+    }
+    ark::RTree rtree(0);
+    rtree.loadFile(input_path);
+    if (!data_path.empty()) {
+        if (!rtree.trainTransfer(data_path + "/depth_exr", data_path + "/part_mask", num_threads, verbose,
+                    vm["images"].defaulted() ? -1 : num_images)) {
+            return 1;
+        }
+        rtree.exportFile(output_path);
+        return 0;
+    }
+
     ark::AvatarModel model;
     ark::AvatarPoseSequence poseSequence;
     if (poseSequence.numFrames) {
@@ -88,16 +109,9 @@ int main(int argc, char** argv) {
         intrin.cx = 637.294;
         intrin.cy = 366.992;
     }
-    if (output_path.empty()) {
-        output_path = input_path;
-        if (input_path.size() > 5 && !input_path.compare(input_path.size()-5, input_path.size(), ".srtr")) {
-            for (int i = 0; i < 5; ++i) output_path.pop_back();
-        }
-        output_path.append(".refine.srtr");
+    if (!rtree.trainTransfer(model, poseSequence, intrin, size, num_threads, verbose, num_images)) {
+        return 1;
     }
-    ark::RTree rtree(0);
-    rtree.loadFile(input_path);
-    rtree.trainTransfer(model, poseSequence, intrin, size, num_threads, verbose, num_images);
     rtree.exportFile(output_path);
 
     return 0;
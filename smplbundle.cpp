@@ -0,0 +1,90 @@
+#include <iostream>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <Eigen/Core>
+
+#include "Avatar.h"
+#include "Util.h"
+
+int main(int argc, char** argv) {
+    namespace po = boost::program_options;
+    std::string model_dir;
+
+    po::options_description desc("Option arguments");
+    po::options_description descPositional("OpenARK avatar model bundler: compiles the model files into model.bundle, which AvatarModel loads without parsing\nPositional arguments");
+    po::options_description descCombined("");
+    desc.add_options()
+        ("help", "Produce help message")
+    ;
+
+    descPositional.add_options()
+        ("model_dir", po::value<std::string>(&model_dir)->default_value(""), "Avatar model directory; default is data/avatar-model")
+        ;
+
+    descCombined.add(descPositional);
+    descCombined.add(desc);
+    po::variables_map vm;
+
+    po::positional_options_description posopt;
+    posopt.add("model_dir", 1);
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(descCombined)
+                .positional(posopt).run(),
+                vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if ( vm.count("help")  )
+    {
+        std::cout << descPositional << "\n" << desc << "\n";
+        return 0;
+    }
+
+    try {
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    using boost::filesystem::path;
+    std::string bundle_path = ((model_dir.empty() ? path(ark::util::resolveRootPath("data/avatar-model")) :
+                path(model_dir)) / "model.bundle").string();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    ark::AvatarModel model(model_dir, false, false);
+    double text_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - start).count();
+    if (!model.exportBundle(bundle_path)) {
+        std::cerr << "Error: failed to write " << bundle_path << "\n";
+        return 1;
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    ark::AvatarModel bundled(model_dir);
+    double bundle_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - start).count();
+
+    // The bundled model should pose identically
+    ark::Avatar ava(model), avaBundled(bundled);
+    ava.randomize(false, true, true, 0);
+    avaBundled.w = ava.w;
+    avaBundled.r = ava.r;
+    avaBundled.p = ava.p;
+    ava.update();
+    avaBundled.update();
+    bool identical = ava.cloud == avaBundled.cloud && ava.jointPos == avaBundled.jointPos;
+
+    std::cout << "Wrote " << bundle_path << " (" << model.numPoints() << " points, "
+        << model.numJoints() << " joints, " << model.numShapeKeys() << " shape keys, "
+        << boost::filesystem::file_size(bundle_path) << " bytes)\n";
+    std::cout << "Load time: " << text_ms << " ms from model files, " << bundle_ms << " ms from bundle\n";
+    std::cout << "Round trip: " << (identical ? "identical" : "NOT IDENTICAL") << "\n";
+    return identical ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <Eigen/Core>
+
+#include "Avatar.h"
+
+int main(int argc, char** argv) {
+    namespace po = boost::program_options;
+    std::string model_dir;
+    std::vector<int> ranks;
+    int num_samples;
+
+    po::options_description desc("Option arguments");
+    po::options_description descPositional("OpenARK avatar shape key compression report: vertex error of truncated PCA and float16 shape bases against the full basis\nPositional arguments");
+    po::options_description descCombined("");
+    desc.add_options()
+        ("help", "Produce help message")
+        ("rank,r", po::value<std::vector<int> >(&ranks)->multitoken()->composing(), "PCA rank to evaluate (can be specified multiple times); default is all keys, 3/4, 1/2 and 1/4 of them")
+        ("samples,n", po::value<int>(&num_samples)->default_value(100), "Number of random shapes to evaluate")
+    ;
+
+    descPositional.add_options()
+        ("model_dir", po::value<std::string>(&model_dir)->default_value(""), "Avatar model directory; default is data/avatar-model")
+        ;
+
+    descCombined.add(descPositional);
+    descCombined.add(desc);
+    po::variables_map vm;
+
+    po::positional_options_description posopt;
+    posopt.add("model_dir", 1);
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(descCombined)
+                .positional(posopt).run(),
+                vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if ( vm.count("help")  )
+    {
+        std::cout << descPositional << "\n" << desc << "\n";
+        return 0;
+    }
+
+    try {
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << descPositional << "\n" << desc << "\n";
+        return 1;
+    }
+
+    const ark::AvatarModel model(model_dir);
+    const int nKeys = model.numShapeKeys();
+    if (nKeys == 0) {
+        std::cerr << "Error: avatar model has no shape keys\n";
+        return 1;
+    }
+    if (ranks.empty()) {
+        for (int rank : { nKeys, nKeys * 3 / 4, nKeys / 2, nKeys / 4 }) {
+            if (rank > 0 && std::find(ranks.begin(), ranks.end(), rank) == ranks.end()) ranks.push_back(rank);
+        }
+    }
+
+    // Reference: full basis in double precision
+    std::vector<Eigen::VectorXd> shapes;
+    std::vector<ark::CloudType> reference;
+    ark::Avatar ava(model);
+    ava.fastSkinning = false;
+    for (int i = 0; i < num_samples; ++i) {
+        ava.randomize(false, true, false, i);
+        ava.update();
+        shapes.push_back(ava.w);
+        reference.push_back(ava.cloud);
+    }
+
+    std::cout << "Model: " << model.numPoints() << " points, " << nKeys << " shape keys, "
+        << num_samples << " random shapes\n\n";
+    std::cout << std::setw(6) << "rank" << std::setw(10) << "storage" << std::setw(12) << "basis KB"
+        << std::setw(14) << "update ms" << std::setw(16) << "mean err mm" << std::setw(15) << "max err mm" << "\n";
+    for (int rank : ranks) {
+        for (bool half : { false, true }) {
+            ark::AvatarModel compressed = model;
+            compressed.compressShapeKeys(rank, half);
+            ark::Avatar cava(compressed);
+            double total_err = 0.0, max_err = 0.0, total_ms = 0.0;
+            for (int i = 0; i < num_samples; ++i) {
+                cava.w = shapes[i];
+                auto start = std::chrono::high_resolution_clock::now();
+                cava.update();
+                total_ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::high_resolution_clock::now() - start).count();
+                Eigen::VectorXd err = (cava.cloud - reference[i]).colwise().norm();
+                total_err += err.sum();
+                max_err = std::max(max_err, err.maxCoeff());
+            }
+            size_t basis_bytes = compressed.keyCloudsSoA.size() * sizeof(float) +
+                compressed.keyCloudsHalf.size() * sizeof(uint16_t);
+            std::cout << std::setw(6) << std::min(rank, nKeys) << std::setw(10) << (half ? "float16" : "float32")
+                << std::fixed << std::setprecision(1) << std::setw(12) << basis_bytes / 1024.0
+                << std::setprecision(4) << std::setw(14) << total_ms / num_samples
+                << std::setw(16) << 1000.0 * total_err / (num_samples * model.numPoints())
+                << std::setw(15) << 1000.0 * max_err << "\n";
+        }
+    }
+    return 0;
+}
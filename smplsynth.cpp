@@ -87,7 +87,9 @@ void run(int num_threads, int num_to_gen, std::string out_path,
     }
 
     auto worker = [&]() {
-        Avatar ava(model);
+        // Images are posed in batches, which are skinned together
+        AvatarBatch batch(model, AvatarBatch::SKIN_LANES);
+        std::vector<int> ids;
         if (!model.hasPosePrior()) {
             std::cerr << "ERROR: Pose prior required! Please get a version of avatar data with pose_prior.txt\n";
             return;
@@ -98,72 +100,81 @@ void run(int num_threads, int num_to_gen, std::string out_path,
         }
 
         while(true) {
+            ids.clear();
             int i;
-            if (!que.pop(i)) break;
-            std::stringstream ss_img_id;
-            ss_img_id << std::setw(8) << std::setfill('0') << std::to_string(i);
-
-            if (poseSequence.numFrames) {
-                // random_util::randint<size_t>(0, poseSequence.numFrames - 1)
-                poseSequence.poseAvatar(ava, seq[i % poseSequence.numFrames]);
-                ava.r[0].setIdentity();
-                ava.randomize(false, true, true);
-            } else {
-                ava.randomize();
-            }
-            ava.update();
-            
-            ark::AvatarRenderer renderer(ava, intrin);
-
-            const std::string depthImgPath = (depthPath / ("depth_" + ss_img_id.str() + ".exr")).string();
-            cv::imwrite(depthImgPath, renderer.renderDepth(image_size));
-            std::cout << "Wrote " << depthImgPath << std::endl;
-
-            const std::string partMaskImgPath = (partMaskPath / ("part_mask_" + ss_img_id.str() + ".tiff")).string();
-            cv::imwrite(partMaskImgPath, renderer.renderPartMask(image_size, part_map));
-            //std::cout << "Wrote " << partMaskImgPath << std::endl;
-
-            // Output labels
-            const std::vector<cv::Point2f>& joints = renderer.getProjectedJoints();
-            std::vector<cv::Point2i> jointsi;
-            for (auto& pt : joints) jointsi.emplace_back(std::round(pt.x), std::round(pt.y));
-            const std::string jointFilePath = (jointsPath / ("joint_" + ss_img_id.str() + ".yml")).string();
-            cv::FileStorage fs3(jointFilePath, cv::FileStorage::WRITE);
-            fs3 << "joints" << jointsi;
-
-            // Also write xyz positions
-            std::vector<cv::Point3f> jointsXYZ;
-            for (auto i = 0; i < model.numJoints(); ++i) {
-                auto pt = ava.jointPos.col(i);
-                jointsXYZ.emplace_back(pt.x(), pt.y(), pt.z());
+            while (static_cast<int>(ids.size()) < batch.size() && que.pop(i)) ids.push_back(i);
+            if (ids.empty()) break;
+            for (size_t b = 0; b < ids.size(); ++b) {
+                Avatar& ava = batch.avatars[b];
+                if (poseSequence.numFrames) {
+                    // random_util::randint<size_t>(0, poseSequence.numFrames - 1)
+                    poseSequence.poseAvatar(ava, seq[ids[b] % poseSequence.numFrames]);
+                    ava.r[0].setIdentity();
+                    ava.randomize(false, true, true);
+                } else {
+                    ava.randomize();
+                }
             }
-            fs3 << "joints_xyz" << jointsXYZ;
-
-            // Also write OpenARK avatar parameters
-            cv::Point3f p(ava.p(0), ava.p(1), ava.p(2));
-            fs3 << "pos" << p;
-
-            std::vector<double> w(model.numShapeKeys());
-            std::copy(ava.w.data(), ava.w.data() + w.size(), w.begin());
-            fs3 << "shape" << w;
-
-            std::vector<double> r(model.numJoints() * 3);
-            for (size_t i = 0; i < ava.r.size(); ++i) {
-                Eigen::AngleAxisd aa;
-                aa.fromRotationMatrix(ava.r[i]);
-                Eigen::Map<Eigen::Vector3d> mp(&r[0] + i*3);
-                mp = aa.axis() * aa.angle();
+            batch.update();
+
+            for (size_t b = 0; b < ids.size(); ++b) {
+                const int i = ids[b];
+                const Avatar& ava = batch.avatars[b];
+                std::stringstream ss_img_id;
+                ss_img_id << std::setw(8) << std::setfill('0') << std::to_string(i);
+
+                ark::AvatarRenderer renderer(ava, intrin);
+
+                const std::string depthImgPath = (depthPath / ("depth_" + ss_img_id.str() + ".exr")).string();
+                cv::imwrite(depthImgPath, renderer.renderDepth(image_size));
+                std::cout << "Wrote " << depthImgPath << std::endl;
+
+                const std::string partMaskImgPath = (partMaskPath / ("part_mask_" + ss_img_id.str() + ".tiff")).string();
+                cv::imwrite(partMaskImgPath, renderer.renderPartMask(image_size, part_map));
+                //std::cout << "Wrote " << partMaskImgPath << std::endl;
+
+                // Output labels
+                const std::vector<cv::Point2f>& joints = renderer.getProjectedJoints();
+                std::vector<cv::Point2i> jointsi;
+                for (auto& pt : joints) jointsi.emplace_back(std::round(pt.x), std::round(pt.y));
+                const std::string jointFilePath = (jointsPath / ("joint_" + ss_img_id.str() + ".yml")).string();
+                cv::FileStorage fs3(jointFilePath, cv::FileStorage::WRITE);
+                fs3 << "joints" << jointsi;
+
+                // Also write xyz positions
+                std::vector<cv::Point3f> jointsXYZ;
+                for (auto i = 0; i < model.numJoints(); ++i) {
+                    auto pt = ava.jointPos.col(i);
+                    jointsXYZ.emplace_back(pt.x(), pt.y(), pt.z());
+                }
+                fs3 << "joints_xyz" << jointsXYZ;
+
+                // Also write OpenARK avatar parameters
+                cv::Point3f p(ava.p(0), ava.p(1), ava.p(2));
+                fs3 << "pos" << p;
+
+                std::vector<double> w(model.numShapeKeys());
+                std::copy(ava.w.data(), ava.w.data() + w.size(), w.begin());
+                fs3 << "shape" << w;
+
+                std::vector<double> r(model.numJoints() * 3);
+                for (size_t i = 0; i < ava.r.size(); ++i) {
+                    Eigen::AngleAxisd aa;
+                    aa.fromRotationMatrix(ava.r[i]);
+                    Eigen::Map<Eigen::Vector3d> mp(&r[0] + i*3);
+                    mp = aa.axis() * aa.angle();
+                }
+                fs3 << "rots" << r;
+
+                // Convert to SMPL parameters
+                Eigen::VectorXd smplParams = ava.smplParams();
+                std::vector<double> smplParamsVec(smplParams.rows());
+                std::copy(smplParams.data(), smplParams.data() + smplParams.rows(), smplParamsVec.begin());
+                fs3 << "smpl_params" << smplParamsVec;
+
+                fs3.release();
+                // std::cout << "Wrote " << jointFilePath << std::endl;
             }
-            fs3 << "rots" << r;
-            
-            // Convert to SMPL parameters
-            Eigen::VectorXd smplParams = ava.smplParams();
-            std::vector<double> smplParamsVec(smplParams.rows());
-            std::copy(smplParams.data(), smplParams.data() + smplParams.rows(), smplParamsVec.begin());
-            fs3 << "smpl_params" << smplParamsVec;
-
-            fs3.release();
-            // std::cout << "Wrote " << jointFilePath << std::endl;
         }
     };
     std::vector<boost::thread> threads;